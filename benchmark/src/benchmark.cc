@@ -57,6 +57,7 @@ static const char help_text[] =
     "  -h, --help            display this help text and exit\n";
 
 #define NUM_METRICS 10000
+#define NUM_POLLS   10
 
 #define METRIC_LEN 10
 #define METRIC_FMT "m%08d"
@@ -77,6 +78,7 @@ public:
     typedef void (Benchmark::*benchmark_fn)();
     void c_api_bench();
     void cpp_api_bench();
+    void publish_bench();
     bool do_read, do_write;
 
 private:
@@ -190,9 +192,77 @@ void Benchmark::cpp_api_bench()
 
         fty::shm::read_metrics(".*", ".*", all_metrics);
         timestamp("readsall");
+
+        // Periodic polling, with and without recycling the fty_proto_t
+        for (i = 0; i < NUM_POLLS; i++) {
+            fty::shm::shmMetrics metrics;
+            fty::shm::read_metrics(".*", ".*", metrics);
+        }
+        timestamp("readsall polls");
+
+        fty::shm::ProtoPool pool;
+        for (i = 0; i < NUM_POLLS; i++) {
+            fty::shm::PooledMetrics metrics(pool);
+            fty::shm::read_metrics(".*", ".*", metrics);
+        }
+        timestamp("readsall polls (pool)");
+
+        fty::shm::shmMetrics parallel_metrics;
+        fty::shm::read_metrics(".*", ".*", parallel_metrics, 0);
+        timestamp("readsall parallel");
     }
 }
 
+// Cost of the publication of the writes, measured against an in-process bus
+void Benchmark::publish_bench()
+{
+    std::vector<std::string> names, values;
+    int                      i;
+
+    names.reserve(NUM_METRICS);
+    values.reserve(NUM_METRICS);
+    for (i = 0; i < NUM_METRICS; i++) {
+        char buf[METRIC_LEN];
+        sprintf(buf, METRIC_FMT, i);
+        names.push_back(buf);
+        sprintf(buf, VALUE_FMT, i);
+        values.push_back(buf);
+    }
+    auto bus = std::make_shared<fty::shm::MockPublishBus>(false);
+    fty::shm::set_publish_bus(bus);
+    timestamp("setup");
+
+    // Each pass writes other values, so that none of the writes is skipped
+    int pass = 0;
+    auto writes = [&]() {
+        std::string suffix(1, char('a' + pass++));
+        for (i = 0; i < NUM_METRICS; i++)
+            fty::shm::write_metric("bench_asset", names[size_t(i)], values[size_t(i)] + suffix, "unit", 300);
+    };
+
+    fty::shm::set_publish_transport(0);
+    writes();
+    timestamp("writes (create)");
+    writes();
+    timestamp("writes (no publish)");
+
+    fty::shm::set_publish_transport(fty::shm::TRANSPORT_MQTT);
+    fty::shm::set_publish_mode(fty::shm::PUBLISH_METRIC);
+    writes();
+    timestamp("writes (publish metric)");
+    fty::shm::flush(-1);
+    timestamp("sent");
+
+    fty::shm::set_publish_mode(fty::shm::PUBLISH_ASSET);
+    writes();
+    timestamp("writes (publish asset)");
+    fty::shm::flush(-1);
+    timestamp("sent");
+
+    std::cout << bus->count() << " messages" << std::endl;
+    fty::shm::set_publish_bus(nullptr);
+}
+
 struct BenchmarkDesc
 {
     Benchmark::benchmark_fn func;
@@ -201,7 +271,8 @@ struct BenchmarkDesc
 
 std::map<std::string, BenchmarkDesc> benchmarks = {
     {"c", {&Benchmark::c_api_bench, "Benchmark fty_shm_{read,write}_metric"}},
-    {"cpp", {&Benchmark::cpp_api_bench, "Benchmark fty::shm::{read,write}_metric"}}};
+    {"cpp", {&Benchmark::cpp_api_bench, "Benchmark fty::shm::{read,write}_metric"}},
+    {"publish", {&Benchmark::publish_bench, "Benchmark fty::shm::write_metric with publishing to a mock bus"}}};
 
 int main(int argc, char** argv)
 {
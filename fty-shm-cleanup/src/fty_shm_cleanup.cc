@@ -22,6 +22,7 @@
 /// fty_shm_cleanup - Garbage collector for fty-shm
 
 #include <iostream>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -29,6 +30,11 @@
 #include <fty_log.h>
 
 #define TTL_LEN 11
+// Age of a compare and swap claim left by a killed writer (seconds), as the
+// library. Also the age of the temporary files of the policies
+#define CLAIM_TIMEOUT 10
+// Histories of the metrics of a family, with the usual ttl header
+#define HISTORY_DIR ".history"
 
 static int parse_ttl(char* ttl_str, time_t& ttl)
 {
@@ -95,10 +101,57 @@ static int clean_outdated_data(std::string filename)
     return 1; // up to date
 }
 
+// Remove the claim of a compare and swap write (".<name>.claim.<inode>.<version>")
+// or the temporary file of a policy (".policy.<pid>") left by a killed or
+// failed writer
+// -1 : remove failed
+//  0 : file removed
+//  1 : file still in use
+static int clean_stale_file(const std::string& filename)
+{
+    struct stat st;
+    if (lstat(filename.c_str(), &st) < 0 || time(nullptr) - st.st_mtime <= CLAIM_TIMEOUT)
+        return 1;
+    if (remove(filename.c_str()) != 0 && errno != ENOENT) {
+        log_error("remove %s failed (%s)", filename.c_str(), strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// false if the policy of the family in directory_path ("cleanup=0" line of
+// its .policy file) keeps its outdated metrics
+static bool cleanup_allowed(const std::string& directory_path)
+{
+    FILE* file = fopen((directory_path + "/.policy").c_str(), "r");
+    if (!file)
+        return true;
+    // Parsed as the library does (load_policy()): "key=value" lines, the
+    // value being a number, the last line of a key winning
+    bool allowed = true;
+    char line[128];
+    while (fgets(line, sizeof(line), file)) {
+        char* value = strchr(line, '=');
+        if (!value)
+            continue;
+        *value++ = '\0';
+        if (strcmp(line, "cleanup") == 0)
+            allowed = strtoul(value, nullptr, 10) != 0;
+    }
+    fclose(file);
+    return allowed;
+}
+
 // cleanup outdated metrics from PATH
 // returns 0 if success, else <0
 static int fty_shm_cleanup(const std::string& directory_path, size_t &removedFilesCnt, bool verbose)
 {
+    if (!cleanup_allowed(directory_path)) {
+        if (verbose) {
+            log_info("shm cleanup directory '%s' skipped (policy)", directory_path.c_str());
+        }
+        return 0;
+    }
     if (verbose) {
         log_info("shm cleanup directory '%s'", directory_path.c_str());
     }
@@ -111,14 +164,35 @@ static int fty_shm_cleanup(const std::string& directory_path, size_t &removedFil
 
     struct dirent *ent;
     while ((ent = readdir(dir)) != nullptr) {
-        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
-            continue;
         std::string filename(directory_path);
         filename.append("/").append(ent->d_name);
-        if (ent->d_type == DT_DIR) { // recursive
+        unsigned char type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(filename.c_str(), &st) == 0)
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        // The dot entries are the state of the library (.auxkeys, .policy,
+        // .updates, .subscribers...), but for the histories, the claims and
+        // the temporary files left by killed writers
+        if (ent->d_name[0] == '.') {
+            if (type == DT_DIR && strcmp(ent->d_name, HISTORY_DIR) == 0) {
+                fty_shm_cleanup(filename, removedFilesCnt, verbose);
+                continue;
+            }
+            if (type != DT_REG)
+                continue;
+            if (strstr(ent->d_name, ".claim.") || strncmp(ent->d_name, ".policy.", 8) == 0) {
+                clean_stale_file(filename);
+                continue;
+            }
+            if (strncmp(ent->d_name, ".tmp.", 5) != 0)
+                continue;
+        }
+        if (type == DT_DIR) { // recursive
             fty_shm_cleanup(filename, removedFilesCnt, verbose);
         }
-        else {
+        else if (type == DT_REG) {
             if (clean_outdated_data(filename) == 0) {
                 removedFilesCnt++;
             }
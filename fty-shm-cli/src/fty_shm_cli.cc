@@ -23,16 +23,27 @@
 #include <czmq.h>
 #include <fty_log.h>
 #include <fty_proto.h>
+#include <inttypes.h>
 #include <malamute.h>
+#include <map>
+#include <poll.h>
+#include <set>
+#include <signal.h>
 #include <string>
 #include <unordered_map>
 
+// Number of threads reading the metrics (--jobs)
+static unsigned read_jobs = 1;
+
 void print_device(const char* device, const char* filter, bool details)
 {
     std::unordered_map<std::string, std::vector<fty_proto_t*>> list;
 
     fty::shm::shmMetrics result;
-    fty::shm::read_metrics(device, filter, result);
+    if (read_jobs == 1)
+        fty::shm::read_metrics(device, filter, result);
+    else
+        fty::shm::read_metrics(device, filter, result, read_jobs);
 
     for (auto& element : result) {
         auto asset = list.find(fty_proto_name(element));
@@ -63,17 +74,399 @@ void print_device(const char* device, const char* filter, bool details)
 
 void list_devices()
 {
-    std::unordered_map<std::string, bool> list;
+    std::vector<std::string> list;
+    fty::shm::list_assets(list, true);
+    for (auto& dev : list) {
+        log_debug("%s", dev.c_str());
+    }
+}
+
+void list_device_metrics(const char* device)
+{
+    std::vector<std::string> list;
+    fty::shm::list_metrics(device, list, true);
+    for (auto& metric : list) {
+        log_debug("%s", metric.c_str());
+    }
+}
+
+// JSON string, escaped as per RFC 8259
+static void s_json_string(FILE* out, const char* str)
+{
+    fputc('"', out);
+    for (const char* p = str; *p; p++) {
+        unsigned char c = static_cast<unsigned char>(*p);
+        switch (c) {
+            case '"':
+                fputs("\\\"", out);
+                break;
+            case '\\':
+                fputs("\\\\", out);
+                break;
+            case '\n':
+                fputs("\\n", out);
+                break;
+            case '\r':
+                fputs("\\r", out);
+                break;
+            case '\t':
+                fputs("\\t", out);
+                break;
+            default:
+                if (c < 0x20)
+                    fprintf(out, "\\u%04x", c);
+                else
+                    fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// CSV field, quoted when needed (RFC 4180)
+static void s_csv_field(FILE* out, const char* str)
+{
+    if (!strpbrk(str, ",\"\r\n")) {
+        fputs(str, out);
+        return;
+    }
+    fputc('"', out);
+    for (const char* p = str; *p; p++) {
+        if (*p == '"')
+            fputc('"', out);
+        fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+// Stream the metrics matching device and filter to stdout, one per line, as
+// they are read: the memory used does not depend on the size of the store
+int export_metrics(const char* format, const char* device, const char* filter)
+{
+    bool csv = streq(format, "csv");
+    if (!csv && !streq(format, "jsonl")) {
+        log_error("Unknown export format '%s' (jsonl or csv)", format);
+        return -1;
+    }
+
+    static char buffer[1 << 16];
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+    if (csv)
+        fputs("asset,metric,value,unit,ttl,time,aux\n", stdout);
+
+    int r = fty::shm::read_metrics(device, filter, [csv](fty_proto_t* metric) {
+        zhash_t* aux = fty_proto_aux(metric);
+        if (csv) {
+            s_csv_field(stdout, fty_proto_name(metric));
+            fputc(',', stdout);
+            s_csv_field(stdout, fty_proto_type(metric));
+            fputc(',', stdout);
+            s_csv_field(stdout, fty_proto_value(metric));
+            fputc(',', stdout);
+            s_csv_field(stdout, fty_proto_unit(metric));
+            fprintf(stdout, ",%" PRIu32 ",%" PRIu64 ",", fty_proto_ttl(metric), fty_proto_time(metric));
+            // aux as key=value;key=value in a single field
+            std::string aux_field;
+            for (char* item = aux ? static_cast<char*>(zhash_first(aux)) : nullptr; item;
+                 item       = static_cast<char*>(zhash_next(aux))) {
+                if (!aux_field.empty())
+                    aux_field.append(";");
+                aux_field.append(zhash_cursor(aux)).append("=").append(item);
+            }
+            s_csv_field(stdout, aux_field.c_str());
+        } else {
+            fputs("{\"asset\":", stdout);
+            s_json_string(stdout, fty_proto_name(metric));
+            fputs(",\"metric\":", stdout);
+            s_json_string(stdout, fty_proto_type(metric));
+            fputs(",\"value\":", stdout);
+            s_json_string(stdout, fty_proto_value(metric));
+            fputs(",\"unit\":", stdout);
+            s_json_string(stdout, fty_proto_unit(metric));
+            fprintf(stdout, ",\"ttl\":%" PRIu32 ",\"time\":%" PRIu64 ",\"aux\":{", fty_proto_ttl(metric),
+                fty_proto_time(metric));
+            bool first = true;
+            for (char* item = aux ? static_cast<char*>(zhash_first(aux)) : nullptr; item;
+                 item       = static_cast<char*>(zhash_next(aux))) {
+                if (!first)
+                    fputc(',', stdout);
+                first = false;
+                s_json_string(stdout, zhash_cursor(aux));
+                fputc(':', stdout);
+                s_json_string(stdout, item);
+            }
+            fputs("}}", stdout);
+        }
+        fputc('\n', stdout);
+        // Stop when the reader is gone
+        return !ferror(stdout);
+    });
+    if (fflush(stdout) != 0 || r < 0)
+        return -1;
+    return 0;
+}
+
+struct WatchedMetric
+{
+    std::string value;
+    std::string unit;
+    uint32_t    ttl         = 0;
+    uint64_t    time        = 0;
+    int         updates     = 0;
+    double      interval    = 0; // smoothed interval between updates [s]
+    double      last_update = 0; // monotonic time of the last update [s]
+    bool        removed     = false;
+};
+
+typedef std::map<std::pair<std::string, std::string>, WatchedMetric> WatchedMetrics;
+
+static volatile sig_atomic_t watch_stop = 0;
+
+static void s_watch_signal(int)
+{
+    watch_stop = 1;
+}
+
+static double s_monotonic()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return double(ts.tv_sec) + double(ts.tv_nsec) / 1e9;
+}
+
+static void s_watch_update(WatchedMetrics& metrics, fty_proto_t* proto, bool notified)
+{
+    WatchedMetric& metric = metrics[{fty_proto_name(proto), fty_proto_type(proto)}];
+    double         now    = s_monotonic();
+
+    if (notified && metric.last_update > 0) {
+        double interval = now - metric.last_update;
+        metric.interval = (metric.interval > 0) ? 0.7 * metric.interval + 0.3 * interval : interval;
+    }
+    metric.value   = fty_proto_value(proto);
+    metric.unit    = fty_proto_unit(proto);
+    metric.ttl     = fty_proto_ttl(proto);
+    metric.time    = fty_proto_time(proto);
+    metric.removed = false;
+    if (notified) {
+        metric.updates++;
+        metric.last_update = now;
+    }
+}
+
+static void s_watch_draw(const WatchedMetrics& metrics, const char* device, const char* filter)
+{
+    time_t now = time(nullptr);
+    double mono = s_monotonic();
+    char   bufftime[sizeof "YYYY-MM-DDTHH:MM:SSZ"];
+    strftime(bufftime, sizeof bufftime, "%FT%TZ", gmtime(&now));
+
+    // Redraw in place: cursor home and clear screen
+    printf("\033[H\033[2J");
+    printf("Watching %s %s - %s (Ctrl-C to quit)\n\n", device, filter, bufftime);
+    printf("%-24s %-32s %24s %8s %8s %8s %10s\n", "DEVICE", "METRIC", "VALUE", "AGE", "TTL", "UPDATES", "RATE/min");
+    for (auto& element : metrics) {
+        const WatchedMetric& metric  = element.second;
+        long                 age     = long(now) - long(metric.time);
+        bool                 expired = metric.removed || (metric.ttl && age > long(metric.ttl));
+        std::string          value   = metric.value + metric.unit;
+
+        // Expired metrics in red, the ones just updated in bold
+        if (expired)
+            printf("\033[31m");
+        else if (metric.updates && mono - metric.last_update < 1)
+            printf("\033[1m");
+        printf("%-24s %-32s %24s %7lds %7" PRIu32 "s %8d ", element.first.first.c_str(), element.first.second.c_str(),
+            value.c_str(), age, metric.ttl, metric.updates);
+        if (metric.interval > 0)
+            printf("%10.1f", 60 / metric.interval);
+        else
+            printf("%10s", "-");
+        printf("%s\033[0m\n", expired ? (metric.removed ? " removed" : " expired") : "");
+    }
+    fflush(stdout);
+}
+
+// Show the metrics matching device and filter, updated in place as they are
+// written. Only the notified metrics are read again, the store is scanned
+// once at start.
+void watch_device(const char* device, const char* filter)
+{
+    WatchedMetrics    metrics;
+    fty::shm::Watcher watcher;
+
+    // Watch before the scan, to miss no update
+    if (watcher.open() < 0) {
+        log_error("Can't watch the metrics (%s)", strerror(errno));
+        return;
+    }
+
+    fty::shm::Filter assetFilter(device), metricFilter(filter);
+    if (!assetFilter.valid() || !metricFilter.valid()) {
+        log_error("Invalid regex");
+        return;
+    }
+
     {
         fty::shm::shmMetrics result;
-        fty::shm::read_metrics(".*", ".*", result);
-
+        fty::shm::read_metrics(device, filter, result);
         for (auto& element : result) {
-            list.insert({{fty_proto_name(element), true}});
+            s_watch_update(metrics, element, false);
         }
     }
-    for (auto& dev : list) {
-        log_debug("%s", dev.first.c_str());
+
+    signal(SIGINT, s_watch_signal);
+    signal(SIGTERM, s_watch_signal);
+
+    double last_draw = 0;
+    while (!watch_stop) {
+        double now = s_monotonic();
+        if (now - last_draw >= 0.5) {
+            s_watch_draw(metrics, device, filter);
+            last_draw = now;
+        }
+
+        struct pollfd pfd = {watcher.fd(), POLLIN, 0};
+        int           r   = poll(&pfd, 1, 500);
+        if (r < 0 && errno != EINTR) {
+            log_error("poll failed (%s)", strerror(errno));
+            break;
+        }
+        if (r <= 0)
+            continue;
+
+        std::set<std::pair<std::string, std::string>> changed;
+        bool                                          overflow = false;
+        watcher.dispatch([&](const std::string& asset, const std::string& metric, bool removed) {
+            if (asset.empty() && metric.empty()) {
+                overflow = true;
+                return;
+            }
+            if (!assetFilter.match(asset) || !metricFilter.match(metric))
+                return;
+            if (removed) {
+                auto it = metrics.find({asset, metric});
+                if (it != metrics.end())
+                    it->second.removed = true;
+                changed.erase({asset, metric});
+            } else {
+                changed.insert({asset, metric});
+            }
+        });
+        if (overflow) {
+            // Updates were lost: scan the store again
+            fty::shm::shmMetrics result;
+            fty::shm::read_metrics(device, filter, result);
+            std::set<std::pair<std::string, std::string>> found;
+            for (auto& element : result) {
+                found.insert({fty_proto_name(element), fty_proto_type(element)});
+                s_watch_update(metrics, element, false);
+            }
+            for (auto& element : metrics) {
+                if (!found.count(element.first))
+                    element.second.removed = true;
+            }
+            changed.clear();
+        }
+        for (auto& element : changed) {
+            fty_proto_t* proto;
+            if (fty::shm::read_metric(element.first, element.second, &proto) == 0) {
+                s_watch_update(metrics, proto, true);
+                fty_proto_destroy(&proto);
+            } else {
+                auto it = metrics.find(element);
+                if (it != metrics.end())
+                    it->second.removed = true;
+            }
+        }
+    }
+    printf("\n");
+}
+
+void print_aggregates(const char* device, const char* filter)
+{
+    std::vector<fty::shm::Aggregate> result;
+    if (fty::shm::aggregate_metrics(device, filter, fty::shm::AGG_ALL, result, true) < 0) {
+        log_error("Can't aggregate the metrics (%s)", strerror(errno));
+        return;
+    }
+    for (auto& aggregate : result) {
+        log_debug("%-30s count=%" PRIu64 " sum=%g min=%g max=%g mean=%g", aggregate.metric.c_str(), aggregate.count,
+            aggregate.sum, aggregate.min, aggregate.max, aggregate.mean);
+    }
+}
+
+void print_history(const char* device, const char* metric)
+{
+    std::vector<fty::shm::MetricSample> samples;
+    if (fty::shm::read_metric_history(device, metric, 0, samples) < 0) {
+        log_error("No history for %s@%s (%s)", metric, device, strerror(errno));
+        return;
+    }
+    for (auto& sample : samples) {
+        char   _bufftime[sizeof "YYYY-MM-DDTHH:MM:SSZ"];
+        time_t _time = time_t(sample.time);
+        strftime(_bufftime, sizeof _bufftime, "%FT%TZ", gmtime(&_time));
+        log_debug("%s %g", _bufftime, sample.value);
+    }
+}
+
+// Print the metric writes as they happen, from the update log
+void tail_updates()
+{
+    fty::shm::UpdateLogReader reader;
+    if (reader.open() < 0) {
+        log_error("Can't open the update log (%s)", strerror(errno));
+        return;
+    }
+
+    signal(SIGINT, s_watch_signal);
+    signal(SIGTERM, s_watch_signal);
+
+    fty::shm::MetricUpdate update;
+    uint64_t               lost = 0;
+    while (!watch_stop) {
+        if (reader.wait(500) <= 0)
+            continue;
+        while (reader.next(update) == 1) {
+            if (reader.lost() != lost) {
+                log_debug("(%" PRIu64 " update(s) lost)", reader.lost() - lost);
+                lost = reader.lost();
+            }
+            char   _bufftime[sizeof "YYYY-MM-DDTHH:MM:SSZ"];
+            time_t _time = time_t(update.time);
+            strftime(_bufftime, sizeof _bufftime, "%FT%TZ", gmtime(&_time));
+            log_debug("%s(ttl=%" PRIu32 "s) %20s@%s = %s%s", _bufftime, update.ttl, update.metric.c_str(),
+                update.asset.c_str(), update.truncated ? "(truncated)" : update.value.c_str(), update.unit.c_str());
+        }
+    }
+}
+
+void print_stats()
+{
+    std::vector<fty::shm::ProcessStats> stats;
+    if (fty::shm::read_shared_stats(stats) < 0) {
+        log_error("Can't read the shared statistics (%s)", strerror(errno));
+        return;
+    }
+    if (stats.empty()) {
+        log_debug("No process shares its statistics (see FTY_SHM_STATS)");
+        return;
+    }
+
+    std::vector<std::pair<std::string, uint64_t>> total;
+    for (auto& process : stats) {
+        log_debug("Process: %s (pid %d)", process.process.c_str(), process.pid);
+        for (size_t i = 0; i < process.counters.size(); i++) {
+            log_debug("\t%-20s %" PRIu64, process.counters[i].first.c_str(), process.counters[i].second);
+            if (i < total.size())
+                total[i].second += process.counters[i].second;
+            else
+                total.push_back(process.counters[i]);
+        }
+    }
+    log_debug("Total: %zu process(es)", stats.size());
+    for (auto& counter : total) {
+        log_debug("\t%-20s %" PRIu64, counter.first.c_str(), counter.second);
     }
 }
 
@@ -122,7 +515,25 @@ int main(int argc, char* argv[])
             puts(
                 "             --details / -d  will print full details metrics (fty_proto style) instead of one line "
                 "style");
-            puts("  --list / -l                print list of devices known to the agent");
+            puts("  --watch / -w device [filter]");
+            puts("                             show the metrics of the device, updated in place as they are");
+            puts("                             written, with their age and update rate");
+            puts("  --export / -e jsonl|csv [device [filter]]");
+            puts("                             stream the metrics (all by default) to stdout, one per line");
+            puts("  --aggregate / -a device [filter]");
+            puts("                             print the count, sum, min, max and mean of the numeric");
+            puts("                             values of each metric of the devices");
+            puts("  --history / -H device metric");
+            puts("                             print the last values of the metric (writers must be");
+            puts("                             started with FTY_SHM_HISTORY=<number of values>)");
+            puts("  --tail / -t                print the metric writes as they happen (writers must be");
+            puts("                             started with FTY_SHM_UPDATE_LOG=ON)");
+            puts("  --list / -l [device]       print list of devices known to the agent,");
+            puts("                             or the metric names of device");
+            puts("  --snapshot <file>          save all the valid metrics in file");
+            puts("  --restore <file>           restore the metrics saved in file (the outdated ones are skipped)");
+            puts("  --stats / -s               print the statistics of the processes using fty-shm");
+            puts("                             (only the processes started with FTY_SHM_STATS=ON)");
             puts("  publish metric <quantity> <element_src> <value> <units> <ttl>");
             puts("                         publish metric on shm");
             puts("                         <quantity> a string name for the metric type");
@@ -134,14 +545,85 @@ int main(int argc, char* argv[])
             puts("                         <ttl>   a number time to leave [s]");
             puts("                         Auxilary data:");
             puts("                             quantity=Y, where Y is value");
+            puts("  --jobs / -j <n>            read the metrics with n threads (0 for one per CPU)");
             puts("  --verbose / -v             verbose output");
             puts("  --help / -h                this information");
             printf("  (Logger: %s)\n", LOGGER.c_str());
             break;
         } else if (streq(argv[argn], "--verbose") || streq(argv[argn], "-v")) {
             ManageFtyLog::getInstanceFtylog()->setVerboseMode();
+        } else if (streq(argv[argn], "--jobs") || streq(argv[argn], "-j")) {
+            if (argn + 1 >= argc || sscanf(argv[argn + 1], "%u", &read_jobs) != 1) {
+                log_error("Missing number of jobs.");
+                retvalue = 1;
+                break;
+            }
+            argn++;
         } else if (streq(argv[argn], "--list") || streq(argv[argn], "-l")) {
-            list_devices();
+            if (argn + 1 < argc)
+                list_device_metrics(argv[argn + 1]);
+            else
+                list_devices();
+            break;
+        } else if (streq(argv[argn], "--watch") || streq(argv[argn], "-w")) {
+            if (argn + 1 >= argc) {
+                log_error("Missing argument.");
+                retvalue = 1;
+                break;
+            }
+            const char* device = argv[argn + 1];
+            const char* filter = (argn + 2 < argc) ? argv[argn + 2] : ".*";
+            watch_device(device, filter);
+            break;
+        } else if (streq(argv[argn], "--export") || streq(argv[argn], "-e")) {
+            if (argn + 1 >= argc) {
+                log_error("Missing export format.");
+                retvalue = 1;
+                break;
+            }
+            const char* format = argv[argn + 1];
+            const char* device = (argn + 2 < argc) ? argv[argn + 2] : ".*";
+            const char* filter = (argn + 3 < argc) ? argv[argn + 3] : ".*";
+            if (export_metrics(format, device, filter) < 0)
+                retvalue = 1;
+            break;
+        } else if (streq(argv[argn], "--snapshot") || streq(argv[argn], "--restore")) {
+            bool save = streq(argv[argn], "--snapshot");
+            if (argn + 1 >= argc) {
+                log_error("Missing snapshot file.");
+                retvalue = 1;
+                break;
+            }
+            const char* path = argv[argn + 1];
+            int r = save ? fty::shm::save_snapshot(path) : fty::shm::restore_snapshot(path);
+            if (r < 0) {
+                log_error("Can't %s snapshot %s (%s)", save ? "save" : "restore", path, strerror(errno));
+                retvalue = 1;
+            } else {
+                log_info("%d metric(s) %s", r, save ? "saved" : "restored");
+            }
+            break;
+        } else if (streq(argv[argn], "--aggregate") || streq(argv[argn], "-a")) {
+            if (argn + 1 >= argc) {
+                log_error("Missing argument.");
+                retvalue = 1;
+                break;
+            }
+            print_aggregates(argv[argn + 1], (argn + 2 < argc) ? argv[argn + 2] : ".*");
+            break;
+        } else if (streq(argv[argn], "--history") || streq(argv[argn], "-H")) {
+            if (argn + 2 >= argc) {
+                log_error("Missing argument.");
+                retvalue = 1;
+                break;
+            }
+            print_history(argv[argn + 1], argv[argn + 2]);
+            break;
+        } else if (streq(argv[argn], "--tail") || streq(argv[argn], "-t")) {
+            tail_updates();
+            break;
+        } else if (streq(argv[argn], "--stats") || streq(argv[argn], "-s")) {
+            print_stats();
             break;
         } else if (streq(argv[argn], "publish") || streq(argv[argn], "pub")) {
             char* token = argv[++argn];
@@ -200,7 +682,11 @@ int main(int argc, char* argv[])
             }
             fty_proto_destroy(&bmsg);
             zhash_destroy(&aux);
-            // to get all the threads behind enough time to send it
+            // the metric is sent by the thread of the library
+            if (fty::shm::shutdown() < 0) {
+                log_error("Can't publish the metric %s@%s", quantity, element_src);
+                retvalue = 1;
+            }
         } else {
             bool details = false;
             if (streq(argv[argn], "--details") || streq(argv[argn], "-d")) {
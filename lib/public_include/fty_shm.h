@@ -22,6 +22,7 @@
 #pragma once
 
 #include <fty_proto.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -49,6 +50,40 @@ int fty_shm_write_metric_proto(fty_proto_t* metric);
 // Returns 0 on success. On error, returns -1 and sets errno accordingly
 int fty_shm_read_metric(const char* asset, const char* metric, char** value, char** unit);
 
+// A metric seen by fty_shm_for_each_metric(). The strings are borrowed for
+// the duration of the callback only. The aux data is not read.
+typedef struct
+{
+    const char* asset;
+    const char* metric;
+    const char* value;
+    const char* unit;
+    uint32_t    ttl;
+    uint64_t    time;
+} fty_shm_metric_view_t;
+
+// Called for each metric of fty_shm_for_each_metric(), with the arg given to
+// it. Returns 0 to go on, anything else to stop the scan.
+typedef int (*fty_shm_metric_callback_t)(const fty_shm_metric_view_t* metric, void* arg);
+
+// Call callback for each valid metric whose asset and metric names match the
+// asset and metric regex, while scanning the store: nothing is collected, so
+// any number of metrics is read in constant memory.
+// Returns 0 on success. On error, returns -1 and sets errno accordingly
+int fty_shm_for_each_metric(const char* asset, const char* metric, fty_shm_metric_callback_t callback, void* arg);
+
+// The writes are published on the message bus by a thread of the library,
+// which connects to the broker in the background: a write only queues its
+// messages, and never waits for the broker. fty_shm_init() starts the thread
+// before the first write; calling it is optional. fty_shm_flush() waits at
+// most timeout_ms (forever if < 0) for the queued messages to be sent.
+// fty_shm_shutdown() flushes for at most a second, then stops the thread and
+// drops what is left; it is done at exit otherwise.
+// Return 0 on success. On timeout, return -1 and set errno to ETIMEDOUT
+int fty_shm_init(void);
+int fty_shm_flush(int timeout_ms);
+int fty_shm_shutdown(void);
+
 // Use a custom storage directory for test purposes (the passed string must
 // not be freed)
 int fty_shm_set_test_dir(const char* dir);
@@ -64,12 +99,74 @@ void fty_shm_test(bool verbose);
 // requires the caller to provide a container for the results instead of
 // relying on RVO -- but it should be good enough for now.
 
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace fty::shm {
 
+// Recycles the fty_proto_t of bulk reads, with their aux hash, so that
+// periodic reads into a PooledMetrics tied to the pool stop allocating them.
+// It is thread safe.
+class ProtoPool
+{
+public:
+    // At most max_size spare metrics are kept
+    explicit ProtoPool(size_t max_size = 4096);
+    ~ProtoPool();
+    ProtoPool(const ProtoPool&) = delete;
+    ProtoPool& operator=(const ProtoPool&) = delete;
+
+    // A metric from the pool (with no aux), or a new one
+    fty_proto_t* acquire();
+    // Give back a metric, the pool now owns it
+    void release(fty_proto_t* metric);
+    // Number of spare metrics
+    size_t size();
+
+private:
+    std::mutex                m_mutex;
+    std::vector<fty_proto_t*> m_free;
+    size_t                    m_max_size;
+};
+
+// Name filter of the metric queries. The std::string filters of the queries
+// are regex (ECMAScript, matching the whole name): the ones which are in fact
+// literals ("ups-42"), prefixes ("realpower.*"), patterns of literals, '.'
+// and ".*", or alternatives of literals ("ups-1|ups-2") are matched without
+// the regex engine. Copies share the compiled filter.
+class Filter
+{
+public:
+    // Matches any name
+    Filter();
+    // Regex filter, not valid() if the regex can't be compiled
+    explicit Filter(const std::string& regex);
+    // Shell pattern: '*', '?' and [...] as in fnmatch(3)
+    static Filter glob(const std::string& pattern);
+    // Matches exactly one of names
+    static Filter names(const std::vector<std::string>& names);
+
+    bool               valid() const;
+    const std::string& pattern() const;
+    bool               match(const char* name, size_t len) const;
+    bool               match(const std::string& name) const
+    {
+        return match(name.data(), name.size());
+    }
+
+    struct Impl;
+
+private:
+    explicit Filter(std::shared_ptr<const Impl> impl);
+
+    std::shared_ptr<const Impl> m_impl;
+};
+
 class shmMetrics
 {
 public:
@@ -103,15 +200,128 @@ public:
         return m_metricsVector.end();
     }
 
-private:
+protected:
     std::vector<fty_proto_t*> m_metricsVector;
 };
 
+// shmMetrics whose metrics are taken from pool by the reads, and given back
+// to it on destruction. A type of its own, so that the layout of shmMetrics
+// is the one the existing binaries know.
+class PooledMetrics : public shmMetrics
+{
+public:
+    explicit PooledMetrics(ProtoPool& pool);
+    ~PooledMetrics();
+    ProtoPool* pool() const;
+
+private:
+    ProtoPool* m_pool;
+};
+
 // C++ versions of fty_shm_write_metric()
 int write_metric(fty_proto_t* metric);
 int write_metric(
     const std::string& asset, const std::string& metric, const std::string& value, const std::string& unit, int ttl);
 
+// Write several metrics at once. With bundle set, the metrics of each asset
+// are stored together in a single bundle file, read back in one syscall by
+// the scans; it replaces the previous bundle of the asset as a unit, so pass
+// all the metrics of an asset each time. The metrics of an asset should be
+// written either one way or the other, not both.
+// Returns 0 on success. On error, returns -1 and sets errno accordingly (the
+// other metrics of the batch are written anyway)
+int write_metrics(const std::vector<fty_proto_t*>& metrics, bool bundle = false);
+
+// How the writes are published on the message bus. PUBLISH_METRIC, the
+// default, sends one message per metric on "/etn/metrics/<asset>/<metric>".
+// PUBLISH_ASSET sends the metrics of an asset written by one write_metrics()
+// call, or within window_ms of the first one, in a single message on
+// "/etn/metrics/<asset>" (the last write of a metric in the window wins).
+// PUBLISH_BOTH sends both, for the subscribers of either. FTY_SHM_PUBLISH
+// ("metric", "asset" or "both") and FTY_SHM_PUBLISH_WINDOW (in ms) set them
+// at start.
+enum PublishMode
+{
+    PUBLISH_METRIC,
+    PUBLISH_ASSET,
+    PUBLISH_BOTH
+};
+void set_publish_mode(PublishMode mode, unsigned window_ms = 100);
+
+// Transports of the publications, or-ed together. TRANSPORT_MQTT, the
+// default, goes through the broker. TRANSPORT_LOCAL sends each write to the
+// LocalSubscriber of the host, in a datagram, and needs no broker.
+// FTY_SHM_TRANSPORT ("mqtt", "local" or "both") sets them at start.
+enum PublishTransport
+{
+    TRANSPORT_MQTT  = 0x01,
+    TRANSPORT_LOCAL = 0x02
+};
+void set_publish_transport(unsigned transports);
+
+// Lifecycle of the publications, see fty_shm_init()
+int init();
+int flush(int timeout_ms);
+int shutdown(int timeout_ms = 1000);
+
+// Where the publications are sent, the MQTT broker by default. The methods
+// are called from the thread of the publisher only. They return 0 on
+// success; on error, they return -1 and fill error.
+class PublishBus
+{
+public:
+    virtual ~PublishBus() = default;
+    // Called again, with a backoff, until it succeeds
+    virtual int connect(std::string& error) = 0;
+    virtual int send(const std::string& topic, const std::string& payload, std::string& error) = 0;
+};
+// Send the publications to bus (to the broker if nullptr), once the messages
+// queued are flushed to the previous one (see shutdown())
+void set_publish_bus(std::shared_ptr<PublishBus> bus);
+
+// In-process bus, to test or measure the publications without a broker. It
+// keeps the messages sent if record is set, and only counts them otherwise.
+class MockPublishBus : public PublishBus
+{
+public:
+    struct Message
+    {
+        std::string topic;
+        std::string payload;
+    };
+
+    explicit MockPublishBus(bool record = true);
+    int connect(std::string& error) override;
+    int send(const std::string& topic, const std::string& payload, std::string& error) override;
+
+    // Messages sent so far
+    size_t count() const;
+    // Copy of the messages recorded, in the order they were sent
+    std::vector<Message> messages() const;
+    void                 clear();
+
+private:
+    bool                 m_record;
+    mutable std::mutex   m_mutex;
+    size_t               m_count;
+    std::vector<Message> m_messages;
+};
+
+// Conditional writes, for the metrics having several writers (redundant
+// collectors): the metric is stored with a version, and replaced only by a
+// more recent one. No lock is taken, a writer never waits for another.
+// write_metric_if_newer() writes metric with version (a source timestamp, a
+// sequence number...) if the stored one is older. compare_and_write_metric()
+// writes it with version expected + 1 if the stored one is expected.
+// A missing or outdated metric, or one written by write_metric(), has the
+// version 0. A metric should be written by one of them only.
+// Returns 0 on success. On error, returns -1 and sets errno accordingly
+// (ECANCELED if the metric was not replaced)
+int write_metric_if_newer(fty_proto_t* metric, uint64_t version);
+int compare_and_write_metric(fty_proto_t* metric, uint64_t expected);
+// Version of a stored metric (see write_metric_if_newer())
+int read_metric_version(const std::string& asset, const std::string& metric, uint64_t& version);
+
 // C++ version of fty_shm_read_metric()
 int read_metric_value(const std::string& asset, const std::string& metric, std::string& value);
 
@@ -122,6 +332,345 @@ int read_metric(const std::string& asset, const std::string& metric, fty_proto_t
 // on success : fill result with the metrics still valid who matches the asset
 // and metric filters.
 int read_metrics(const std::string& asset, const std::string& metric, shmMetrics& result);
+int read_metrics(const std::string& asset, const std::string& metric, PooledMetrics& result);
+
+// Same as read_metrics() with compiled filters (see Filter)
+int read_metrics(const Filter& asset, const Filter& metric, shmMetrics& result);
+int read_metrics(const Filter& asset, const Filter& metric, PooledMetrics& result);
+
+// Parallel version of read_metrics(), for large stores: the directory
+// entries are read by up to threads workers (0 for one per CPU), each of
+// them taking at least a few hundred entries. The result is the same, in
+// the same order.
+int read_metrics(const std::string& asset, const std::string& metric, shmMetrics& result, unsigned threads);
+int read_metrics(const std::string& asset, const std::string& metric, PooledMetrics& result, unsigned threads);
+
+// Aggregates to compute with aggregate_metrics(), or-ed together
+enum AggregateOp
+{
+    AGG_COUNT = 0x01,
+    AGG_SUM   = 0x02,
+    AGG_MIN   = 0x04,
+    AGG_MAX   = 0x08,
+    AGG_MEAN  = 0x10,
+    AGG_ALL   = 0x1f
+};
+
+// Aggregates of the numeric values of a group of metrics. The aggregates
+// not asked for, and those of a group without numeric value, are NaN.
+struct Aggregate
+{
+    // Metric name of the group, empty when the metrics are not grouped
+    std::string metric;
+    // Number of numeric values, and of values which are not numbers
+    uint64_t count;
+    uint64_t skipped;
+    double   sum;
+    double   min;
+    double   max;
+    double   mean;
+};
+
+// Aggregate the values of the valid metrics matching the asset and metric
+// filters, all together or grouped by metric name (sorted by name), without
+// building the metrics for the caller.
+// Returns 0 on success, -1 on error
+int aggregate_metrics(const std::string& asset, const std::string& metric, unsigned ops,
+    std::vector<Aggregate>& result, bool by_metric = false);
+
+// A sample of the history of a metric
+struct MetricSample
+{
+    uint64_t time;
+    double   value;
+};
+
+// Fill samples with the history of a metric of the default family, oldest
+// first, from time since on (0 for all of it). Writers started with
+// FTY_SHM_HISTORY=<n> keep the last n numeric values of each metric they
+// write in the default family, the other families have no history.
+// Returns 0 on success. On error, returns -1 and sets errno accordingly
+// (ENOENT if the metric has no history, ESTALE if it is outdated)
+int read_metric_history(
+    const std::string& asset, const std::string& metric, uint64_t since, std::vector<MetricSample>& samples);
+
+// Cache the metrics read by this process, within budget bytes (0, the
+// default, disables the cache; FTY_SHM_READ_CACHE sets it in KiB at start).
+// A cached metric is served as long as its file is unchanged, which is
+// checked with a stat, or with an inotify watch of the store if notify is
+// set: hits then cost one non-blocking read of the watch instead of a path
+// lookup and stat. The ttl is honoured as without the cache, and the least
+// recently used metrics are dropped first.
+void set_read_cache(size_t budget, bool notify = false);
+
+// Called for each metric of a streaming read. The fty_proto_t is lent for
+// the duration of the call only (do not destroy or keep it). Return false to
+// stop the read.
+typedef std::function<bool(fty_proto_t* metric)> MetricVisitor;
+
+// Streaming version of read_metrics(): visit the valid metrics matching the
+// asset and metric filters while scanning, without collecting them.
+int read_metrics(const std::string& asset, const std::string& metric, const MetricVisitor& visitor);
+
+int read_metrics(const Filter& asset, const Filter& metric, const MetricVisitor& visitor);
+
+typedef fty_shm_metric_view_t MetricView;
+
+// Called for each metric of for_each_metric(), return false to stop
+typedef std::function<bool(const MetricView& metric)> MetricViewVisitor;
+
+// C++ version of fty_shm_for_each_metric(): visit the valid metrics matching
+// the asset and metric filters as views, without building fty_proto_t
+int for_each_metric(const std::string& asset, const std::string& metric, const MetricViewVisitor& visitor);
+int for_each_metric(const Filter& asset, const Filter& metric, const MetricViewVisitor& visitor);
+
+// Policy of a family of metrics (see Family)
+struct FamilyPolicy
+{
+    // Longest ttl of the metrics written (0 for no limit): longer ttls, and
+    // infinite ones, are cut to it
+    uint32_t max_ttl = 0;
+    // Publish the writes on the message bus
+    bool publish = true;
+    // Remove the outdated metrics, when read and in fty-shm-cleanup
+    bool cleanup = true;
+};
+
+// Create family if needed, and set its policy (shared by all processes)
+// Returns 0 on success. On error, returns -1 and sets errno accordingly
+int set_family_policy(const std::string& family, const FamilyPolicy& policy);
+// Get the policy of family, the default one if it was never set
+int get_family_policy(const std::string& family, FamilyPolicy& policy);
+// Fill families with the sorted names of the families of the store
+int list_families(std::vector<std::string>& families);
+
+// A family of metrics: a directory of its own in the store, so that fast
+// changing metrics are not scanned along with slow data, with its own policy.
+// The functions outside of Family work on FTY_SHM_METRIC_TYPE. The reads of
+// the family "*" go through all the families.
+class Family
+{
+public:
+    explicit Family(const std::string& name);
+
+    const std::string& name() const
+    {
+        return m_name;
+    }
+    // False if the name can't be a family ('/' in it, starting with '.')
+    bool valid() const;
+
+    // Same as the functions of the same name, in the family. The family
+    // directory is created by the first write.
+    int write_metric(fty_proto_t* metric);
+    int write_metric(const std::string& asset, const std::string& metric, const std::string& value,
+        const std::string& unit, int ttl);
+    int read_metric_value(const std::string& asset, const std::string& metric, std::string& value);
+    int read_metric(const std::string& asset, const std::string& metric, fty_proto_t** proto_metric);
+    int read_metrics(const Filter& asset, const Filter& metric, shmMetrics& result);
+    int read_metrics(const Filter& asset, const Filter& metric, PooledMetrics& result);
+    int for_each_metric(const Filter& asset, const Filter& metric, const MetricViewVisitor& visitor);
+
+private:
+    std::string m_name;
+};
+
+// Fill assets with the sorted names of the assets having metrics, answered
+// from the directory entry names only. If check_ttl is set, only the assets
+// with at least one valid metric are listed (this reads the ttl header of
+// the metric files, but never parses them)
+int list_assets(std::vector<std::string>& assets, bool check_ttl = false);
+
+// Same as list_assets() for the metric names of an asset (the records of a
+// bundle are read to get them)
+int list_metrics(const std::string& asset, std::vector<std::string>& metrics, bool check_ttl = false);
+
+// Save all the valid metrics, with their timestamp, ttl and aux data, in a
+// single snapshot file. Returns the number of metrics saved, -1 on error
+int save_snapshot(const std::string& path);
+
+// Reload a snapshot in one pass. Metrics keep their original timestamp so
+// they expire on their own; the outdated ones and the ones written again
+// since the snapshot are skipped. Restored metrics are not published.
+// Returns the number of metrics restored, -1 on error
+int restore_snapshot(const std::string& path);
+
+// Change notifications of the metric store, to use in an event loop:
+// poll() fd() for POLLIN, then call dispatch(). The callback gets the asset
+// and metric names of each metric written or removed since the last call.
+// The removal of a bundle is notified once for the asset, with an empty
+// metric name. A metric moved away but replaced meanwhile (as the
+// conditional writes swap the files) is notified as written. When the
+// kernel queue overflowed, the callback is called once with empty asset and
+// metric names: notifications were lost, and the metrics watched have to be
+// read again.
+class Watcher
+{
+public:
+    typedef std::function<void(const std::string& asset, const std::string& metric, bool removed)> Callback;
+
+    Watcher();
+    ~Watcher();
+    Watcher(const Watcher&) = delete;
+    Watcher& operator=(const Watcher&) = delete;
+
+    // Start watching. Returns 0 on success, -1 on error (errno is set)
+    int open();
+    int fd() const;
+    // Returns the number of notifications processed, -1 on error
+    int dispatch(const Callback& callback);
+
+private:
+    int m_fd;
+};
+
+// Asynchronous reads for event loops. The metric files of a request are
+// opened, read and closed in batches through io_uring, a few syscalls for
+// thousands of metrics, without blocking the caller. Where io_uring is not
+// available, the requests are served synchronously when queued, and their
+// callbacks still called from dispatch().
+// Usage: queue requests, poll() fd() for POLLIN, then call dispatch().
+class AsyncReader
+{
+public:
+    // Called once all the reads of a request are done, with the valid
+    // metrics found. result only lives for the duration of the call (use
+    // getDup() to keep some metrics).
+    typedef std::function<void(shmMetrics& result)>          Callback;
+    typedef std::vector<std::pair<std::string, std::string>> Keys;
+
+    AsyncReader();
+    ~AsyncReader();
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+
+    // Set up the engine, with at most depth reads in flight. Returns 0 on
+    // success, -1 on error (errno is set)
+    int open(unsigned depth = 256);
+    // Whether io_uring is used
+    bool async() const;
+    int  fd() const;
+
+    // Queue the read of the metrics matching the asset and metric filters,
+    // as read_metrics() does. Returns 0 on success, -1 on error
+    int read_metrics(const std::string& asset, const std::string& metric, Callback callback);
+    // Queue the read of the metrics of keys (asset, metric); the missing or
+    // outdated ones are left out of the result
+    int read_metrics(const Keys& keys, Callback callback);
+
+    // Reap the completed reads, submit the next ones, and call the callbacks
+    // of the finished requests. Returns their number, -1 on error
+    int dispatch();
+    // Block until all the queued requests are finished
+    int wait();
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
+// A metric write, as recorded in the update log
+struct MetricUpdate
+{
+    // Position in the log (0 for the updates of a LocalSubscriber)
+    uint64_t    seq;
+    std::string asset;
+    std::string metric;
+    std::string value;
+    std::string unit;
+    uint32_t    ttl;
+    uint64_t    time;
+    // Value and unit were too long for the log, read the metric to get them
+    bool truncated;
+};
+
+struct UpdateRing;
+
+// Tail of the update log. Writers started with FTY_SHM_UPDATE_LOG=ON also
+// append each update to a ring of a few thousand entries in shared memory,
+// the newest overwriting the oldest, without any lock. Readers follow it
+// from their own cursor, and learn how many updates they missed when they
+// are too slow.
+class UpdateLogReader
+{
+public:
+    UpdateLogReader();
+    ~UpdateLogReader();
+    UpdateLogReader(const UpdateLogReader&) = delete;
+    UpdateLogReader& operator=(const UpdateLogReader&) = delete;
+
+    // Map the log (created if needed), the cursor at its end: only the
+    // updates to come are read. Returns 0 on success, -1 on error (errno is
+    // set)
+    int open();
+    // Position of the next update to read
+    uint64_t cursor() const;
+    // Move the cursor, e.g. back to a saved one. The updates already
+    // overwritten are counted as lost by the next read
+    void seek(uint64_t cursor);
+    // Number of updates overwritten before this reader could get them
+    uint64_t lost() const;
+
+    // Returns 1 if update is filled with the next update, 0 if there is none
+    // yet, -1 on error
+    int next(MetricUpdate& update);
+    // Block until there are updates to read or timeout_ms (-1 for none)
+    // elapsed. Returns 1 if there are, 0 if not, -1 on error
+    int wait(int timeout_ms);
+
+private:
+    UpdateRing* m_ring;
+    size_t      m_size;
+    uint64_t    m_cursor;
+    uint64_t    m_lost;
+};
+
+// Subscription to the writes published on the local transport (see
+// set_publish_transport()): the writers send each update matching the
+// filters of the subscriber in a datagram on its socket, without any broker.
+// A subscriber too slow to read its socket loses the updates.
+class LocalSubscriber
+{
+public:
+    LocalSubscriber();
+    ~LocalSubscriber();
+    LocalSubscriber(const LocalSubscriber&) = delete;
+    LocalSubscriber& operator=(const LocalSubscriber&) = delete;
+
+    // Subscribe to the writes of the metrics matching the asset and metric
+    // regex (see Filter). Returns 0 on success, -1 on error (errno is set)
+    int open(const std::string& asset = ".*", const std::string& metric = ".*");
+    void close();
+    // Socket to poll for POLLIN along with other sources
+    int fd() const;
+
+    // Returns 1 if update is filled with the next update, 0 if there is none
+    // yet, -1 on error
+    int next(MetricUpdate& update);
+    // Block until there are updates to read or timeout_ms (-1 for none)
+    // elapsed. Returns 1 if there are, 0 if not, -1 on error
+    int wait(int timeout_ms);
+
+private:
+    int         m_fd;
+    std::string m_path;
+    std::string m_buffer;
+};
+
+// Hot path statistics of a process: operation, error and syscall counters
+struct ProcessStats
+{
+    int                                           pid;
+    std::string                                   process;
+    std::vector<std::pair<std::string, uint64_t>> counters;
+};
+
+// Get the counters of the calling process
+void get_stats(ProcessStats& stats);
+
+// Append the counters of every running process which shares them (see
+// FTY_SHM_STATS) to result. Returns 0 on success, -1 on error
+int read_shared_stats(std::vector<ProcessStats>& result);
 
 } // namespace fty::shm
 
@@ -0,0 +1,134 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Aggregates of the metric values, computed in the library
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include <map>
+#include <math.h>
+#include <stdlib.h>
+
+// The scan goes through for_each_metric() (no aux is parsed, and no
+// fty_proto_t is built), and parses the values of each group in a column of
+// doubles. Then the reductions run over the columns. Their loops keep LANES
+// independent accumulators, so that the compiler vectorizes them without
+// reordering the floating point operations of a single accumulator.
+
+#define LANES 4
+
+using namespace fty::shm;
+
+void aggregate_column(const double* values, size_t count, unsigned ops, Aggregate& aggregate)
+{
+    aggregate.count = count;
+    aggregate.sum   = NAN;
+    aggregate.min   = NAN;
+    aggregate.max   = NAN;
+    aggregate.mean  = NAN;
+    if (count == 0)
+        return;
+
+    size_t body = count - count % LANES;
+    if (ops & (AGG_SUM | AGG_MEAN)) {
+        double lanes[LANES] = {0};
+        for (size_t i = 0; i < body; i += LANES) {
+            for (int l = 0; l < LANES; l++)
+                lanes[l] += values[i + size_t(l)];
+        }
+        double sum = 0;
+        for (int l = 0; l < LANES; l++)
+            sum += lanes[l];
+        for (size_t i = body; i < count; i++)
+            sum += values[i];
+        if (ops & AGG_SUM)
+            aggregate.sum = sum;
+        if (ops & AGG_MEAN)
+            aggregate.mean = sum / double(count);
+    }
+    if (ops & (AGG_MIN | AGG_MAX)) {
+        double mins[LANES], maxs[LANES];
+        for (int l = 0; l < LANES; l++)
+            mins[l] = maxs[l] = values[0];
+        for (size_t i = 0; i < body; i += LANES) {
+            for (int l = 0; l < LANES; l++) {
+                double v = values[i + size_t(l)];
+                mins[l]  = v < mins[l] ? v : mins[l];
+                maxs[l]  = v > maxs[l] ? v : maxs[l];
+            }
+        }
+        double min = mins[0], max = maxs[0];
+        for (int l = 1; l < LANES; l++) {
+            min = mins[l] < min ? mins[l] : min;
+            max = maxs[l] > max ? maxs[l] : max;
+        }
+        for (size_t i = body; i < count; i++) {
+            min = values[i] < min ? values[i] : min;
+            max = values[i] > max ? values[i] : max;
+        }
+        if (ops & AGG_MIN)
+            aggregate.min = min;
+        if (ops & AGG_MAX)
+            aggregate.max = max;
+    }
+}
+
+namespace {
+
+struct Column
+{
+    std::vector<double> values;
+    uint64_t            skipped = 0;
+};
+
+void add_value(Column& column, const char* value)
+{
+    char*  end;
+    double number = strtod(value, &end);
+    // NaN would poison the whole group
+    if (end == value || *end != '\0' || isnan(number))
+        column.skipped++;
+    else
+        column.values.push_back(number);
+}
+
+} // namespace
+
+int fty::shm::aggregate_metrics(const std::string& asset, const std::string& metric, unsigned ops,
+    std::vector<Aggregate>& result, bool by_metric)
+{
+    // Sorted by metric name
+    std::map<std::string, Column> columns;
+    Column*                       single = by_metric ? nullptr : &columns[""];
+    if (for_each_metric(asset, metric, [&columns, single](const MetricView& view) {
+            add_value(single ? *single : columns[view.metric], view.value);
+            return true;
+        }) < 0)
+        return -1;
+
+    result.clear();
+    for (auto& column : columns) {
+        Aggregate aggregate;
+        aggregate.metric = column.first;
+        aggregate_column(column.second.values.data(), column.second.values.size(), ops, aggregate);
+        aggregate.skipped = column.second.skipped;
+        result.push_back(aggregate);
+    }
+    return 0;
+}
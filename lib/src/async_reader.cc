@@ -0,0 +1,609 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Asynchronous batch reads through io_uring
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include "stats.h"
+#include <deque>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <list>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Each metric file takes two submissions: openat, then statx, read and close
+// linked together (hard links, so that close always runs). The rings are
+// set up with the raw syscalls, there is no need for liburing. Bundles are
+// read synchronously when a request is queued, they are a single file per
+// asset anyway.
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define FTY_SHM_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+// Most metrics fit, the others are read again synchronously
+#define READ_BUF_SIZE 1024
+
+using namespace fty::shm;
+
+namespace {
+
+struct Request;
+
+// Read of one metric file
+struct FileRead
+{
+    Request*     request;
+    std::string  filename;
+    std::string  asset;
+    std::string  metric;
+    int          fd    = -1;
+    int          error = 0;
+    int          len   = 0;
+    int          steps = 0; // completions left
+    fty_proto_t* proto = nullptr;
+#ifdef FTY_SHM_HAVE_IO_URING
+    struct statx stx;
+#endif
+    char buf[READ_BUF_SIZE];
+};
+
+struct Request
+{
+    AsyncReader::Callback callback;
+    size_t                left = 0;
+    // In the order of the directory, as read_metrics() does
+    std::vector<std::unique_ptr<FileRead>> reads;
+    std::vector<fty_proto_t*>              bundled;
+};
+
+void set_names(FileRead& read)
+{
+    fty_proto_set_name(read.proto, "%s", read.asset.c_str());
+    fty_proto_set_type(read.proto, "%s", read.metric.c_str());
+}
+
+// The synchronous path, also for a file which did not fit in the buffer or a
+// metric stored in a bundle
+void read_sync(FileRead& read)
+{
+    read.proto = fty_proto_new(FTY_PROTO_METRIC);
+    if (read_data_metric(read.filename.c_str(), read.proto) < 0) {
+        fty_proto_destroy(&read.proto);
+        return;
+    }
+    set_names(read);
+}
+
+#ifdef FTY_SHM_HAVE_IO_URING
+
+// Parse a completed file read
+void finish_read(FileRead& read)
+{
+    if (read.error == ENOENT || (read.error == 0 && read.len >= READ_BUF_SIZE - 1)) {
+        read_sync(read);
+        return;
+    }
+    if (read.error) {
+        stat_add(STAT_READ_ERROR);
+        return;
+    }
+    read.buf[read.len] = '\0';
+    stat_add(STAT_BYTES_READ, uint64_t(read.len));
+    read.proto = fty_proto_new(FTY_PROTO_METRIC);
+    if (parse_metric_data(read.filename.c_str(), read.buf, size_t(read.len), time_t(read.stx.stx_mtime.tv_sec),
+            read.proto) < 0) {
+        if (errno != ESTALE)
+            stat_add(STAT_READ_ERROR);
+        fty_proto_destroy(&read.proto);
+        return;
+    }
+    stat_add(STAT_READ);
+    set_names(read);
+}
+
+class Uring
+{
+public:
+    ~Uring();
+    int  setup(unsigned entries, int event_fd);
+    // Free submission slots
+    unsigned space() const;
+    struct io_uring_sqe* get_sqe();
+    int                  submit(unsigned min_complete);
+    template <typename F>
+    unsigned reap(F func);
+    unsigned cq_entries() const
+    {
+        return m_cq_entries;
+    }
+
+private:
+    int                  m_fd = -1;
+    void*                m_sq_ptr = MAP_FAILED;
+    void*                m_cq_ptr = MAP_FAILED;
+    size_t               m_sq_size = 0;
+    size_t               m_cq_size = 0;
+    struct io_uring_sqe* m_sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    size_t               m_sqes_size = 0;
+    unsigned*            m_sq_head;
+    unsigned*            m_sq_tail;
+    unsigned*            m_sq_mask;
+    unsigned*            m_sq_array;
+    unsigned*            m_cq_head;
+    unsigned*            m_cq_tail;
+    unsigned*            m_cq_mask;
+    struct io_uring_cqe* m_cqes;
+    unsigned             m_sq_entries = 0;
+    unsigned             m_cq_entries = 0;
+    unsigned             m_to_submit  = 0;
+};
+
+Uring::~Uring()
+{
+    if (m_sqes != MAP_FAILED)
+        munmap(m_sqes, m_sqes_size);
+    if (m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+        munmap(m_cq_ptr, m_cq_size);
+    if (m_sq_ptr != MAP_FAILED)
+        munmap(m_sq_ptr, m_sq_size);
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+int Uring::setup(unsigned entries, int event_fd)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    m_fd = int(syscall(__NR_io_uring_setup, entries, &p));
+    if (m_fd < 0)
+        return -1;
+    // openat, statx, read and close are all there since 5.6, as this feature
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        errno = ENOSYS;
+        return -1;
+    }
+    m_sq_entries = p.sq_entries;
+    m_cq_entries = p.cq_entries;
+    m_sq_size    = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_size    = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+
+    m_sq_ptr = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sq_ptr == MAP_FAILED)
+        return -1;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        m_cq_ptr = m_sq_ptr;
+    else
+        m_cq_ptr =
+            mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+    if (m_cq_ptr == MAP_FAILED)
+        return -1;
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes      = static_cast<struct io_uring_sqe*>(
+        mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+    if (m_sqes == MAP_FAILED)
+        return -1;
+
+    char* sq   = static_cast<char*>(m_sq_ptr);
+    char* cq   = static_cast<char*>(m_cq_ptr);
+    m_sq_head  = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    m_sq_tail  = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    m_sq_mask  = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    m_sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    m_cq_head  = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    m_cq_tail  = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    m_cq_mask  = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    m_cqes     = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    // The completions wake up the event loop
+    if (syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)
+        return -1;
+    return 0;
+}
+
+unsigned Uring::space() const
+{
+    return m_sq_entries - (*m_sq_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE));
+}
+
+struct io_uring_sqe* Uring::get_sqe()
+{
+    unsigned tail  = *m_sq_tail;
+    unsigned index = tail & *m_sq_mask;
+    struct io_uring_sqe* sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[index] = index;
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    m_to_submit++;
+    return sqe;
+}
+
+int Uring::submit(unsigned min_complete)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    if (m_to_submit == 0 && min_complete == 0)
+        return 0;
+    stat_add(STAT_SYSCALLS);
+    int ret = int(syscall(__NR_io_uring_enter, m_fd, m_to_submit, min_complete, flags, nullptr, 0));
+    if (ret < 0)
+        return -1;
+    m_to_submit -= unsigned(ret);
+    return ret;
+}
+
+template <typename F>
+unsigned Uring::reap(F func)
+{
+    unsigned head  = *m_cq_head;
+    unsigned tail  = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    unsigned count = 0;
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &m_cqes[head & *m_cq_mask];
+        func(cqe->user_data, cqe->res);
+        head++;
+        count++;
+    }
+    __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+#endif // FTY_SHM_HAVE_IO_URING
+
+} // namespace
+
+struct fty::shm::AsyncReader::Impl
+{
+    int                                  event_fd = -1;
+    bool                                 async    = false;
+    unsigned                             depth    = 0;
+    std::list<std::unique_ptr<Request>>  requests;
+    std::deque<FileRead*>                to_open;
+    std::deque<FileRead*>                to_read;
+    unsigned                             in_flight = 0;
+#ifdef FTY_SHM_HAVE_IO_URING
+    Uring ring;
+#endif
+
+    void queue(std::unique_ptr<Request> request);
+    void done(FileRead* read);
+    int  submit(unsigned min_complete);
+    int  complete();
+};
+
+void fty::shm::AsyncReader::Impl::queue(std::unique_ptr<Request> request)
+{
+    request->left = request->reads.size();
+    if (!async) {
+        // Synchronous fallback, the callback is still called by dispatch()
+        for (auto& read : request->reads)
+            read_sync(*read);
+        request->left = 0;
+    } else {
+        for (auto& read : request->reads)
+            to_open.push_back(read.get());
+    }
+    requests.push_back(std::move(request));
+    if (requests.back()->left == 0) {
+        uint64_t one = 1;
+        stat_add(STAT_SYSCALLS);
+        if (write(event_fd, &one, sizeof(one)) < 0) {
+            // The counter is saturated, the loop is woken up anyway
+        }
+    } else {
+        submit(0);
+    }
+}
+
+void fty::shm::AsyncReader::Impl::done(FileRead* read)
+{
+#ifdef FTY_SHM_HAVE_IO_URING
+    finish_read(*read);
+#endif
+    read->request->left--;
+}
+
+// Fill the submission queue from the waiting reads, and submit it
+int fty::shm::AsyncReader::Impl::submit(unsigned min_complete)
+{
+#ifdef FTY_SHM_HAVE_IO_URING
+    // Reads first, they release file descriptors
+    while (!to_read.empty() && ring.space() >= 3 && in_flight + 3 <= ring.cq_entries()) {
+        FileRead* read = to_read.front();
+        to_read.pop_front();
+
+        struct io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode              = IORING_OP_STATX;
+        sqe->flags               = IOSQE_IO_HARDLINK;
+        sqe->fd                  = read->fd;
+        sqe->addr                = uint64_t(reinterpret_cast<uintptr_t>(""));
+        sqe->len                 = STATX_MTIME | STATX_SIZE;
+        sqe->off                 = uint64_t(reinterpret_cast<uintptr_t>(&read->stx));
+        sqe->statx_flags         = AT_EMPTY_PATH;
+        sqe->user_data           = uint64_t(reinterpret_cast<uintptr_t>(read)) | 1;
+
+        sqe            = ring.get_sqe();
+        sqe->opcode    = IORING_OP_READ;
+        sqe->flags     = IOSQE_IO_HARDLINK;
+        sqe->fd        = read->fd;
+        sqe->addr      = uint64_t(reinterpret_cast<uintptr_t>(read->buf));
+        sqe->len       = READ_BUF_SIZE - 1;
+        sqe->off       = 0;
+        sqe->user_data = uint64_t(reinterpret_cast<uintptr_t>(read)) | 2;
+
+        sqe            = ring.get_sqe();
+        sqe->opcode    = IORING_OP_CLOSE;
+        sqe->fd        = read->fd;
+        sqe->user_data = uint64_t(reinterpret_cast<uintptr_t>(read)) | 3;
+
+        read->steps = 3;
+        in_flight += 3;
+    }
+    while (!to_open.empty() && ring.space() >= 1 && in_flight + 1 <= std::min(depth, ring.cq_entries())) {
+        FileRead* read = to_open.front();
+        to_open.pop_front();
+
+        struct io_uring_sqe* sqe = ring.get_sqe();
+        sqe->opcode              = IORING_OP_OPENAT;
+        sqe->fd                  = AT_FDCWD;
+        sqe->addr                = uint64_t(reinterpret_cast<uintptr_t>(read->filename.c_str()));
+        sqe->open_flags          = O_RDONLY | O_CLOEXEC;
+        sqe->user_data           = uint64_t(reinterpret_cast<uintptr_t>(read));
+
+        read->steps = 1;
+        in_flight++;
+    }
+    return ring.submit(min_complete);
+#else
+    (void)min_complete;
+    return 0;
+#endif
+}
+
+// Reap the completions, returns the number of requests finished meanwhile
+int fty::shm::AsyncReader::Impl::complete()
+{
+#ifdef FTY_SHM_HAVE_IO_URING
+    ring.reap([this](uint64_t user_data, int res) {
+        FileRead* read = reinterpret_cast<FileRead*>(uintptr_t(user_data & ~uint64_t(3)));
+        unsigned  op   = unsigned(user_data & 3);
+        in_flight--;
+        read->steps--;
+        if (op == 0) {
+            // openat
+            if (res < 0) {
+                read->error = -res;
+                done(read);
+            } else {
+                read->fd = res;
+                to_read.push_back(read);
+            }
+            return;
+        }
+        if (op == 2 && res >= 0)
+            read->len = res;
+        else if (op != 3 && res < 0 && read->error == 0)
+            read->error = -res;
+        if (read->steps == 0)
+            done(read);
+    });
+#endif
+    int count = 0;
+    for (auto it = requests.begin(); it != requests.end();) {
+        if ((*it)->left > 0) {
+            ++it;
+            continue;
+        }
+        // The callback may queue requests, which go at the end of the list
+        std::unique_ptr<Request> request = std::move(*it);
+        it                               = requests.erase(it);
+        shmMetrics result;
+        for (auto& read : request->reads) {
+            if (read->proto)
+                result.add(read->proto);
+        }
+        for (auto metric : request->bundled)
+            result.add(metric);
+        request->callback(result);
+        count++;
+    }
+    return count;
+}
+
+fty::shm::AsyncReader::AsyncReader()
+    : m_impl(new Impl)
+{
+}
+
+fty::shm::AsyncReader::~AsyncReader()
+{
+    // The kernel must be done with the buffers before they go away
+    while (m_impl->async && m_impl->in_flight > 0) {
+        if (m_impl->submit(1) < 0 && errno != EINTR)
+            break;
+        m_impl->complete();
+    }
+    // The files opened but not read yet are closed here
+    for (FileRead* read : m_impl->to_read)
+        close(read->fd);
+    for (auto& request : m_impl->requests) {
+        for (auto& read : request->reads)
+            fty_proto_destroy(&read->proto);
+        for (auto& metric : request->bundled)
+            fty_proto_destroy(&metric);
+    }
+    if (m_impl->event_fd >= 0)
+        close(m_impl->event_fd);
+}
+
+int fty::shm::AsyncReader::open(unsigned depth)
+{
+    if (m_impl->event_fd >= 0)
+        return 0;
+    m_impl->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_impl->event_fd < 0)
+        return -1;
+    m_impl->depth = std::max(depth, 1u);
+#ifdef FTY_SHM_HAVE_IO_URING
+    // Three submissions per file read
+    m_impl->async = m_impl->ring.setup(std::max(m_impl->depth, 4u), m_impl->event_fd) == 0;
+#endif
+    return 0;
+}
+
+bool fty::shm::AsyncReader::async() const
+{
+    return m_impl->async;
+}
+
+int fty::shm::AsyncReader::fd() const
+{
+    return m_impl->event_fd;
+}
+
+int fty::shm::AsyncReader::read_metrics(const std::string& asset, const std::string& metric, Callback callback)
+{
+    if (m_impl->event_fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    std::unique_ptr<Request> request(new Request);
+    request->callback = std::move(callback);
+
+    std::string family_dir = family_directory(FTY_SHM_METRIC_TYPE);
+    Filter      assetFilter(asset), metricFilter(metric);
+    if (!assetFilter.valid() || !metricFilter.valid()) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    DIR* dir;
+    stat_add(STAT_SCAN);
+    stat_add(STAT_SYSCALLS, 2); // open, close
+    if (!(dir = opendir(family_dir.c_str())))
+        return -1;
+    struct dirent* de;
+    fty_proto_t*   proto_metric = nullptr;
+    while ((de = readdir(dir))) {
+        stat_add(STAT_SCAN_ENTRIES);
+        // Skip the temporary files
+        if (de->d_name[0] == '.')
+            continue;
+        const char* delim = strchr(de->d_name, '@');
+        if (!delim)
+            continue;
+        std::string filename(family_dir);
+        filename.append("/").append(de->d_name);
+        if (delim == de->d_name) {
+            if (assetFilter.match(delim + 1, strlen(delim + 1))) {
+                scan_bundle(filename.c_str(), delim + 1, metricFilter, proto_metric,
+                    [&request](fty_proto_t*& metric) {
+                        request->bundled.push_back(metric);
+                        metric = nullptr;
+                        return true;
+                    },
+                    nullptr);
+            }
+            continue;
+        }
+        if (!match_metric_filename(de->d_name, delim, assetFilter, metricFilter))
+            continue;
+        std::unique_ptr<FileRead> read(new FileRead);
+        read->request  = request.get();
+        read->filename = filename;
+        read->asset.assign(delim + 1);
+        read->metric.assign(de->d_name, size_t(delim - de->d_name));
+        request->reads.push_back(std::move(read));
+    }
+    closedir(dir);
+    fty_proto_destroy(&proto_metric);
+
+    m_impl->queue(std::move(request));
+    return 0;
+}
+
+int fty::shm::AsyncReader::read_metrics(const Keys& keys, Callback callback)
+{
+    if (m_impl->event_fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    std::unique_ptr<Request> request(new Request);
+    request->callback = std::move(callback);
+
+    char filename[PATH_MAX];
+    for (auto& key : keys) {
+        if (prepare_filename(filename, key.first.c_str(), key.first.length(), key.second.c_str(),
+                key.second.length(), FTY_SHM_METRIC_TYPE) < 0)
+            continue;
+        std::unique_ptr<FileRead> read(new FileRead);
+        read->request  = request.get();
+        read->filename = filename;
+        read->asset    = key.first;
+        read->metric   = key.second;
+        request->reads.push_back(std::move(read));
+    }
+    m_impl->queue(std::move(request));
+    return 0;
+}
+
+int fty::shm::AsyncReader::dispatch()
+{
+    if (m_impl->event_fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    uint64_t counter;
+    stat_add(STAT_SYSCALLS);
+    if (read(m_impl->event_fd, &counter, sizeof(counter)) < 0 && errno != EAGAIN)
+        return -1;
+    int count = m_impl->complete();
+    // The completions made room for the waiting reads
+    if (m_impl->submit(0) < 0)
+        return -1;
+    return count;
+}
+
+int fty::shm::AsyncReader::wait()
+{
+    int count = 0;
+    while (!m_impl->requests.empty()) {
+        if (m_impl->in_flight > 0 && m_impl->submit(1) < 0 && errno != EINTR)
+            return -1;
+        int r = dispatch();
+        if (r < 0)
+            return -1;
+        count += r;
+    }
+    return count;
+}
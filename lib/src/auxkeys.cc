@@ -0,0 +1,327 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Compact aux encoding, with the keys interned in a dictionary of the store
+
+#include "fty_shm_internal.h"
+#include "stats.h"
+#include <errno.h>
+#include <atomic>
+#include <fcntl.h>
+#include <mutex>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// The compact aux block follows the value line of a metric file:
+//   AUX_COMPACT_MARKER, dictionary tag, number of pairs, pairs
+// where a pair is the key id (0 for a key stored inline, as its length and
+// bytes), then the value length and bytes. Numbers are LEB128 varints.
+//
+// The dictionary "<family>/.auxkeys" holds one key per line, the id of a
+// key being its line number. It is append-only, so ids never change and
+// every process caches it. The tag is the inode of the dictionary, so that
+// a record is never decoded against another dictionary than its own.
+
+// Keys beyond this are stored inline, the dictionary is for the usual ones
+#define AUX_KEYS_MAX 4096
+
+using namespace fty::shm;
+
+namespace {
+
+class AuxKeys
+{
+public:
+    // Id of key in the dictionary of dir, interned if needed, 0 if it can't
+    // be. ino is set to the dictionary tag.
+    uint32_t intern(const char* dir, size_t dir_len, const char* key, uint64_t& ino);
+    // Key of id in the dictionary tagged ino, false if there is none
+    bool lookup(const char* dir, size_t dir_len, uint64_t ino, uint32_t id, std::string& key);
+    void clear();
+
+private:
+    // The cache of the dictionary of a family directory
+    struct Dictionary
+    {
+        std::string                               dir;
+        uint64_t                                  ino  = 0;
+        off_t                                     size = 0;
+        std::vector<std::string>                  keys;
+        std::unordered_map<std::string, uint32_t> ids;
+
+        void reset();
+        bool load(int fd);
+    };
+
+    Dictionary& bind(const char* dir, size_t dir_len);
+
+    std::mutex                                  m_mutex;
+    std::unordered_map<std::string, Dictionary> m_dictionaries;
+    // Last one bound, the writes usually go to a single family
+    Dictionary*                                 m_last = nullptr;
+};
+
+AuxKeys aux_keys;
+
+void AuxKeys::Dictionary::reset()
+{
+    ino  = 0;
+    size = 0;
+    keys.clear();
+    ids.clear();
+}
+
+void AuxKeys::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_last = nullptr;
+    m_dictionaries.clear();
+}
+
+AuxKeys::Dictionary& AuxKeys::bind(const char* dir, size_t dir_len)
+{
+    if (m_last && m_last->dir.length() == dir_len && memcmp(m_last->dir.data(), dir, dir_len) == 0)
+        return *m_last;
+    std::string key(dir, dir_len);
+    m_last      = &m_dictionaries[key];
+    m_last->dir = std::move(key);
+    return *m_last;
+}
+
+// Load the keys appended to the dictionary since the last load
+bool AuxKeys::Dictionary::load(int fd)
+{
+    struct stat st;
+    stat_add(STAT_SYSCALLS);
+    if (fstat(fd, &st) < 0)
+        return false;
+    if (uint64_t(st.st_ino) != ino) {
+        reset();
+        ino = uint64_t(st.st_ino);
+    }
+    if (st.st_size <= size)
+        return true;
+
+    std::string data(size_t(st.st_size - size), '\0');
+    stat_add(STAT_SYSCALLS);
+    ssize_t len = pread(fd, &data[0], data.size(), size);
+    if (len < 0)
+        return false;
+    // Only complete lines, a key may be half written
+    size_t pos = 0;
+    while (true) {
+        const char* nl = static_cast<const char*>(memchr(data.data() + pos, '\n', size_t(len) - pos));
+        if (!nl)
+            break;
+        size_t end = size_t(nl - data.data());
+        keys.emplace_back(data, pos, end - pos);
+        ids.emplace(keys.back(), uint32_t(keys.size()));
+        pos = end + 1;
+    }
+    size += off_t(pos);
+    return true;
+}
+
+uint32_t AuxKeys::intern(const char* dir, size_t dir_len, const char* key, uint64_t& ino)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Dictionary&                 dict = bind(dir, dir_len);
+
+    auto it = dict.ids.find(key);
+    if (it != dict.ids.end()) {
+        ino = dict.ino;
+        return it->second;
+    }
+    if (dict.keys.size() >= AUX_KEYS_MAX || strchr(key, '\n'))
+        return 0;
+
+    std::string path(dict.dir);
+    path.append("/" AUX_KEYS_FILE);
+    stat_add(STAT_SYSCALLS, 3); // open, flock, close
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return 0;
+    // Writers take turns so that a key gets a single id
+    uint32_t id = 0;
+    if (flock(fd, LOCK_EX) == 0 && dict.load(fd)) {
+        it = dict.ids.find(key);
+        if (it != dict.ids.end()) {
+            id = it->second;
+        } else {
+            std::string line(key);
+            line.append("\n");
+            stat_add(STAT_SYSCALLS);
+            if (write(fd, line.data(), line.size()) == ssize_t(line.size())) {
+                dict.keys.emplace_back(key);
+                id = uint32_t(dict.keys.size());
+                dict.ids.emplace(dict.keys.back(), id);
+                dict.size += off_t(line.size());
+            }
+        }
+    }
+    close(fd);
+    ino = dict.ino;
+    return id;
+}
+
+bool AuxKeys::lookup(const char* dir, size_t dir_len, uint64_t ino, uint32_t id, std::string& key)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Dictionary&                 dict = bind(dir, dir_len);
+
+    if (ino != dict.ino || id > dict.keys.size()) {
+        // Keys added (or dictionary recreated) by another process
+        std::string path(dict.dir);
+        path.append("/" AUX_KEYS_FILE);
+        stat_add(STAT_SYSCALLS, 2); // open, close
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        dict.load(fd);
+        close(fd);
+        if (ino != dict.ino || id > dict.keys.size())
+            return false;
+    }
+    key = dict.keys[id - 1];
+    return true;
+}
+
+void put_varint(std::string& buf, uint64_t v)
+{
+    while (v >= 0x80) {
+        buf.push_back(char(v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back(char(v));
+}
+
+bool get_varint(const char*& p, const char* end, uint64_t& v)
+{
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = uint8_t(*p++);
+        v |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+} // namespace
+
+// FTY_SHM_COMPACT_AUX, read again after a reset
+static std::atomic<int> compact_aux{-1};
+
+bool compact_aux_enabled()
+{
+    int enabled = compact_aux.load(std::memory_order_relaxed);
+    if (enabled < 0) {
+        // Opt-in: the readers of the text format can't decode it
+        const char* valenv = getenv("FTY_SHM_COMPACT_AUX");
+        enabled            = valenv && strcmp(valenv, "ON") == 0;
+        compact_aux.store(enabled, std::memory_order_relaxed);
+    }
+    return enabled;
+}
+
+void encode_aux(const char* filename, zhash_t* aux, std::string& buf)
+{
+    const char* name    = strrchr(filename, '/');
+    size_t      dir_len = name ? size_t(name - filename) : 0;
+    std::string pairs;
+    uint64_t    ino   = 0;
+    size_t      count = 0;
+
+    // The ids of a pass are only good if they all come from the same
+    // dictionary. Should it be recreated meanwhile, retry, then give up on
+    // interning.
+    for (int pass = 0; pass < 3; pass++) {
+        bool mixed = false;
+        pairs.clear();
+        ino   = 0;
+        count = 0;
+        for (char* item = static_cast<char*>(zhash_first(aux)); item;
+             item       = static_cast<char*>(zhash_next(aux))) {
+            const char* key     = zhash_cursor(aux);
+            uint64_t    key_ino = 0;
+            uint32_t    id      = pass < 2 ? aux_keys.intern(filename, dir_len, key, key_ino) : 0;
+            if (id) {
+                mixed = mixed || (ino && key_ino != ino);
+                ino   = key_ino;
+            }
+            put_varint(pairs, id);
+            if (id == 0) {
+                size_t key_len = strlen(key);
+                put_varint(pairs, key_len);
+                pairs.append(key, key_len);
+            }
+            size_t value_len = strlen(item);
+            put_varint(pairs, value_len);
+            pairs.append(item, value_len);
+            count++;
+        }
+        if (!mixed)
+            break;
+    }
+    buf.push_back(AUX_COMPACT_MARKER);
+    put_varint(buf, ino);
+    put_varint(buf, count);
+    buf.append(pairs);
+}
+
+bool decode_aux(const char* filename, const char* data, size_t len, fty_proto_t* proto_metric)
+{
+    const char* name    = strrchr(filename, '/');
+    size_t      dir_len = name ? size_t(name - filename) : 0;
+    const char* p       = data;
+    const char* end     = data + len;
+    uint64_t    ino, count;
+    std::string key;
+
+    if (!get_varint(p, end, ino) || !get_varint(p, end, count))
+        return false;
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t id, key_len, value_len;
+        if (!get_varint(p, end, id))
+            return false;
+        if (id == 0) {
+            if (!get_varint(p, end, key_len) || key_len > size_t(end - p))
+                return false;
+            key.assign(p, key_len);
+            p += key_len;
+        } else if (id > UINT32_MAX || !aux_keys.lookup(filename, dir_len, ino, uint32_t(id), key)) {
+            return false;
+        }
+        if (!get_varint(p, end, value_len) || value_len > size_t(end - p))
+            return false;
+        fty_proto_aux_insert(proto_metric, key.c_str(), "%.*s", int(value_len), p);
+        p += value_len;
+    }
+    return true;
+}
+
+void reset_aux_keys()
+{
+    compact_aux.store(-1);
+    aux_keys.clear();
+}
@@ -0,0 +1,325 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Per-asset bundles: all the metrics of an asset in a single file
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include "publisher.h"
+#include "stats.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A bundle "<family>/@<asset>" starts with the usual ttl header, holding the
+// largest ttl of its records (0 if one of them never expires), so that the
+// bundle is outdated exactly when all its records are and fty-shm-cleanup
+// handles it as any metric file. Then come the records, one field per line:
+//   metric, ttl, unit, value, number of aux pairs, aux keys and values
+// All the records share the timestamp of the bundle.
+
+using namespace fty::shm;
+
+int prepare_bundle_filename(char* buf, const char* asset, size_t a_len, const char* type)
+{
+    std::string dir = family_directory(type);
+    if (a_len + 1 > NAME_MAX || dir.length() + a_len + 3 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (memchr(asset, '/', a_len) || memchr(asset, BUNDLE_PREFIX, a_len) || memchr(asset, '\n', a_len)) {
+        errno = EINVAL;
+        return -1;
+    }
+    char* p = buf;
+    memcpy(p, dir.c_str(), dir.length());
+    p += dir.length();
+    *p++ = '/';
+    *p++ = BUNDLE_PREFIX;
+    memcpy(p, asset, a_len);
+    p += a_len;
+    *p = '\0';
+    return 0;
+}
+
+// A field spreading over several lines would shift all the following records
+static bool valid_field(const char* str)
+{
+    return str && !strchr(str, '\n');
+}
+
+int write_bundle_file(const char* filename, const std::vector<fty_proto_t*>& metrics, const FamilyPolicy& policy)
+{
+    int              max_ttl = 0;
+    std::vector<int> ttls;
+    ttls.reserve(metrics.size());
+    for (auto metric : metrics) {
+        zhash_t* aux = fty_proto_aux(metric);
+        if (!valid_field(fty_proto_type(metric)) || strchr(fty_proto_type(metric), '/') ||
+            strchr(fty_proto_type(metric), BUNDLE_PREFIX) || !valid_field(fty_proto_unit(metric)) ||
+            !valid_field(fty_proto_value(metric))) {
+            errno = EINVAL;
+            return -1;
+        }
+        for (char* item = aux ? static_cast<char*>(zhash_first(aux)) : nullptr; item;
+             item       = static_cast<char*>(zhash_next(aux))) {
+            if (!valid_field(zhash_cursor(aux)) || !valid_field(item)) {
+                errno = EINVAL;
+                return -1;
+            }
+        }
+        int ttl = policy_ttl(policy, int(fty_proto_ttl(metric)));
+        ttls.push_back(ttl);
+        if (ttl <= 0 || max_ttl < 0)
+            max_ttl = -1;
+        else if (ttl > max_ttl)
+            max_ttl = ttl;
+    }
+
+    // Readers see either the previous bundle or this one, never a mix
+    std::string tmp_filename = temporary_filename(filename);
+
+    stat_add(STAT_SYSCALLS, 4); // open, write, close, rename
+    FILE* file = fopen(tmp_filename.c_str(), "w");
+    if (file == nullptr) {
+        stat_add(STAT_WRITE_ERROR);
+        return -1;
+    }
+    int len = fprintf(file, TTL_FMT, max_ttl < 0 ? 0 : max_ttl);
+    for (size_t i = 0; i < metrics.size(); i++) {
+        if (len < 0)
+            break;
+        fty_proto_t* metric = metrics[i];
+        zhash_t*     aux    = fty_proto_aux(metric);
+        int          r      = fprintf(file, "%s\n" TTL_FMT "%s\n%s\n%zu\n", fty_proto_type(metric), ttls[i],
+            fty_proto_unit(metric), fty_proto_value(metric), aux ? zhash_size(aux) : 0);
+        len = (r < 0) ? r : len + r;
+        for (char* item = aux ? static_cast<char*>(zhash_first(aux)) : nullptr; item && len >= 0;
+             item       = static_cast<char*>(zhash_next(aux))) {
+            r   = fprintf(file, "%s\n%s\n", zhash_cursor(aux), item);
+            len = (r < 0) ? r : len + r;
+        }
+    }
+    if (fclose(file) < 0 || len < 0 || rename(tmp_filename.c_str(), filename) < 0) {
+        int err = errno;
+        remove(tmp_filename.c_str());
+        errno = err;
+        stat_add(STAT_WRITE_ERROR);
+        return -1;
+    }
+    stat_add(STAT_WRITE, metrics.size());
+    stat_add(STAT_BYTES_WRITTEN, uint64_t(len));
+    return 0;
+}
+
+int BundleReader::open(const char* filename)
+{
+    struct stat st;
+
+    m_data.clear();
+    m_pos      = 0;
+    m_aux_left = 0;
+    stat_add(STAT_SYSCALLS, 4); // open, fstat, read, close
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    // One read of the whole bundle, one byte more to notice a concurrent growth
+    m_data.resize(size_t(st.st_size) + 1);
+    ssize_t len = read(fd, &m_data[0], m_data.size());
+    int     err = errno;
+    close(fd);
+    if (len < 0) {
+        errno = err;
+        return -1;
+    }
+    m_data.resize(size_t(len));
+    stat_add(STAT_BYTES_READ, uint64_t(len));
+    m_time = st.st_mtime;
+
+    time_t ttl;
+    char*  header = line();
+    if (!header || strlen(header) != TTL_LEN - 1 || parse_ttl(header, ttl) < 0) {
+        errno = ERANGE;
+        return -1;
+    }
+    m_ttl = ttl;
+    return 0;
+}
+
+bool BundleReader::outdated(time_t now) const
+{
+    return m_ttl && now - m_time > m_ttl;
+}
+
+// Next line of the bundle, made a C string in place
+char* BundleReader::line()
+{
+    if (m_pos >= m_data.size())
+        return nullptr;
+    char* start = &m_data[m_pos];
+    char* end   = static_cast<char*>(memchr(start, '\n', m_data.size() - m_pos));
+    if (!end)
+        return nullptr;
+    *end  = '\0';
+    m_pos = size_t(end - &m_data[0]) + 1;
+    return start;
+}
+
+bool BundleReader::next()
+{
+    // Skip what is left of the current record
+    while (m_aux_left > 0) {
+        if (!line() || !line())
+            return false;
+        m_aux_left--;
+    }
+    char* ttl_str;
+    char* count;
+    if (!(m_metric = line()) || !(ttl_str = line()) || !(m_unit = line()) || !(m_value = line()) ||
+        !(count = line()))
+        return false;
+    char* err;
+    m_record_ttl = strtol(ttl_str, &err, 10);
+    if (*err != '\0')
+        return false;
+    m_aux_left = size_t(strtoul(count, &err, 10));
+    return *err == '\0';
+}
+
+bool BundleReader::valid(time_t now) const
+{
+    return m_record_ttl == 0 || now - m_time <= m_record_ttl;
+}
+
+void BundleReader::fill(fty_proto_t* proto_metric)
+{
+    fty_proto_set_ttl(proto_metric, uint32_t(m_record_ttl));
+    fty_proto_set_time(proto_metric, uint64_t(m_time));
+    fty_proto_set_unit(proto_metric, "%s", m_unit);
+    fty_proto_set_value(proto_metric, "%s", m_value);
+    while (m_aux_left > 0) {
+        char* key   = line();
+        char* value = key ? line() : nullptr;
+        if (!value)
+            break;
+        fty_proto_aux_insert(proto_metric, key, "%s", value);
+        m_aux_left--;
+    }
+}
+
+int BundleReader::find(const char* metric, time_t now)
+{
+    while (next()) {
+        if (strcmp(m_metric, metric) != 0)
+            continue;
+        if (!valid(now)) {
+            errno = ESTALE;
+            return -1;
+        }
+        return 0;
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+int find_in_bundle(const char* filename, BundleReader& reader)
+{
+    // filename is "<dir>/<metric>@<asset>", its bundle "<dir>/@<asset>"
+    const char* name  = strrchr(filename, '/') + 1;
+    const char* delim = strchr(name, '@');
+    if (!delim) {
+        errno = ENOENT;
+        return -1;
+    }
+    std::string bundle(filename, size_t(name - filename));
+    bundle.append(delim);
+    if (reader.open(bundle.c_str()) < 0)
+        return -1;
+    time_t now = time(nullptr);
+    if (reader.outdated(now)) {
+        remove_stale(bundle.c_str());
+        errno = ESTALE;
+        return -1;
+    }
+    std::string metric(name, size_t(delim - name));
+    return reader.find(metric.c_str(), now);
+}
+
+int fty::shm::write_metrics(const std::vector<fty_proto_t*>& metrics, bool bundle)
+{
+    int ret = 0;
+    int err = 0;
+    // One message per asset in the batched publish modes
+    Publisher::Batch publish_batch;
+
+    if (!bundle) {
+        for (auto metric : metrics) {
+            if (write_metric(metric) < 0) {
+                ret = -1;
+                err = err ? err : errno;
+            }
+        }
+        errno = err;
+        return ret;
+    }
+
+    // Group the metrics by asset, in order of appearance
+    std::vector<std::pair<std::string, std::vector<fty_proto_t*>>> assets;
+    for (auto metric : metrics) {
+        const char* asset = fty_proto_name(metric);
+        auto        it    = assets.begin();
+        while (it != assets.end() && it->first != asset)
+            ++it;
+        if (it == assets.end())
+            it = assets.insert(assets.end(), {asset, {}});
+        it->second.push_back(metric);
+    }
+
+    char filename[PATH_MAX];
+    for (auto& asset : assets) {
+        if (prepare_bundle_filename(filename, asset.first.c_str(), asset.first.length(), FTY_SHM_METRIC_TYPE) < 0) {
+            ret = -1;
+            err = err ? err : errno;
+            continue;
+        }
+        FamilyPolicy policy = family_policy(filename);
+        if (write_bundle_file(filename, asset.second, policy) < 0) {
+            ret = -1;
+            err = err ? err : errno;
+            continue;
+        }
+        for (auto metric : asset.second) {
+            log_update(filename, metric);
+            record_history(filename, metric);
+            if (policy.publish)
+                Publisher::publishMetric(metric); //mqtt-pub
+        }
+    }
+    errno = err;
+    return ret;
+}
@@ -0,0 +1,326 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Conditional writes of the metrics having several writers
+
+#include "fty_shm_internal.h"
+#include "stats.h"
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// write_metric_if_newer() prepares its file aside, checks the version of the
+// metric, and swaps its file with the metric file in one renameat2()
+// (RENAME_EXCHANGE). The file it gets back is the one it actually replaced:
+// if another writer came in between with a more recent version, the write
+// lost. It withdraws its own file (through the descriptor it kept, the file
+// may have moved) and swaps the file it got back in again, until the metric
+// file is at least as recent. No writer ever waits for another one, and the
+// most recent version ends up in the metric file. Readers see one complete
+// metric file or another, possibly a withdrawn one for the time of the swaps.
+//
+// compare_and_write_metric() claims the metric file it replaces, by creating
+// ".<name>.claim.<inode>.<version>" with O_EXCL: a single writer can replace
+// a given file, the others fail right away. It swaps its file in the same
+// way, and checks the file it got back is the one claimed: a
+// write_metric_if_newer() may have come in between, its file is restored as
+// above. A writer killed between its claim and its swap leaves the metric to
+// the other kinds of writes, and its claim to the next writer once older than
+// CLAIM_TIMEOUT (fty-shm-cleanup removes them too). Two writers taking over a
+// claim at once are caught by the check of the swap.
+
+// A claim is held for a few system calls, an older one was left by a
+// killed writer (seconds)
+#define CLAIM_TIMEOUT 10
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+using namespace fty::shm;
+
+namespace {
+
+int rename_flags(const char* from, const char* to, unsigned flags)
+{
+    stat_add(STAT_SYSCALLS);
+    return int(syscall(SYS_renameat2, AT_FDCWD, from, AT_FDCWD, to, flags));
+}
+
+// Put the file held at tmp_filename back in filename, unless filename holds
+// at least as recent a version which was not withdrawn. Files withdrawn, and
+// own (the file of this write), are dropped
+void restore(const char* filename, const char* tmp_filename, ino_t own, MetricVersion held)
+{
+    MetricVersion current;
+    while (held.exists && held.ino != own && !held.withdrawn) {
+        if (read_metric_version(filename, current) < 0)
+            break;
+        if (!current.exists) {
+            if (rename_flags(tmp_filename, filename, RENAME_NOREPLACE) == 0 || errno != EEXIST)
+                return;
+            continue;
+        }
+        if (current.ino != own && !current.withdrawn && current.version >= held.version)
+            break;
+        if (rename_flags(tmp_filename, filename, RENAME_EXCHANGE) < 0) {
+            if (errno == ENOENT)
+                continue;
+            break;
+        }
+        if (read_metric_version(tmp_filename, held) < 0)
+            break;
+    }
+    stat_add(STAT_SYSCALLS);
+    unlink(tmp_filename);
+}
+
+} // namespace
+
+int read_metric_version(const char* filename, MetricVersion& version)
+{
+    struct stat st;
+
+    version = MetricVersion();
+    stat_add(STAT_SYSCALLS, 4); // open, fstat, read, close
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    std::string data(size_t(st.st_size) + 1, '\0');
+    ssize_t     len = read(fd, &data[0], data.size() - 1);
+    close(fd);
+    if (len < 0)
+        return -1;
+    data.resize(size_t(len));
+    version.exists = true;
+    version.ino    = st.st_ino;
+
+    // ttl, unit and value lines, then the version key and line if any
+    time_t ttl;
+    size_t unit  = data.find('\n');
+    size_t value = unit == std::string::npos ? unit : data.find('\n', unit + 1);
+    size_t line  = value == std::string::npos ? value : data.find('\n', value + 1);
+    if (unit != TTL_LEN - 1 || line == std::string::npos || line + 1 + VERSION_LEN > data.size())
+        return 0;
+    data[unit] = '\0';
+    if (parse_ttl(&data[0], ttl) < 0 || (ttl && time(nullptr) - st.st_mtime > ttl))
+        return 0;
+    if (data.compare(line + 1, VERSION_KEY_LEN + 1, VERSION_KEY "\n") != 0)
+        return 0;
+    line += VERSION_KEY_LEN + 1;
+    if (line + 1 + VERSION_LEN > data.size())
+        return 0;
+    if (data[line + 1] != VERSION_MARKER && data[line + 1] != VERSION_WITHDRAWN)
+        return 0;
+    version.withdrawn = data[line + 1] == VERSION_WITHDRAWN;
+    version.version   = strtoull(data.c_str() + line + 2, nullptr, 10);
+    return 0;
+}
+
+namespace {
+
+// Write data to a new temporary file next to filename, left open in fd
+int create_tmp(const char* filename, const std::string& data, std::string& tmp_filename, int& fd, struct stat& st)
+{
+    const char* name = strrchr(filename, '/') + 1;
+    tmp_filename     = temporary_filename(filename);
+
+    stat_add(STAT_SYSCALLS, 3); // open, write, fstat
+    fd = open(tmp_filename.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0 && errno == ENOENT) {
+        // First write to a family
+        stat_add(STAT_SYSCALLS);
+        mkdir(std::string(filename, size_t(name - filename - 1)).c_str(), 0777);
+        fd = open(tmp_filename.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    }
+    if (fd < 0)
+        return -1;
+    ssize_t len = write(fd, data.data(), data.size());
+    bool    ok  = len >= 0 && size_t(len) == data.size();
+    if (!ok && len >= 0)
+        errno = ENOSPC;
+    if (!ok || fstat(fd, &st) < 0) {
+        int err = errno;
+        unlink(tmp_filename.c_str());
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Account for the end of a conditional write, ret being its result and err
+// its errno
+int write_done(int ret, int err, size_t size)
+{
+    if (ret < 0) {
+        stat_add(err == ECANCELED ? STAT_WRITE_CONFLICT : STAT_WRITE_ERROR);
+        errno = err;
+        return -1;
+    }
+    stat_add(STAT_WRITE);
+    stat_add(STAT_BYTES_WRITTEN, uint64_t(size));
+    return 0;
+}
+
+} // namespace
+
+int replace_if_newer(const char* filename, const std::string& data, size_t marker, uint64_t version)
+{
+    auto accept = [version](const MetricVersion& replaced) {
+        return replaced.withdrawn || replaced.version < version;
+    };
+
+    MetricVersion current;
+    if (read_metric_version(filename, current) < 0)
+        return write_done(-1, errno, 0);
+    if (!accept(current))
+        return write_done(-1, ECANCELED, 0);
+
+    // The descriptor is kept to withdraw the file wherever it went
+    std::string tmp_filename;
+    struct stat st;
+    int         fd;
+    if (create_tmp(filename, data, tmp_filename, fd, st) < 0)
+        return write_done(-1, errno, 0);
+
+    int ret = -1, err = 0;
+    for (;;) {
+        if (!current.exists) {
+            if (rename_flags(tmp_filename.c_str(), filename, RENAME_NOREPLACE) == 0) {
+                ret = 0;
+                break;
+            }
+        } else if (rename_flags(tmp_filename.c_str(), filename, RENAME_EXCHANGE) == 0) {
+            MetricVersion replaced;
+            if (read_metric_version(tmp_filename.c_str(), replaced) == 0 && accept(replaced)) {
+                stat_add(STAT_SYSCALLS);
+                unlink(tmp_filename.c_str());
+                ret = 0;
+                break;
+            }
+            // Lost the race to another writer
+            char withdrawn = VERSION_WITHDRAWN;
+            stat_add(STAT_SYSCALLS);
+            err = pwrite(fd, &withdrawn, 1, off_t(marker)) == 1 ? ECANCELED : errno;
+            restore(filename, tmp_filename.c_str(), st.st_ino, replaced);
+            break;
+        }
+        // Created or removed meanwhile
+        if (errno != EEXIST && errno != ENOENT) {
+            err = errno;
+            unlink(tmp_filename.c_str());
+            break;
+        }
+        if (read_metric_version(filename, current) < 0 || !accept(current)) {
+            err = current.exists ? ECANCELED : errno;
+            unlink(tmp_filename.c_str());
+            break;
+        }
+    }
+    stat_add(STAT_SYSCALLS);
+    close(fd);
+    return write_done(ret, err, data.size());
+}
+
+int replace_if_version(const char* filename, const std::string& data, size_t marker, uint64_t expected)
+{
+    MetricVersion current;
+    if (read_metric_version(filename, current) < 0)
+        return write_done(-1, errno, 0);
+    if (current.withdrawn || (current.exists ? current.version != expected : expected != 0))
+        return write_done(-1, ECANCELED, 0);
+
+    std::string tmp_filename;
+    struct stat st;
+    int         fd;
+    if (create_tmp(filename, data, tmp_filename, fd, st) < 0)
+        return write_done(-1, errno, 0);
+
+    int ret = 0, err = 0;
+    if (!current.exists) {
+        // Created by another writer meanwhile
+        if ((ret = rename_flags(tmp_filename.c_str(), filename, RENAME_NOREPLACE)) < 0)
+            err = errno == EEXIST ? ECANCELED : errno;
+    } else {
+        const char* name = strrchr(filename, '/') + 1;
+        std::string claim(filename, size_t(name - filename));
+        claim.append(".").append(name).append(".claim.").append(std::to_string(current.ino));
+        claim.append(".").append(std::to_string(current.version));
+        MetricVersion replaced;
+        stat_add(STAT_SYSCALLS, 2); // open, close
+        int claim_fd = open(claim.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        struct stat claim_st;
+        if (claim_fd < 0 && errno == EEXIST) {
+            // Left by a killed writer
+            stat_add(STAT_SYSCALLS);
+            if (stat(claim.c_str(), &claim_st) == 0 && time(nullptr) - claim_st.st_mtime > CLAIM_TIMEOUT) {
+                stat_add(STAT_SYSCALLS, 2); // unlink, open
+                unlink(claim.c_str());
+                claim_fd = open(claim.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+            } else {
+                errno = EEXIST;
+            }
+        }
+        if (claim_fd < 0) {
+            ret = -1;
+            err = errno == EEXIST ? ECANCELED : errno;
+        } else {
+            close(claim_fd);
+            // The file swapped out is the one claimed, unless another writer
+            // replaced it meanwhile (a write_metric_if_newer() not knowing
+            // the claims, or a compare_and_write_metric() before the claim)
+            if ((ret = rename_flags(tmp_filename.c_str(), filename, RENAME_EXCHANGE)) < 0) {
+                err = errno == ENOENT ? ECANCELED : errno;
+            } else if (read_metric_version(tmp_filename.c_str(), replaced) < 0 || replaced.ino != current.ino ||
+                       replaced.version != current.version || replaced.withdrawn) {
+                char withdrawn = VERSION_WITHDRAWN;
+                stat_add(STAT_SYSCALLS);
+                ret = -1;
+                err = pwrite(fd, &withdrawn, 1, off_t(marker)) == 1 ? ECANCELED : errno;
+                restore(filename, tmp_filename.c_str(), st.st_ino, replaced);
+                tmp_filename.clear();
+            } else {
+                stat_add(STAT_SYSCALLS);
+                unlink(tmp_filename.c_str());
+            }
+            stat_add(STAT_SYSCALLS);
+            unlink(claim.c_str());
+        }
+    }
+    if (ret < 0 && !tmp_filename.empty()) {
+        stat_add(STAT_SYSCALLS);
+        unlink(tmp_filename.c_str());
+    }
+    stat_add(STAT_SYSCALLS);
+    close(fd);
+    return write_done(ret, err, data.size());
+}
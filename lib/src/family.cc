@@ -0,0 +1,248 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Families of metrics and their policies
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include "stats.h"
+#include <algorithm>
+#include <atomic>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <mutex>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+// The policy of a family is "<shm_dir>/<family>/.policy", "key=value" lines
+// (max_ttl, publish, cleanup) that fty-shm-cleanup reads as well. A family
+// without one has the default policy. The processes keep the policies they
+// use, reading them again at most once per POLICY_REFRESH seconds. Each
+// thread keeps the last policies it got, so that the writes take no lock: the
+// shared cache is only locked when they are older than POLICY_REFRESH, or
+// when set_family_policy() changed a policy of the process (generation).
+
+#define POLICY_REFRESH 1
+// Policies kept by each thread
+#define THREAD_POLICIES 4
+
+using namespace fty::shm;
+
+namespace {
+
+struct CachedPolicy
+{
+    FamilyPolicy policy;
+    time_t       loaded;
+};
+
+std::mutex                                    policy_mutex;
+std::unordered_map<std::string, CachedPolicy> policies;
+std::atomic<uint64_t>                         policy_generation{0};
+
+struct ThreadPolicy
+{
+    std::string  family_dir;
+    CachedPolicy cached;
+    uint64_t     generation;
+};
+
+thread_local ThreadPolicy thread_policies[THREAD_POLICIES];
+thread_local unsigned     thread_policy_next = 0;
+
+// Read the policy file of family_dir, the default policy if there is none
+FamilyPolicy load_policy(const std::string& family_dir)
+{
+    FamilyPolicy policy;
+    char         buf[256];
+
+    stat_add(STAT_SYSCALLS, 3); // open, read, close
+    int fd = open((family_dir + "/" POLICY_FILE).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return policy;
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return policy;
+    buf[len] = '\0';
+
+    char* save;
+    for (char* line = strtok_r(buf, "\n", &save); line; line = strtok_r(nullptr, "\n", &save)) {
+        char* value = strchr(line, '=');
+        if (!value)
+            continue;
+        *value++           = '\0';
+        unsigned long uval = strtoul(value, nullptr, 10);
+        if (strcmp(line, "max_ttl") == 0)
+            policy.max_ttl = uint32_t(std::min(uval, static_cast<unsigned long>(INT_MAX)));
+        else if (strcmp(line, "publish") == 0)
+            policy.publish = uval != 0;
+        else if (strcmp(line, "cleanup") == 0)
+            policy.cleanup = uval != 0;
+    }
+    return policy;
+}
+
+} // namespace
+
+bool valid_family_name(const std::string& family)
+{
+    return !family.empty() && family[0] != '.' && family.find('/') == std::string::npos &&
+           family.length() <= NAME_MAX;
+}
+
+FamilyPolicy family_policy(const char* filename)
+{
+    // The family directory holds the metric files, and the side directories
+    // (.history) holding files of their own
+    const char* end = strrchr(filename, '/');
+    const char* dir = end;
+    while (dir > filename && dir[-1] != '/')
+        dir--;
+    if (dir[0] == '.' && dir > filename) {
+        end = dir - 1;
+        for (dir = end; dir > filename && dir[-1] != '/'; dir--)
+            ;
+    }
+    size_t   dir_len    = size_t(end - filename);
+    time_t   now        = time(nullptr);
+    uint64_t generation = policy_generation.load(std::memory_order_acquire);
+    ThreadPolicy* slot  = nullptr;
+    for (auto& entry : thread_policies) {
+        if (entry.family_dir.length() != dir_len || memcmp(entry.family_dir.data(), filename, dir_len) != 0)
+            continue;
+        if (entry.generation == generation && now - entry.cached.loaded < POLICY_REFRESH)
+            return entry.cached.policy;
+        slot = &entry;
+    }
+
+    std::string  family_dir(filename, dir_len);
+    CachedPolicy cached;
+    {
+        std::lock_guard<std::mutex> lock(policy_mutex);
+        auto                        it = policies.find(family_dir);
+        if (it == policies.end() || now - it->second.loaded >= POLICY_REFRESH) {
+            it = policies.insert_or_assign(family_dir, CachedPolicy{load_policy(family_dir), now}).first;
+        }
+        cached = it->second;
+    }
+    if (!slot)
+        slot = &thread_policies[thread_policy_next++ % THREAD_POLICIES];
+    slot->family_dir.assign(family_dir);
+    slot->cached     = cached;
+    slot->generation = generation;
+    return cached.policy;
+}
+
+void reset_family_policies()
+{
+    std::lock_guard<std::mutex> lock(policy_mutex);
+    policies.clear();
+    policy_generation.fetch_add(1, std::memory_order_release);
+}
+
+int fty::shm::set_family_policy(const std::string& family, const FamilyPolicy& policy)
+{
+    if (!valid_family_name(family)) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::string family_dir = family_directory(family.c_str());
+    stat_add(STAT_SYSCALLS);
+    if (mkdir(family_dir.c_str(), 0777) < 0 && errno != EEXIST)
+        return -1;
+
+    char data[128];
+    int  len = snprintf(data, sizeof(data), "max_ttl=%u\npublish=%d\ncleanup=%d\n", policy.max_ttl,
+        policy.publish ? 1 : 0, policy.cleanup ? 1 : 0);
+
+    // Readers see the previous policy or this one
+    std::string path(family_dir + "/" POLICY_FILE);
+    std::string tmp_path(path + "." + std::to_string(getpid()));
+    stat_add(STAT_SYSCALLS, 4); // open, write, close, rename
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return -1;
+    bool ok  = write(fd, data, size_t(len)) == len;
+    int  err = errno;
+    if (close(fd) < 0 && ok) {
+        ok  = false;
+        err = errno;
+    }
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        err = ok ? errno : err;
+        unlink(tmp_path.c_str());
+        errno = err;
+        return -1;
+    }
+
+    // This process sees it right away
+    std::lock_guard<std::mutex> lock(policy_mutex);
+    policies.insert_or_assign(family_dir, CachedPolicy{policy, time(nullptr)});
+    policy_generation.fetch_add(1, std::memory_order_release);
+    return 0;
+}
+
+int fty::shm::get_family_policy(const std::string& family, FamilyPolicy& policy)
+{
+    if (!valid_family_name(family)) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::string family_dir = family_directory(family.c_str());
+    struct stat st;
+    stat_add(STAT_SYSCALLS);
+    if (stat(family_dir.c_str(), &st) < 0)
+        return -1;
+    policy = family_policy((family_dir + "/" POLICY_FILE).c_str());
+    return 0;
+}
+
+int fty::shm::list_families(std::vector<std::string>& families)
+{
+    std::string root = family_directory("");
+    root.pop_back();
+    DIR* dir;
+    stat_add(STAT_SYSCALLS, 2); // open, close
+    if (!(dir = opendir(root.c_str())))
+        return -1;
+    families.clear();
+    struct dirent* de;
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] != '.' && (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN))
+            families.push_back(de->d_name);
+    }
+    closedir(dir);
+    std::sort(families.begin(), families.end());
+    return 0;
+}
+
+fty::shm::Family::Family(const std::string& name)
+    : m_name(name)
+{
+}
+
+bool fty::shm::Family::valid() const
+{
+    return valid_family_name(m_name);
+}
@@ -0,0 +1,331 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Name filters of the metric queries
+
+#include "fty_shm.h"
+#include <ctype.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <regex>
+#include <string.h>
+#include <string_view>
+#include <unordered_set>
+
+// A filter is compiled into the cheapest matcher able to run it:
+//   - ANY for ".*" or "*",
+//   - PATTERN for literal characters, any character ('.' or '?') and any
+//     sequence (".*" or "*"): the pattern is split in parts at the
+//     sequences, the first part must start the name, the last one end it
+//     and the others are searched in between with memmem() (the leftmost
+//     occurrence is always the right one),
+//   - NAMES for alternatives of literals ("ups-1|ups-2") and name sets,
+//   - FNMATCH for the globs with brackets,
+//   - REGEX for the rest.
+// Metric and asset names never contain a NUL, which stands for any
+// character in the parts.
+
+#define ANY_CHAR '\0'
+
+namespace {
+
+enum FilterKind
+{
+    FILTER_ANY,
+    FILTER_PATTERN,
+    FILTER_NAMES,
+    FILTER_FNMATCH,
+    FILTER_REGEX,
+    FILTER_INVALID
+};
+
+struct Part
+{
+    std::string text;
+    // Holds ANY_CHAR
+    bool wild;
+};
+
+bool part_at(const Part& part, const char* name)
+{
+    if (!part.wild)
+        return memcmp(part.text.data(), name, part.text.size()) == 0;
+    for (size_t i = 0; i < part.text.size(); i++) {
+        if (part.text[i] != ANY_CHAR && part.text[i] != name[i])
+            return false;
+    }
+    return true;
+}
+
+// Leftmost occurrence of part in [begin, end), nullptr if none
+const char* find_part(const Part& part, const char* begin, const char* end)
+{
+    size_t len = part.text.size();
+    if (size_t(end - begin) < len)
+        return nullptr;
+    if (!part.wild)
+        return static_cast<const char*>(memmem(begin, size_t(end - begin), part.text.data(), len));
+    for (const char* pos = begin; pos + len <= end; pos++) {
+        if (part_at(part, pos))
+            return pos;
+    }
+    return nullptr;
+}
+
+// Parse re[begin, end) made of literal characters (or escaped ones), '.'
+// and ".*" into parts. Returns false if it uses anything else
+bool parse_regex(const std::string& re, size_t begin, size_t end, std::vector<Part>& parts)
+{
+    parts.assign(1, {std::string(), false});
+    for (size_t i = begin; i < end; i++) {
+        char c = re[i];
+        if (c == '.' && i + 1 < end && re[i + 1] == '*') {
+            // A lazy or possessive sequence is left to the regex engine
+            if (i + 2 < end && strchr("*+?{", re[i + 2]))
+                return false;
+            parts.push_back({std::string(), false});
+            i++;
+            continue;
+        }
+        // A quantified character is left to the regex engine
+        if (i + 1 < end && strchr("*+?{", re[i + 1]))
+            return false;
+        if (c == '.') {
+            parts.back().text.push_back(ANY_CHAR);
+            parts.back().wild = true;
+        } else if (c == '\\') {
+            // \d, \w, \1... are not literals
+            if (i + 1 >= end || isalnum(static_cast<unsigned char>(re[i + 1])))
+                return false;
+            parts.back().text.push_back(re[++i]);
+        } else if (strchr("^$*+?()[]{}|", c)) {
+            return false;
+        } else {
+            parts.back().text.push_back(c);
+        }
+    }
+    return true;
+}
+
+// Parse a glob into parts. Returns false if it has brackets
+bool parse_glob(const std::string& glob, std::vector<Part>& parts)
+{
+    parts.assign(1, {std::string(), false});
+    for (size_t i = 0; i < glob.size(); i++) {
+        char c = glob[i];
+        if (c == '*') {
+            parts.push_back({std::string(), false});
+        } else if (c == '?') {
+            parts.back().text.push_back(ANY_CHAR);
+            parts.back().wild = true;
+        } else if (c == '[') {
+            return false;
+        } else {
+            if (c == '\\' && i + 1 < glob.size())
+                c = glob[++i];
+            parts.back().text.push_back(c);
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+struct fty::shm::Filter::Impl
+{
+    FilterKind  kind = FILTER_ANY;
+    std::string source;
+
+    std::vector<Part> parts;
+    // Length of all the parts
+    size_t min_len = 0;
+
+    std::vector<std::string>             names_storage;
+    std::unordered_set<std::string_view> names;
+
+    std::regex regex;
+
+    void set_parts(std::vector<Part>& new_parts);
+    void set_names(std::vector<std::string> new_names);
+    bool match(const char* name, size_t len) const;
+};
+
+void fty::shm::Filter::Impl::set_parts(std::vector<Part>& new_parts)
+{
+    // Consecutive sequences make empty parts in between
+    parts.clear();
+    for (size_t i = 0; i < new_parts.size(); i++) {
+        if (new_parts[i].text.empty() && i != 0 && i + 1 != new_parts.size())
+            continue;
+        parts.push_back(std::move(new_parts[i]));
+    }
+    min_len = 0;
+    for (auto& part : parts)
+        min_len += part.text.size();
+    kind = (parts.size() == 2 && min_len == 0) ? FILTER_ANY : FILTER_PATTERN;
+}
+
+void fty::shm::Filter::Impl::set_names(std::vector<std::string> new_names)
+{
+    kind          = FILTER_NAMES;
+    names_storage = std::move(new_names);
+    names.clear();
+    for (auto& name : names_storage)
+        names.insert(name);
+}
+
+bool fty::shm::Filter::Impl::match(const char* name, size_t len) const
+{
+    switch (kind) {
+        case FILTER_ANY:
+            return true;
+        case FILTER_PATTERN: {
+            if (len < min_len)
+                return false;
+            const Part& first = parts.front();
+            if (parts.size() == 1)
+                return len == min_len && part_at(first, name);
+            const Part& last = parts.back();
+            const char* end  = name + len - last.text.size();
+            if (!part_at(first, name) || !part_at(last, end))
+                return false;
+            const char* pos = name + first.text.size();
+            for (size_t i = 1; i + 1 < parts.size(); i++) {
+                if (!(pos = find_part(parts[i], pos, end)))
+                    return false;
+                pos += parts[i].text.size();
+            }
+            return true;
+        }
+        case FILTER_NAMES:
+            return names.count(std::string_view(name, len)) != 0;
+        case FILTER_FNMATCH: {
+            char        buf[NAME_MAX + 1];
+            std::string heap;
+            const char* str = buf;
+            if (len < sizeof(buf)) {
+                memcpy(buf, name, len);
+                buf[len] = '\0';
+            } else {
+                heap.assign(name, len);
+                str = heap.c_str();
+            }
+            return fnmatch(source.c_str(), str, 0) == 0;
+        }
+        case FILTER_REGEX:
+            return std::regex_match(name, name + len, regex);
+        case FILTER_INVALID:
+            break;
+    }
+    return false;
+}
+
+fty::shm::Filter::Filter()
+{
+    auto impl    = std::make_shared<Impl>();
+    impl->source = ".*";
+    m_impl       = impl;
+}
+
+fty::shm::Filter::Filter(std::shared_ptr<const Impl> impl)
+    : m_impl(std::move(impl))
+{
+}
+
+fty::shm::Filter::Filter(const std::string& regex)
+{
+    auto impl    = std::make_shared<Impl>();
+    impl->source = regex;
+
+    std::vector<Part> parts;
+    // Alternatives of literals, possibly in a group
+    size_t begin = 0, end = regex.size();
+    if (regex.compare(0, 3, "(?:") == 0 && end > 3 && regex[end - 1] == ')') {
+        begin = 3;
+        end--;
+    } else if (regex.compare(0, 1, "(") == 0 && end > 1 && regex[end - 1] == ')') {
+        begin = 1;
+        end--;
+    }
+    std::vector<std::string> alternatives;
+    bool                     simple = true;
+    for (size_t pos = begin; simple && pos <= end;) {
+        // Next unescaped '|'
+        size_t next = pos;
+        while (next < end && regex[next] != '|')
+            next += (regex[next] == '\\') ? 2 : 1;
+        next = std::min(next, end);
+        simple = parse_regex(regex, pos, next, parts) && parts.size() == 1 && !parts[0].wild;
+        if (simple)
+            alternatives.push_back(parts[0].text);
+        pos = next + 1;
+    }
+    if (simple && (alternatives.size() > 1 || begin != 0)) {
+        impl->set_names(std::move(alternatives));
+    } else if (begin == 0 && parse_regex(regex, 0, regex.size(), parts)) {
+        impl->set_parts(parts);
+    } else {
+        try {
+            impl->regex = std::regex(regex);
+            impl->kind  = FILTER_REGEX;
+        } catch (const std::regex_error& e) {
+            impl->kind = FILTER_INVALID;
+        }
+    }
+    m_impl = impl;
+}
+
+fty::shm::Filter fty::shm::Filter::glob(const std::string& pattern)
+{
+    auto              impl = std::make_shared<Impl>();
+    std::vector<Part> parts;
+    impl->source = pattern;
+    if (parse_glob(pattern, parts))
+        impl->set_parts(parts);
+    else
+        impl->kind = FILTER_FNMATCH;
+    return Filter(impl);
+}
+
+fty::shm::Filter fty::shm::Filter::names(const std::vector<std::string>& names)
+{
+    auto impl = std::make_shared<Impl>();
+    for (auto& name : names) {
+        if (!impl->source.empty())
+            impl->source.append("|");
+        impl->source.append(name);
+    }
+    impl->set_names(names);
+    return Filter(impl);
+}
+
+bool fty::shm::Filter::valid() const
+{
+    return m_impl->kind != FILTER_INVALID;
+}
+
+const std::string& fty::shm::Filter::pattern() const
+{
+    return m_impl->source;
+}
+
+bool fty::shm::Filter::match(const char* name, size_t len) const
+{
+    return m_impl->match(name, len);
+}
@@ -0,0 +1,201 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Streaming scan of the metrics as borrowed views
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include "probes.h"
+#include "stats.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+// The scan reads the ttl, unit and value lines of the metric files in a
+// buffer reused from one metric to the next, and hands out pointers into it:
+// the aux is not parsed, and no fty_proto_t is built.
+
+using namespace fty::shm;
+
+namespace {
+
+// Read the ttl, unit and value lines of the metric file filename into view.
+// Returns false if the metric can't be read or is outdated
+bool read_view(const char* filename, std::string& heap_buf, char* stack_buf, size_t stack_size, MetricView& view)
+{
+    struct stat st;
+    char*       data = stack_buf;
+    size_t      size = stack_size;
+
+    stat_add(STAT_SYSCALLS, 4); // open, fstat, read, close
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        stat_add(errno == ENOENT ? STAT_READ_ENOENT : STAT_READ_ERROR);
+        return false;
+    }
+    if (fstat(fd, &st) < 0) {
+        stat_add(STAT_READ_ERROR);
+        close(fd);
+        return false;
+    }
+    if (size_t(st.st_size) + 1 >= size) {
+        heap_buf.resize(size_t(st.st_size) + 2);
+        data = &heap_buf[0];
+        size = heap_buf.size();
+    }
+    ssize_t len = read(fd, data, size - 1);
+    close(fd);
+    if (len < 0) {
+        stat_add(STAT_READ_ERROR);
+        return false;
+    }
+    data[len] = '\0';
+    stat_add(STAT_BYTES_READ, uint64_t(len));
+
+    // ttl, unit and value lines
+    char*  unit = static_cast<char*>(memchr(data, '\n', size_t(len)));
+    char*  line = unit ? strchr(unit + 1, '\n') : nullptr;
+    time_t ttl;
+    if (!line || unit - data != TTL_LEN - 1) {
+        stat_add(STAT_READ_ERROR);
+        return false;
+    }
+    *unit = '\0';
+    if (parse_ttl(data, ttl) < 0) {
+        stat_add(STAT_READ_ERROR);
+        return false;
+    }
+    if (ttl && time(nullptr) - st.st_mtime > ttl) {
+        stat_add(STAT_READ_ESTALE);
+        remove_stale(filename);
+        return false;
+    }
+    *line      = '\0';
+    view.unit  = unit + 1;
+    view.value = line + 1;
+    view.ttl   = uint32_t(ttl);
+    view.time  = uint64_t(st.st_mtime);
+    line       = strchr(line + 1, '\n');
+    if (line)
+        *line = '\0';
+    stat_add(STAT_READ);
+    return true;
+}
+
+} // namespace
+
+int scan_views(const char* family, const Filter& asset, const Filter& metric, const MetricViewVisitor& visitor)
+{
+    if (!asset.valid() || !metric.valid()) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    std::string family_dir = family_directory(family);
+    DIR*        dir;
+    FTY_SHM_PROBE3(read_family_entry, family, asset.pattern().c_str(), metric.pattern().c_str());
+    stat_add(STAT_SCAN);
+    stat_add(STAT_SYSCALLS, 2); // open, close
+    if (!(dir = opendir(family_dir.c_str()))) {
+        FTY_SHM_PROBE3(read_family_return, family, -1, 0);
+        return -1;
+    }
+
+    std::string filename(family_dir);
+    filename.append("/");
+    size_t         dir_len = filename.length();
+    std::string    heap_buf, metric_name;
+    char           stack_buf[1024];
+    size_t         count = 0;
+    bool           stop  = false;
+    struct dirent* de;
+    while (!stop && (de = readdir(dir))) {
+        stat_add(STAT_SCAN_ENTRIES);
+        const char* delim = strchr(de->d_name, '@');
+        if (de->d_name[0] == '.' || !delim)
+            continue;
+        filename.resize(dir_len);
+        filename.append(de->d_name);
+
+        MetricView view;
+        view.asset = delim + 1;
+        if (delim == de->d_name) {
+            if (!asset.match(delim + 1, strlen(delim + 1)))
+                continue;
+            BundleReader reader;
+            if (reader.open(filename.c_str()) < 0)
+                continue;
+            time_t now = time(nullptr);
+            if (reader.outdated(now)) {
+                stat_add(STAT_READ_ESTALE);
+                remove_stale(filename.c_str());
+                continue;
+            }
+            while (reader.next()) {
+                if (!reader.valid(now) || !metric.match(reader.metric(), strlen(reader.metric())))
+                    continue;
+                stat_add(STAT_READ);
+                view.metric = reader.metric();
+                view.value  = reader.value();
+                view.unit   = reader.unit();
+                view.ttl    = uint32_t(reader.ttl());
+                view.time   = uint64_t(reader.time());
+                count++;
+                if (!visitor(view)) {
+                    stop = true;
+                    break;
+                }
+            }
+            continue;
+        }
+        if (!match_metric_filename(de->d_name, delim, asset, metric) ||
+            !read_view(filename.c_str(), heap_buf, stack_buf, sizeof(stack_buf), view))
+            continue;
+        metric_name.assign(de->d_name, size_t(delim - de->d_name));
+        view.metric = metric_name.c_str();
+        count++;
+        stop = !visitor(view);
+    }
+    closedir(dir);
+    FTY_SHM_PROBE3(read_family_return, family, 0, count);
+    return 0;
+}
+
+int fty::shm::for_each_metric(const Filter& asset, const Filter& metric, const MetricViewVisitor& visitor)
+{
+    return scan_views(FTY_SHM_METRIC_TYPE, asset, metric, visitor);
+}
+
+int fty::shm::for_each_metric(const std::string& asset, const std::string& metric, const MetricViewVisitor& visitor)
+{
+    return for_each_metric(Filter(asset), Filter(metric), visitor);
+}
+
+int fty_shm_for_each_metric(const char* asset, const char* metric, fty_shm_metric_callback_t callback, void* arg)
+{
+    if (!asset || !metric || !callback) {
+        errno = EINVAL;
+        return -1;
+    }
+    return for_each_metric(Filter(asset), Filter(metric), [callback, arg](const MetricView& view) {
+        return callback(&view, arg) == 0;
+    });
+}
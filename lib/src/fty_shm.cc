@@ -23,25 +23,25 @@
 
 #include "fty_shm.h"
 #include <assert.h>
-#include <regex>
 
 #include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include "probes.h"
 #include "publisher.h"
+#include "stats.h"
 
+#include <atomic>
 #include <cstring>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <set>
+#include <unistd.h>
 
 #define DEFAULT_SHM_DIR "/run/42shm"
 
 #define SEPARATOR     '@'
 #define SEPARATOR_LEN 1
 
-// The first 11 bytes of each file are the ttl in 10 decimal digits, followed
-// by \n.  This is a compromise between machine and human readability
-#define TTL_FMT "%010d\n"
-#define TTL_LEN 11
-
-#define UNIT_FMT "%s\n"
-
 // Convenience macros
 #define FREE(x) (free(x), (x) = nullptr)
 
@@ -71,10 +71,26 @@ int fty_get_polling_interval()
 static const char* shm_dir     = DEFAULT_SHM_DIR;
 static size_t      shm_dir_len = strlen(DEFAULT_SHM_DIR);
 
-static int prepare_filename(
+std::string family_directory(const char* family)
+{
+    std::string dir(shm_dir);
+    dir.append("/").append(family);
+    return dir;
+}
+
+bool in_default_family(const char* filename)
+{
+    return strncmp(filename, shm_dir, shm_dir_len) == 0 && filename[shm_dir_len] == '/' &&
+           strncmp(filename + shm_dir_len + 1, FTY_SHM_METRIC_TYPE "/", sizeof(FTY_SHM_METRIC_TYPE)) == 0 &&
+           !strchr(filename + shm_dir_len + sizeof(FTY_SHM_METRIC_TYPE) + 1, '/');
+}
+
+int prepare_filename(
     char* buf, const char* asset, size_t a_len, const char* metric, size_t m_len, const char* type)
 {
-    if (m_len + SEPARATOR_LEN + a_len > NAME_MAX) {
+    size_t t_len = strlen(type);
+    if (m_len + SEPARATOR_LEN + a_len > NAME_MAX || t_len > NAME_MAX ||
+        shm_dir_len + t_len + m_len + SEPARATOR_LEN + a_len + 3 > PATH_MAX) {
         errno = ENAMETOOLONG;
         return -1;
     }
@@ -88,8 +104,8 @@ static int prepare_filename(
     p += shm_dir_len;
 
     *p++ = '/';
-    memcpy(p, type, strlen(type));
-    p += strlen(type);
+    memcpy(p, type, t_len);
+    p += t_len;
 
     *p++ = '/';
     memcpy(p, metric, m_len);
@@ -101,36 +117,183 @@ static int prepare_filename(
     return 0;
 }
 
-// Write ttl and value to filename
-static int write_value(const char* filename, const char* value, const char* unit, int ttl)
+std::string temporary_filename(const char* filename)
+{
+    static std::atomic<unsigned> tmp_count{0};
+
+    const char* name = strrchr(filename, '/') + 1;
+    std::string tmp_filename(filename, size_t(name - filename));
+    tmp_filename.append(".tmp.").append(std::to_string(getpid())).append(".");
+    tmp_filename.append(std::to_string(tmp_count.fetch_add(1, std::memory_order_relaxed)));
+    return tmp_filename;
+}
+
+// Replace filename by data in one rename, so that readers never see a
+// partially written metric. The written file is remembered to skip the
+// next write if it is the same, unless it is given a mtime (not 0)
+static int replace_file(const char* filename, const std::string& data, time_t mtime = 0)
 {
-    FILE* file = fopen(filename, "w");
-    if (file == nullptr)
+    const char* name         = strrchr(filename, '/') + 1;
+    std::string tmp_filename = temporary_filename(filename);
+
+    bool        remember = write_cache_enabled() && !mtime;
+    struct stat st;
+    stat_add(STAT_SYSCALLS, remember || mtime ? 5 : 4); // open, write, fstat or futimens, close, rename
+    int fd = open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0 && errno == ENOENT) {
+        // First write to a family
+        stat_add(STAT_SYSCALLS);
+        mkdir(std::string(filename, size_t(name - filename - 1)).c_str(), 0777);
+        fd = open(tmp_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    if (fd < 0) {
+        stat_add(STAT_WRITE_ERROR);
+        return -1;
+    }
+    ssize_t len = write(fd, data.data(), data.size());
+    bool    ok  = len >= 0 && size_t(len) == data.size();
+    if (!ok && len >= 0)
+        errno = ENOSPC;
+    int err = errno;
+    if (ok && remember && fstat(fd, &st) < 0)
+        remember = false;
+    if (ok && mtime) {
+        // Before the rename, so that it is never seen with another mtime
+        struct timespec times[2];
+        times[0].tv_sec  = mtime;
+        times[0].tv_nsec = 0;
+        times[1]         = times[0];
+        if (futimens(fd, times) < 0) {
+            ok  = false;
+            err = errno;
+        }
+    }
+    if (close(fd) < 0 && ok) {
+        ok  = false;
+        err = errno;
+    }
+    if (ok && rename(tmp_filename.c_str(), filename) < 0) {
+        ok  = false;
+        err = errno;
+    }
+    if (!ok) {
+        unlink(tmp_filename.c_str());
+        errno = err;
+        stat_add(STAT_WRITE_ERROR);
         return -1;
+    }
+    if (remember)
+        remember_write(filename, data, st);
+    stat_add(STAT_WRITE);
+    stat_add(STAT_BYTES_WRITTEN, uint64_t(len));
+    return 0;
+}
+
+// Write data to filename, or only refresh its mtime if this process wrote
+// the same data last
+static int store_file(const char* filename, const std::string& data)
+{
+    if (write_cache_enabled() && refresh_unchanged(filename, data)) {
+        stat_add(STAT_WRITE_UNCHANGED);
+        return 0;
+    }
+    return replace_file(filename, data);
+}
+
+int policy_ttl(const FamilyPolicy& policy, int ttl)
+{
     if (ttl < 0)
         ttl = 0;
-    std::string fmt(TTL_FMT);
-    fmt.append(UNIT_FMT).append("%s");
-    fprintf(file, fmt.c_str(), ttl, unit, value);
-    if(fclose(file) < 0)
+    if (policy.max_ttl && (ttl == 0 || uint32_t(ttl) > policy.max_ttl))
+        ttl = int(policy.max_ttl);
+    return ttl;
+}
+
+// Write ttl and value to filename
+static int write_value(const char* filename, const char* value, const char* unit, int ttl)
+{
+    FTY_SHM_PROBE1(write_value_entry, filename);
+    FamilyPolicy policy = family_policy(filename);
+    ttl                 = policy_ttl(policy, ttl);
+    char header[TTL_LEN + 1];
+    snprintf(header, sizeof(header), TTL_FMT, ttl);
+    std::string data(header);
+    data.append(unit).append("\n").append(value);
+    if (store_file(filename, data) < 0) {
+        FTY_SHM_PROBE2(write_value_return, filename, -1);
         return -1;
+    }
 
-    Publisher::publishMetric(filename, value, unit, static_cast<uint32_t>(ttl)); //mqtt-pub
+    log_update(filename, value, unit, static_cast<uint32_t>(ttl));
+    record_history(filename, value, static_cast<uint32_t>(ttl));
+    if (policy.publish)
+        Publisher::publishMetric(filename, value, unit, static_cast<uint32_t>(ttl)); //mqtt-pub
+    FTY_SHM_PROBE2(write_value_return, filename, 0);
     return 0;
 }
 
-static char* dup_str(char* str, char*)
+void remove_stale(const char* filename)
+{
+    char* valenv = getenv("FTY_SHM_AUTOCLEAN");
+    if ((!valenv || strcmp(valenv, "OFF") != 0) && family_policy(filename).cleanup) {
+        stat_add(STAT_SYSCALLS);
+        int r = remove(filename);
+        if (r == 0)
+            stat_add(STAT_STALE_REMOVED);
+        FTY_SHM_PROBE2(stale_remove, filename, r);
+    }
+}
+
+// Account a failed read, errno being set by the failing call
+static void stat_read_error()
+{
+    if (errno == ESTALE)
+        stat_add(STAT_READ_ESTALE);
+    else
+        stat_add(errno == ENOENT ? STAT_READ_ENOENT : STAT_READ_ERROR);
+}
+
+static char* dup_str(const char* str, char*)
 {
     return strdup(str);
 }
 
 // When working with std::string, we do not want to call strdup
-static char* dup_str(char* str, std::string)
+static const char* dup_str(const char* str, std::string)
 {
     return str;
 }
 
-static int parse_ttl(char* ttl_str, time_t& ttl)
+// Read a metric without file from the bundle of its asset
+template <typename T>
+static int read_value_bundle(const char* filename, T& value, T& unit, bool need_unit)
+{
+    BundleReader reader;
+    if (find_in_bundle(filename, reader) < 0) {
+        stat_read_error();
+        return -1;
+    }
+    if (need_unit) {
+        unit = dup_str(reader.unit(), T());
+    }
+    value = dup_str(reader.value(), T());
+    stat_add(STAT_READ);
+    return 0;
+}
+
+static int read_data_bundle(const char* filename, fty_proto_t* proto_metric)
+{
+    BundleReader reader;
+    if (find_in_bundle(filename, reader) < 0) {
+        stat_read_error();
+        return -1;
+    }
+    reader.fill(proto_metric);
+    stat_add(STAT_READ);
+    return 0;
+}
+
+int parse_ttl(char* ttl_str, time_t& ttl)
 {
     char* err;
     int   res;
@@ -150,20 +313,40 @@ static int parse_ttl(char* ttl_str, time_t& ttl)
 
 // XXX: The error codes are somewhat arbitrary
 template <typename T>
-static int read_value(const char* filename, T& value, T& unit, bool need_unit = true)
+static int read_value_file(const char* filename, T& value, T& unit, bool need_unit)
 {
     int         ret = -1;
     struct stat st;
     FILE*       file = nullptr;
     char        buf[128];
+    char        value_buf[128];
     time_t      now, ttl;
     int         len;
 
+    if (read_cache_enabled()) {
+        std::string cached_value, cached_unit;
+        if (read_cache_get(filename, cached_value, cached_unit)) {
+            if (need_unit) {
+                unit = dup_str(cached_unit.c_str(), T());
+            }
+            value = dup_str(cached_value.c_str(), T());
+            stat_add(STAT_READ);
+            return 0;
+        }
+    }
+
+    stat_add(STAT_SYSCALLS);
     file = fopen(filename, "r");
-    if (file == nullptr)
+    if (file == nullptr) {
+        if (errno == ENOENT)
+            return read_value_bundle(filename, value, unit, need_unit);
+        stat_read_error();
         return -1;
+    }
+    stat_add(STAT_SYSCALLS, 3); // fstat, read, close
     if (fstat(fileno(file), &st) < 0)
         goto shm_out_fd;
+    stat_add(STAT_BYTES_READ, uint64_t(st.st_size));
 
     // get ttl
     fgets(buf, sizeof(buf), file);
@@ -177,9 +360,8 @@ static int read_value(const char* filename, T& value, T& unit, bool need_unit =
         if (now - st.st_mtime > ttl) {
             errno = ESTALE;
             fclose(file);
-            char* valenv = getenv("FTY_SHM_AUTOCLEAN");
-            if (!valenv || strcmp(valenv, "OFF") != 0)
-                remove(filename);
+            stat_add(STAT_READ_ESTALE);
+            remove_stale(filename);
             return -1;
         }
     }
@@ -194,47 +376,64 @@ static int read_value(const char* filename, T& value, T& unit, bool need_unit =
         unit = dup_str(buf, T());
     }
     // get value
-    fgets(buf, sizeof(buf), file);
-    value = dup_str(buf, T());
+    value_buf[0] = '\0';
+    fgets(value_buf, sizeof(value_buf), file);
+    // Delete the '\n' (there is one when aux follow)
+    value_buf[strcspn(value_buf, "\n")] = '\0';
+    value = dup_str(value_buf, T());
     fclose(file);
+    if (read_cache_enabled())
+        read_cache_put(filename, st, ttl, buf, value_buf);
+    stat_add(STAT_READ);
     return 0;
 
 shm_out_fd:
+    stat_read_error();
     fclose(file);
     return ret;
 }
 
-int read_data_metric(const char* filename, fty_proto_t* proto_metric)
+template <typename T>
+static int read_value(const char* filename, T& value, T& unit, bool need_unit = true)
 {
-    int         ret = -1;
-    struct stat st;
-    FILE*       file = nullptr;
-    char        buf[128];
-    char        bufVal[128];
-    time_t      now, ttl;
-    int         len;
+    FTY_SHM_PROBE1(read_value_entry, filename);
+    int ret = read_value_file(filename, value, unit, need_unit);
+    FTY_SHM_PROBE3(read_value_return, filename, ret, ret ? errno : 0);
+    return ret;
+}
 
-    file = fopen(filename, "r");
-    if (file == nullptr)
-        return -1;
-    if (fstat(fileno(file), &st) < 0)
-        goto shm_out_fd;
+int parse_metric_data(const char* filename, char* data, size_t len, time_t mtime, fty_proto_t* proto_metric)
+{
+    char*  end = data + len;
+    char*  p   = data;
+    time_t ttl;
+
+    // Cut the next line (the last one has no \n)
+    auto next_line = [&p, end]() {
+        char* line = p;
+        char* nl   = static_cast<char*>(memchr(p, '\n', size_t(end - p)));
+        if (nl) {
+            *nl = '\0';
+            p   = nl + 1;
+        } else {
+            p = end;
+        }
+        return line;
+    };
 
     // get ttl
-    fgets(buf, sizeof(buf), file);
-
-    if (parse_ttl(buf, ttl) < 0)
-        goto shm_out_fd;
+    char* ttl_str = next_line();
+    if (strlen(ttl_str) != TTL_LEN - 1 || parse_ttl(ttl_str, ttl) < 0) {
+        errno = ERANGE;
+        return -1;
+    }
 
     // data still valid ?
     if (ttl) {
-        now = time(nullptr);
-        if (now - st.st_mtime > ttl) {
+        if (time(nullptr) - mtime > ttl) {
             errno = ESTALE;
-            fclose(file);
-            char* valenv = getenv("FTY_SHM_AUTOCLEAN");
-            if (!valenv || strcmp(valenv, "OFF") != 0)
-                remove(filename);
+            stat_add(STAT_READ_ESTALE);
+            remove_stale(filename);
             return -1;
         }
     }
@@ -242,47 +441,90 @@ int read_data_metric(const char* filename, fty_proto_t* proto_metric)
     // set ttl
     fty_proto_set_ttl(proto_metric, uint32_t(ttl));
     // set timestamp
-    fty_proto_set_time(proto_metric, uint64_t(st.st_mtim.tv_sec));
-
-    // get unit
-    fgets(buf, sizeof(buf), file);
-    // Delete the '\n'
-    len = int(strlen(buf) - 1);
-    if (buf[len] == '\n')
-        buf[len] = '\0';
-    fty_proto_set_unit(proto_metric, "%s", buf); // unit can be "%" (ex.: load.default@ups-xxx)
-
-    // get value
-    fgets(buf, sizeof(buf), file);
-    // Delete the '\n'
-    len = int(strlen(buf) - 1);
-    if (buf[len] == '\n')
-        buf[len] = '\0';
-
-    fty_proto_set_value(proto_metric, buf);
+    fty_proto_set_time(proto_metric, uint64_t(mtime));
+
+    // unit can be "%" (ex.: load.default@ups-xxx)
+    fty_proto_set_unit(proto_metric, "%s", next_line());
+    fty_proto_set_value(proto_metric, "%s", next_line());
+    // Version of a conditional write
+    if (size_t(end - p) > VERSION_KEY_LEN && memcmp(p, VERSION_KEY "\n", VERSION_KEY_LEN + 1) == 0) {
+        next_line();
+        next_line();
+    }
 
-    while (fgets(buf, sizeof(buf), file) != nullptr) {
-        if (fgets(bufVal, sizeof(bufVal), file) == nullptr) {
-            break;
+    if (p < end && *p == AUX_COMPACT_MARKER) {
+        if (!decode_aux(filename, p + 1, size_t(end - p - 1), proto_metric)) {
+            errno = EBADMSG;
+            return -1;
         }
+        return 0;
+    }
+    // Text aux, as key and value lines
+    while (p < end) {
+        char* key = next_line();
+        // A key without value line
+        if (p >= end)
+            break;
+        fty_proto_aux_insert(proto_metric, key, "%s", next_line());
+    }
+    return 0;
+}
 
-        // Delete the '\n'
-        len = int(strlen(buf) - 1);
-        if (buf[len] == '\n')
-            buf[len] = '\0';
+static int read_data_file(const char* filename, fty_proto_t* proto_metric)
+{
+    struct stat st;
+    // Most metrics fit, the others are read in a heap buffer
+    char        stack_buf[1024];
+    std::string heap_buf;
+    char*       data = stack_buf;
+    size_t      size = sizeof(stack_buf);
+
+    if (read_cache_enabled() && read_cache_get(filename, proto_metric)) {
+        stat_add(STAT_READ);
+        return 0;
+    }
 
-        len = int(strlen(bufVal) - 1);
-        if (bufVal[len] == '\n')
-            bufVal[len] = '\0';
+    stat_add(STAT_SYSCALLS);
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return read_data_bundle(filename, proto_metric);
+        stat_read_error();
+        return -1;
+    }
+    stat_add(STAT_SYSCALLS, 3); // fstat, read, close
+    if (fstat(fd, &st) < 0) {
+        stat_read_error();
+        close(fd);
+        return -1;
+    }
+    if (size_t(st.st_size) + 1 >= size) {
+        // One more byte to notice a concurrent growth, and the terminator
+        heap_buf.resize(size_t(st.st_size) + 2);
+        data = &heap_buf[0];
+        size = heap_buf.size();
+    }
+    ssize_t len = read(fd, data, size - 1);
+    int     err = errno;
+    close(fd);
+    if (len < 0) {
+        errno = err;
+        stat_read_error();
+        return -1;
+    }
+    data[len] = '\0';
+    stat_add(STAT_BYTES_READ, uint64_t(len));
 
-        fty_proto_aux_insert(proto_metric, buf, "%s", bufVal);
+    if (parse_metric_data(filename, data, size_t(len), st.st_mtime, proto_metric) < 0) {
+        if (errno != ESTALE)
+            stat_read_error();
+        return -1;
     }
-    fclose(file);
+    // Not what was read if the file changed meanwhile
+    if (read_cache_enabled() && len == st.st_size)
+        read_cache_put(filename, st, proto_metric);
+    stat_add(STAT_READ);
     return 0;
-
-shm_out_fd:
-    fclose(file);
-    return ret;
 }
 
 int fty_shm_write_metric(const char* asset, const char* metric, const char* value, const char* unit, int ttl)
@@ -307,76 +549,261 @@ int fty_shm_read_metric(const char* asset, const char* metric, char** value, cha
     return read_value(filename, *value, *unit);
 }
 
-int fty_shm_read_family(const char* family, std::string asset, std::string type, fty::shm::shmMetrics& result)
+int read_data_metric(const char* filename, fty_proto_t* proto_metric)
 {
-    std::string family_dir = shm_dir;
-    family_dir.append("/");
-    family_dir.append(family);
-    DIR* dir;
-    if (!(dir = opendir(family_dir.c_str())))
+    FTY_SHM_PROBE1(read_data_metric_entry, filename);
+    int ret = read_data_file(filename, proto_metric);
+    FTY_SHM_PROBE3(read_data_metric_return, filename, ret, ret ? errno : 0);
+    return ret;
+}
+
+bool match_metric_filename(const char* filename, const char* delim, const Filter& asset, const Filter& type)
+{
+    return asset.match(delim + 1, strlen(delim + 1)) && type.match(filename, size_t(delim - filename));
+}
+
+bool scan_bundle(const char* filename, const char* asset, const Filter& type, fty_proto_t*& proto_metric,
+    const ScanVisitor& visitor, ProtoPool* pool)
+{
+    BundleReader reader;
+    if (reader.open(filename) < 0) {
+        stat_read_error();
+        return true;
+    }
+    time_t now = time(nullptr);
+    if (reader.outdated(now)) {
+        stat_add(STAT_READ_ESTALE);
+        remove_stale(filename);
+        return true;
+    }
+    while (reader.next()) {
+        if (!reader.valid(now) || !type.match(reader.metric(), strlen(reader.metric())))
+            continue;
+        if (!proto_metric)
+            proto_metric = pool ? pool->acquire() : fty_proto_new(FTY_PROTO_METRIC);
+        else if (fty_proto_aux(proto_metric))
+            zhash_purge(fty_proto_aux(proto_metric));
+        reader.fill(proto_metric);
+        fty_proto_set_name(proto_metric, "%s", asset);
+        fty_proto_set_type(proto_metric, "%s", reader.metric());
+        stat_add(STAT_READ);
+        if (!visitor(proto_metric))
+            return false;
+    }
+    return true;
+}
+
+int scan_family(
+    const char* family, const Filter& asset, const Filter& type, const ScanVisitor& visitor, ProtoPool* pool)
+{
+    if (!asset.valid() || !type.valid())
         return -1;
 
-    try {
+    std::string family_dir = family_directory(family);
+    DIR*        dir;
+    stat_add(STAT_SCAN);
+    stat_add(STAT_SYSCALLS, 2); // open, close
+    if (!(dir = opendir(family_dir.c_str())))
+        return -1;
 
-        struct dirent* de;
-        std::regex regType(type);
-        std::regex regAsset(asset);
-        while ((de = readdir(dir))) {
-            const char* delim = strchr(de->d_name, SEPARATOR);
-            // If not a valid metric
-            if (!delim)
+    fty_proto_t*   proto_metric = nullptr;
+    struct dirent* de;
+    std::string    filename(family_dir);
+    filename.append("/");
+    size_t dir_len = filename.length();
+    while ((de = readdir(dir))) {
+        stat_add(STAT_SCAN_ENTRIES);
+        // Skip the temporary files
+        if (de->d_name[0] == '.')
+            continue;
+        const char* delim = strchr(de->d_name, SEPARATOR);
+        // If not a valid metric
+        if (!delim)
+            continue;
+        if (delim == de->d_name) {
+            if (!asset.match(delim + 1, strlen(delim + 1)))
                 continue;
-            size_t type_name = size_t(delim - de->d_name);
-            if (std::regex_match(std::string(delim + 1), regAsset) &&
-                std::regex_match(std::string(de->d_name, type_name), regType)) {
-                fty_proto_t* proto_metric = fty_proto_new(FTY_PROTO_METRIC);
-                std::string  filename(family_dir);
-                filename.append("/").append(de->d_name);
-                if (read_data_metric(filename.c_str(), proto_metric) == 0) {
-                    fty_proto_set_name(proto_metric, "%s", std::string(delim + 1).c_str());
-                    fty_proto_set_type(proto_metric, "%s", std::string(de->d_name, type_name).c_str());
-                    result.add(proto_metric);
-                } else {
-                    fty_proto_destroy(&proto_metric);
-                }
-            }
+            filename.resize(dir_len);
+            filename.append(de->d_name);
+            if (!scan_bundle(filename.c_str(), delim + 1, type, proto_metric, visitor, pool))
+                break;
+            continue;
         }
-    } catch (const std::regex_error& e) {
-        closedir(dir);
-        return -1;
+        if (!match_metric_filename(de->d_name, delim, asset, type))
+            continue;
+        filename.resize(dir_len);
+        filename.append(de->d_name);
+        if (!proto_metric)
+            proto_metric = pool ? pool->acquire() : fty_proto_new(FTY_PROTO_METRIC);
+        else if (fty_proto_aux(proto_metric))
+            zhash_purge(fty_proto_aux(proto_metric));
+        if (read_data_metric(filename.c_str(), proto_metric) != 0)
+            continue;
+        fty_proto_set_name(proto_metric, "%s", delim + 1);
+        fty_proto_set_type(proto_metric, "%.*s", int(delim - de->d_name), de->d_name);
+        if (!visitor(proto_metric))
+            break;
     }
+    if (pool && proto_metric)
+        pool->release(proto_metric);
+    else
+        fty_proto_destroy(&proto_metric);
     closedir(dir);
     return 0;
 }
 
+static int read_family(
+    const char* family, const Filter& asset, const Filter& type, shmMetrics& result, ProtoPool* pool)
+{
+    return scan_family(
+        family, asset, type,
+        [&result](fty_proto_t*& proto_metric) {
+            result.add(proto_metric);
+            proto_metric = nullptr;
+            return true;
+        },
+        pool);
+}
+
+static int fty_shm_read_family(
+    const char* family, const Filter& asset, const Filter& type, shmMetrics& result, ProtoPool* pool = nullptr)
+{
+    FTY_SHM_PROBE3(read_family_entry, family, asset.pattern().c_str(), type.pattern().c_str());
+    size_t count = result.size();
+    int    ret   = read_family(family, asset, type, result, pool);
+    FTY_SHM_PROBE3(read_family_return, family, ret, result.size() - count);
+    return ret;
+}
+
 int fty::shm::read_metrics(const std::string& asset, const std::string& type, shmMetrics& result)
 {
-    std::string family(FTY_SHM_METRIC_TYPE);
-    if (family == "*") {
-        DIR*           dir;
-        struct dirent* de_root;
-        if (!(dir = opendir(shm_dir)))
-            return -1;
-        dirfd(dir);
-        while ((de_root = readdir(dir))) {
-            fty_shm_read_family(de_root->d_name, asset, type, result);
+    return read_metrics(Filter(asset), Filter(type), result);
+}
+
+int fty::shm::read_metrics(const std::string& asset, const std::string& type, PooledMetrics& result)
+{
+    return read_metrics(Filter(asset), Filter(type), result);
+}
+
+int fty::shm::read_metrics(const Filter& asset, const Filter& type, shmMetrics& result)
+{
+    fty_shm_read_family(FTY_SHM_METRIC_TYPE, asset, type, result);
+    return 0;
+}
+
+int fty::shm::read_metrics(const Filter& asset, const Filter& type, PooledMetrics& result)
+{
+    fty_shm_read_family(FTY_SHM_METRIC_TYPE, asset, type, result, result.pool());
+    return 0;
+}
+
+int fty::shm::read_metrics(const std::string& asset, const std::string& type, const MetricVisitor& visitor)
+{
+    return read_metrics(Filter(asset), Filter(type), visitor);
+}
+
+int fty::shm::read_metrics(const Filter& asset, const Filter& type, const MetricVisitor& visitor)
+{
+    FTY_SHM_PROBE3(read_family_entry, FTY_SHM_METRIC_TYPE, asset.pattern().c_str(), type.pattern().c_str());
+    // One fty_proto_t for the whole scan, lent to the visitor
+    size_t count = 0;
+    int    ret   = scan_family(FTY_SHM_METRIC_TYPE, asset, type, [&](fty_proto_t*& proto_metric) {
+        count++;
+        return visitor(proto_metric);
+    });
+    FTY_SHM_PROBE3(read_family_return, FTY_SHM_METRIC_TYPE, ret, count);
+    return ret;
+}
+
+// Check the ttl header of a metric file, without reading the rest of it
+static bool metric_file_valid(int dir_fd, const char* name, time_t now)
+{
+    char        buf[TTL_LEN + 1];
+    struct stat st;
+    time_t      ttl;
+
+    stat_add(STAT_SYSCALLS, 4); // open, fstat, read, close
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    bool valid = fstat(fd, &st) == 0 && pread(fd, buf, TTL_LEN, 0) == TTL_LEN;
+    close(fd);
+    if (!valid)
+        return false;
+    buf[TTL_LEN] = '\0';
+    if (parse_ttl(buf, ttl) < 0)
+        return false;
+    return ttl == 0 || now - st.st_mtime <= ttl;
+}
+
+// Collect asset names (asset == nullptr) or the metric names of asset from
+// the directory entries of the default family
+static int list_names(const std::string* asset, std::vector<std::string>& result, bool check_ttl)
+{
+    std::string family_dir = family_directory(FTY_SHM_METRIC_TYPE);
+    DIR*        dir;
+    stat_add(STAT_SCAN);
+    stat_add(STAT_SYSCALLS, 2); // open, close
+    if (!(dir = opendir(family_dir.c_str())))
+        return -1;
+
+    std::set<std::string> names;
+    time_t                now = time(nullptr);
+    struct dirent*        de;
+    while ((de = readdir(dir))) {
+        stat_add(STAT_SCAN_ENTRIES);
+        // Skip the temporary files
+        if (de->d_name[0] == '.')
+            continue;
+        const char* delim = strchr(de->d_name, SEPARATOR);
+        // If not a valid metric
+        if (!delim)
+            continue;
+        if (asset && *asset != delim + 1)
+            continue;
+        // The metric names of a bundle are in its records
+        if (asset && delim == de->d_name) {
+            BundleReader reader;
+            std::string  filename(family_dir);
+            filename.append("/").append(de->d_name);
+            if (reader.open(filename.c_str()) < 0)
+                continue;
+            while (reader.next()) {
+                if (!check_ttl || reader.valid(now))
+                    names.insert(reader.metric());
+            }
+            continue;
         }
-    } else {
-        fty_shm_read_family(family.c_str(), asset, type, result);
+        std::string name = asset ? std::string(de->d_name, size_t(delim - de->d_name)) : std::string(delim + 1);
+        // No need to check again an asset already known to be valid
+        if (!asset && names.count(name))
+            continue;
+        if (check_ttl && !metric_file_valid(dirfd(dir), de->d_name, now))
+            continue;
+        names.insert(name);
     }
+    closedir(dir);
+    result.assign(names.begin(), names.end());
     return 0;
 }
 
-int fty_shm_delete_test_dir()
+int fty::shm::list_assets(std::vector<std::string>& assets, bool check_ttl)
 {
-    if (strcmp(shm_dir, DEFAULT_SHM_DIR) == 0)
-        return -2;
+    return list_names(nullptr, assets, check_ttl);
+}
+
+int fty::shm::list_metrics(const std::string& asset, std::vector<std::string>& metrics, bool check_ttl)
+{
+    return list_names(&asset, metrics, check_ttl);
+}
 
+// Remove the metrics of a family directory and its side files
+static void delete_family_dir(const std::string& metric_dir)
+{
     struct dirent* entry = nullptr;
-    DIR*           dir   = nullptr;
-    std::string    metric_dir(shm_dir);
-    metric_dir.append("/").append(FTY_SHM_METRIC_TYPE);
-    dir = opendir(metric_dir.c_str());
+    DIR*           dir   = opendir(metric_dir.c_str());
+    if (!dir)
+        return;
 
     entry = readdir(dir);
     while (entry != nullptr) {
@@ -393,7 +820,43 @@ int fty_shm_delete_test_dir()
         entry = readdir(dir);
     }
     closedir(dir);
+    remove((metric_dir + "/" AUX_KEYS_FILE).c_str());
+    std::string history_dir(metric_dir + "/" HISTORY_DIR);
+    if ((dir = opendir(history_dir.c_str()))) {
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] != '.')
+                remove((history_dir + "/" + entry->d_name).c_str());
+        }
+        closedir(dir);
+        remove(history_dir.c_str());
+    }
+    remove((metric_dir + "/" UPDATE_LOG_FILE).c_str());
+    remove((metric_dir + "/" POLICY_FILE).c_str());
     remove(metric_dir.c_str());
+}
+
+int fty_shm_delete_test_dir()
+{
+    if (strcmp(shm_dir, DEFAULT_SHM_DIR) == 0)
+        return -2;
+
+    // The test directory may hold other directories: only the default family
+    // and the ones with a policy are removed
+    std::vector<std::string> families;
+    list_families(families);
+    for (auto& family : families) {
+        std::string family_dir = family_directory(family.c_str());
+        if (family == FTY_SHM_METRIC_TYPE || access((family_dir + "/" POLICY_FILE).c_str(), F_OK) == 0)
+            delete_family_dir(family_dir);
+    }
+    reset_aux_keys();
+    reset_history();
+    reset_update_log();
+    reset_read_cache();
+    reset_write_cache();
+    reset_family_policies();
+    reset_publish_mode();
+    rmdir(family_directory(SUBSCRIBERS_DIR).c_str());
     return remove(shm_dir);
 }
 
@@ -426,32 +889,132 @@ int fty_shm_set_test_dir(const char* dir)
     return 0;
 }
 
-// Write ttl and value to filename
+// Format the metric file of metric, with ttl and version (none if 0), in
+// data. Returns the offset of the version marker
+static size_t format_metric(const char* filename, fty_proto_t* metric, int ttl, std::string& data, uint64_t version = 0)
+{
+
+    // The whole content is formatted first, for a single write
+    char header[TTL_LEN + 1];
+    snprintf(header, sizeof(header), TTL_FMT, ttl);
+    data.assign(header);
+    data.append(fty_proto_unit(metric)).append("\n").append(fty_proto_value(metric));
+    size_t marker = 0;
+    if (version) {
+        char line[VERSION_KEY_LEN + VERSION_LEN + 4];
+        snprintf(line, sizeof(line), "\n" VERSION_KEY "\n%c%0*" PRIu64, VERSION_MARKER, VERSION_LEN, version);
+        marker = data.size() + VERSION_KEY_LEN + 2;
+        data.append(line);
+    }
+    zhash_t* aux = fty_proto_aux(metric);
+    if (aux && zhash_size(aux) > 0) {
+        data.append("\n");
+        if (compact_aux_enabled()) {
+            encode_aux(filename, aux, data);
+        } else {
+            for (char* item = static_cast<char*>(zhash_first(aux)); item;
+                 item       = static_cast<char*>(zhash_next(aux))) {
+                data.append(zhash_cursor(aux)).append("\n").append(item).append("\n");
+            }
+            // No \n after the last value
+            data.pop_back();
+        }
+    }
+    return marker;
+}
+
+// Write ttl, value and aux data to filename
+int write_metric_file(const char* filename, fty_proto_t* metric, time_t mtime)
+{
+    std::string data;
+    format_metric(filename, metric, policy_ttl(FamilyPolicy(), int(fty_proto_ttl(metric))), data);
+    return replace_file(filename, data, mtime);
+}
+
+// Write the metric to filename and publish it
 static int write_metric_data(const char* filename, fty_proto_t* metric)
 {
-    FILE* file = fopen(filename, "w");
-    if (file == nullptr)
+    FTY_SHM_PROBE1(write_metric_data_entry, filename);
+    FamilyPolicy policy = family_policy(filename);
+    std::string  data;
+    format_metric(filename, metric, policy_ttl(policy, int(fty_proto_ttl(metric))), data);
+    if (store_file(filename, data) < 0) {
+        FTY_SHM_PROBE2(write_metric_data_return, filename, -1);
         return -1;
-    int ttl = int(fty_proto_ttl(metric));
-    if (ttl < 0)
-        ttl = 0;
+    }
 
-    std::string fmt(TTL_FMT);
-    fmt.append(UNIT_FMT).append("%s");
-    fprintf(file, fmt.c_str(), ttl, fty_proto_unit(metric), fty_proto_value(metric));
-    zhash_t* aux = fty_proto_aux(metric);
+    log_update(filename, metric);
+    record_history(filename, metric);
+    if (policy.publish)
+        Publisher::publishMetric(metric); //mqtt-pub
+    FTY_SHM_PROBE2(write_metric_data_return, filename, 0);
+    return 0;
+}
 
-    if (aux) {
-        char* item = static_cast<char*>(zhash_first(aux));
-        while (item) {
-            fprintf(file, "\n%s\n%s", zhash_cursor(aux), item);
-            item = static_cast<char*>(zhash_next(aux));
-        }
+// Write the metric to filename with version, if it is newer than the stored
+// one, or if the stored one is expected (when set), and publish it
+static int write_metric_if(const char* filename, fty_proto_t* metric, uint64_t version, const uint64_t* expected)
+{
+    FTY_SHM_PROBE1(write_metric_data_entry, filename);
+    FamilyPolicy policy = family_policy(filename);
+    std::string  data;
+    size_t marker = format_metric(filename, metric, policy_ttl(policy, int(fty_proto_ttl(metric))), data, version);
+    if ((expected ? replace_if_version(filename, data, marker, *expected)
+                  : replace_if_newer(filename, data, marker, version)) < 0) {
+        FTY_SHM_PROBE2(write_metric_data_return, filename, -1);
+        return -1;
+    }
+
+    log_update(filename, metric);
+    record_history(filename, metric);
+    if (policy.publish)
+        Publisher::publishMetric(metric); //mqtt-pub
+    FTY_SHM_PROBE2(write_metric_data_return, filename, 0);
+    return 0;
+}
+
+int fty::shm::write_metric_if_newer(fty_proto_t* metric, uint64_t version)
+{
+    char filename[PATH_MAX];
+
+    if (version == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (prepare_filename(filename, fty_proto_name(metric), strlen(fty_proto_name(metric)), fty_proto_type(metric),
+            strlen(fty_proto_type(metric)), FTY_SHM_METRIC_TYPE) < 0)
+        return -1;
+    return write_metric_if(filename, metric, version, nullptr);
+}
+
+int fty::shm::compare_and_write_metric(fty_proto_t* metric, uint64_t expected)
+{
+    char filename[PATH_MAX];
+
+    if (expected == UINT64_MAX) {
+        errno = EOVERFLOW;
+        return -1;
     }
-    if (fclose(file) < 0)
+    if (prepare_filename(filename, fty_proto_name(metric), strlen(fty_proto_name(metric)), fty_proto_type(metric),
+            strlen(fty_proto_type(metric)), FTY_SHM_METRIC_TYPE) < 0)
         return -1;
+    return write_metric_if(filename, metric, expected + 1, &expected);
+}
+
+int fty::shm::read_metric_version(const std::string& asset, const std::string& metric, uint64_t& version)
+{
+    char          filename[PATH_MAX];
+    MetricVersion current;
 
-    Publisher::publishMetric(metric); //mqtt-pub
+    if (prepare_filename(
+            filename, asset.c_str(), asset.length(), metric.c_str(), metric.length(), FTY_SHM_METRIC_TYPE) < 0 ||
+        ::read_metric_version(filename, current) < 0)
+        return -1;
+    if (!current.exists) {
+        errno = ENOENT;
+        return -1;
+    }
+    version = current.version;
     return 0;
 }
 
@@ -521,6 +1084,174 @@ int fty::shm::read_metric(const std::string& asset, const std::string& metric, f
     return ret;
 }
 
+// The family of a write or of a single metric read
+static bool single_family(const Family& family)
+{
+    if (!family.valid() || family.name() == "*") {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+int fty::shm::Family::write_metric(fty_proto_t* metric)
+{
+    char filename[PATH_MAX];
+
+    if (!single_family(*this) ||
+        prepare_filename(filename, fty_proto_name(metric), strlen(fty_proto_name(metric)), fty_proto_type(metric),
+            strlen(fty_proto_type(metric)), m_name.c_str()) < 0)
+        return -1;
+    return write_metric_data(filename, metric);
+}
+
+int fty::shm::Family::write_metric(
+    const std::string& asset, const std::string& metric, const std::string& value, const std::string& unit, int ttl)
+{
+    char filename[PATH_MAX];
+
+    if (!single_family(*this) ||
+        prepare_filename(filename, asset.c_str(), asset.length(), metric.c_str(), metric.length(), m_name.c_str()) < 0)
+        return -1;
+    return write_value(filename, value.c_str(), unit.c_str(), ttl);
+}
+
+int fty::shm::Family::read_metric_value(const std::string& asset, const std::string& metric, std::string& value)
+{
+    char        filename[PATH_MAX];
+    std::string dummy;
+
+    if (!single_family(*this) ||
+        prepare_filename(filename, asset.c_str(), asset.length(), metric.c_str(), metric.length(), m_name.c_str()) < 0)
+        return -1;
+    return read_value(filename, value, dummy, false);
+}
+
+int fty::shm::Family::read_metric(const std::string& asset, const std::string& metric, fty_proto_t** proto_metric)
+{
+    char filename[PATH_MAX];
+
+    if (!proto_metric || !single_family(*this) ||
+        prepare_filename(filename, asset.c_str(), asset.length(), metric.c_str(), metric.length(), m_name.c_str()) < 0)
+        return -1;
+
+    *proto_metric = fty_proto_new(FTY_PROTO_METRIC);
+    fty_proto_set_name(*proto_metric, "%s", asset.c_str());
+    fty_proto_set_type(*proto_metric, "%s", metric.c_str());
+    int ret = read_data_metric(filename, *proto_metric);
+    if (ret != 0)
+        fty_proto_destroy(proto_metric);
+    return ret;
+}
+
+// Read the metrics of family, of all of them for "*"
+static int read_families(
+    const std::string& name, const Filter& asset, const Filter& metric, shmMetrics& result, ProtoPool* pool)
+{
+    if (name != "*")
+        return fty_shm_read_family(name.c_str(), asset, metric, result, pool);
+
+    std::vector<std::string> families;
+    if (list_families(families) < 0)
+        return -1;
+    for (auto& family : families) {
+        if (fty_shm_read_family(family.c_str(), asset, metric, result, pool) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int fty::shm::Family::read_metrics(const Filter& asset, const Filter& metric, shmMetrics& result)
+{
+    if (!valid()) {
+        errno = EINVAL;
+        return -1;
+    }
+    return read_families(m_name, asset, metric, result, nullptr);
+}
+
+int fty::shm::Family::read_metrics(const Filter& asset, const Filter& metric, PooledMetrics& result)
+{
+    if (!valid()) {
+        errno = EINVAL;
+        return -1;
+    }
+    return read_families(m_name, asset, metric, result, result.pool());
+}
+
+int fty::shm::Family::for_each_metric(const Filter& asset, const Filter& metric, const MetricViewVisitor& visitor)
+{
+    if (!valid()) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (m_name != "*")
+        return scan_views(m_name.c_str(), asset, metric, visitor);
+
+    std::vector<std::string> families;
+    if (list_families(families) < 0)
+        return -1;
+    bool stop = false;
+    for (auto& family : families) {
+        if (scan_views(family.c_str(), asset, metric, [&stop, &visitor](const MetricView& view) {
+                stop = !visitor(view);
+                return !stop;
+            }) < 0)
+            return -1;
+        if (stop)
+            break;
+    }
+    return 0;
+}
+
+fty::shm::ProtoPool::ProtoPool(size_t max_size)
+    : m_max_size(max_size)
+{
+}
+
+fty::shm::ProtoPool::~ProtoPool()
+{
+    for (auto& metric : m_free)
+        fty_proto_destroy(&metric);
+}
+
+fty_proto_t* fty::shm::ProtoPool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_free.empty()) {
+            fty_proto_t* metric = m_free.back();
+            m_free.pop_back();
+            return metric;
+        }
+    }
+    return fty_proto_new(FTY_PROTO_METRIC);
+}
+
+void fty::shm::ProtoPool::release(fty_proto_t* metric)
+{
+    if (!metric)
+        return;
+    // Keep the hash, drop its content
+    zhash_t* aux = fty_proto_aux(metric);
+    if (aux)
+        zhash_purge(aux);
+    if (fty_proto_id(metric) == FTY_PROTO_METRIC) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_free.size() < m_max_size) {
+            m_free.push_back(metric);
+            return;
+        }
+    }
+    fty_proto_destroy(&metric);
+}
+
+size_t fty::shm::ProtoPool::size()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_free.size();
+}
+
 fty::shm::shmMetrics::~shmMetrics()
 {
     for (std::vector<fty_proto_t*>::iterator i = m_metricsVector.begin(); i != m_metricsVector.end(); ++i) {
@@ -529,6 +1260,24 @@ fty::shm::shmMetrics::~shmMetrics()
     m_metricsVector.clear();
 }
 
+fty::shm::PooledMetrics::PooledMetrics(ProtoPool& pool)
+    : m_pool(&pool)
+{
+}
+
+fty::shm::PooledMetrics::~PooledMetrics()
+{
+    // Before ~shmMetrics(), which would destroy them
+    for (auto metric : m_metricsVector)
+        m_pool->release(metric);
+    m_metricsVector.clear();
+}
+
+fty::shm::ProtoPool* fty::shm::PooledMetrics::pool() const
+{
+    return m_pool;
+}
+
 fty_proto_t* fty::shm::shmMetrics::get(int i)
 {
     return m_metricsVector.at(size_t(i));
@@ -0,0 +1,291 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+#pragma once
+
+// Building blocks of the library, not part of the public API. They are
+// shared between the library sources, and exposed to the microbenchmark to
+// measure them in isolation.
+
+#include "fty_shm.h"
+#include <fty_proto.h>
+#include <functional>
+#include <stddef.h>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+#include <vector>
+
+// The first 11 bytes of each file are the ttl in 10 decimal digits, followed
+// by \n.  This is a compromise between machine and human readability
+#define TTL_FMT "%010d\n"
+#define TTL_LEN 11
+
+// Bundle files are named "@<asset>"
+#define BUNDLE_PREFIX '@'
+
+// Directory of a metric family: "<shm_dir>/<family>"
+std::string family_directory(const char* family);
+// Whether filename is a file of the default family directory
+bool in_default_family(const char* filename);
+// Whether family can name a family directory: not empty, no '/', no leading
+// '.' and at most NAME_MAX long
+bool valid_family_name(const std::string& family);
+
+// Build "<shm_dir>/<type>/<metric>@<asset>" in buf (at least PATH_MAX bytes)
+// Returns 0 on success. On error, returns -1 and sets errno accordingly
+int prepare_filename(char* buf, const char* asset, size_t a_len, const char* metric, size_t m_len, const char* type);
+
+// Name of a new temporary file in the directory of filename, unique for the
+// process and skipped by the scans: ".tmp.<pid>.<n>", whatever the length
+// of the name of filename
+std::string temporary_filename(const char* filename);
+
+// Parse the ttl header line of a metric file (ttl_str is modified)
+int parse_ttl(char* ttl_str, time_t& ttl);
+
+// Read filename in proto_metric (ttl, time, unit, value and aux)
+// Returns 0 on success, -1 on error (errno is ESTALE if the data are outdated)
+int read_data_metric(const char* filename, fty_proto_t* proto_metric);
+
+// Parse the content of the metric file filename (data, modified in place and
+// NUL terminated) in proto_metric. Returns 0 on success, -1 on error (errno
+// is ESTALE if the data are outdated, the file being removed then)
+int parse_metric_data(const char* filename, char* data, size_t len, time_t mtime, fty_proto_t* proto_metric);
+
+// Write metric in filename, without publishing it, with mtime as its
+// modification time if not 0
+int write_metric_file(const char* filename, fty_proto_t* metric, time_t mtime = 0);
+
+// Dictionary of the interned aux keys of a family, and the first byte of a
+// compact aux block
+#define AUX_KEYS_FILE      ".auxkeys"
+#define AUX_COMPACT_MARKER '\x01'
+
+// Whether aux are written in compact form (FTY_SHM_COMPACT_AUX is "ON")
+bool compact_aux_enabled();
+
+// Append the compact form of aux to buf, the keys being interned in the
+// dictionary of the family of filename
+void encode_aux(const char* filename, zhash_t* aux, std::string& buf);
+
+// Insert the aux of a compact block (after the marker) in proto_metric.
+// Returns false if the block is malformed or its keys unknown
+bool decode_aux(const char* filename, const char* data, size_t len, fty_proto_t* proto_metric);
+
+// Forget the cached dictionary, when the store is deleted
+void reset_aux_keys();
+
+// Read cache (see set_read_cache()), also enabled by FTY_SHM_READ_CACHE, its
+// budget in KiB
+bool read_cache_enabled();
+// Serve the metric file filename from the cache. Returns false on a miss,
+// outdated entries included: the file is then read as usual
+bool read_cache_get(const char* filename, fty_proto_t* proto_metric);
+bool read_cache_get(const char* filename, std::string& value, std::string& unit);
+// Cache what was read from filename, st being its fstat before the read
+void read_cache_put(const char* filename, const struct stat& st, fty_proto_t* proto_metric);
+// Same without the aux (read_value() does not parse them)
+void read_cache_put(const char* filename, const struct stat& st, time_t ttl, const char* unit, const char* value);
+
+// Forget the cached metrics, when the store is deleted
+void reset_read_cache();
+
+// Whether the writes of an unchanged metric only refresh its mtime
+// (FTY_SHM_SKIP_UNCHANGED is not "OFF")
+bool write_cache_enabled();
+// Refresh the mtime of filename if this process wrote data to it last and
+// nobody wrote it since. Returns false if the file must be written
+bool refresh_unchanged(const char* filename, const std::string& data);
+// Remember data as written to filename, st being the written file
+void remember_write(const char* filename, const std::string& data, const struct stat& st);
+// Forget the written metrics, when the store is deleted
+void reset_write_cache();
+
+// Aux pair following the value of the metrics written by the conditional
+// writes, so that older readers take it as an aux: the VERSION_KEY line, then
+// the marker and the version in VERSION_LEN decimal digits. The marker of a
+// write which lost the race is overwritten by VERSION_WITHDRAWN
+#define VERSION_KEY       "__fty_shm_version"
+#define VERSION_KEY_LEN   (sizeof(VERSION_KEY) - 1)
+#define VERSION_MARKER    '+'
+#define VERSION_WITHDRAWN '-'
+#define VERSION_LEN       20
+
+// Version of a metric file, as seen by the conditional writes
+struct MetricVersion
+{
+    bool exists = false;
+    // Written by a conditional write which lost
+    bool withdrawn = false;
+    // 0 for an outdated metric, or one written unconditionally
+    uint64_t version = 0;
+    ino_t    ino     = 0;
+};
+
+// Replace filename by data (its version marker at marker) if the version of
+// filename is older than version (see write_metric_if_newer())
+// Returns 0 on success. On error, returns -1 and sets errno accordingly
+// (ECANCELED if filename is at least as recent)
+int replace_if_newer(const char* filename, const std::string& data, size_t marker, uint64_t version);
+// Same if the version of filename is expected (see compare_and_write_metric())
+int replace_if_version(const char* filename, const std::string& data, size_t marker, uint64_t expected);
+
+// Read the version of filename
+// Returns 0 on success (a missing file included), -1 on error
+int read_metric_version(const char* filename, MetricVersion& version);
+
+// Policy of a family, in the family directory
+#define POLICY_FILE ".policy"
+
+// Policy of the family of filename (a file of the family directory or of
+// one of its side directories)
+fty::shm::FamilyPolicy family_policy(const char* filename);
+// ttl cut to the retention of policy (0 for an infinite ttl)
+int policy_ttl(const fty::shm::FamilyPolicy& policy, int ttl);
+// Forget the policies read, when the store is deleted
+void reset_family_policies();
+
+// Visit the valid metrics of family as views (see for_each_metric())
+int scan_views(const char* family, const fty::shm::Filter& asset, const fty::shm::Filter& metric,
+    const fty::shm::MetricViewVisitor& visitor);
+
+// Ring of the last writes of the default family, appended to when
+// FTY_SHM_UPDATE_LOG is "ON"
+#define UPDATE_LOG_FILE ".updates"
+
+// Append the write of the metric file filename to the update log, if it is
+// in the default family
+void log_update(const char* filename, const char* value, const char* unit, uint32_t ttl);
+// Same for metric, written in filename (a metric file or a bundle)
+void log_update(const char* filename, fty_proto_t* metric);
+
+// Unmap the update log, when the store is deleted
+void reset_update_log();
+
+// Directory of the sockets of the local subscribers (see LocalSubscriber)
+#define SUBSCRIBERS_DIR ".subscribers"
+
+// Send a write to the local subscribers whose filters match it
+void publish_local(const char* asset, const char* metric, const char* value, const char* unit, uint32_t ttl);
+
+// Directory of the metric histories of a family, kept when FTY_SHM_HISTORY
+// is set (to their number of samples)
+#define HISTORY_DIR ".history"
+
+// Add value to the history of the metric file filename, if it is numeric
+void record_history(const char* filename, const char* value, uint32_t ttl);
+// Same for metric, written in filename (a metric file or a bundle)
+void record_history(const char* filename, fty_proto_t* metric);
+
+// Read FTY_SHM_HISTORY again, when the store is deleted
+void reset_history();
+
+// Remove an outdated metric file, unless FTY_SHM_AUTOCLEAN is "OFF"
+void remove_stale(const char* filename);
+
+// Called for each valid metric of a scan, returns false to stop the scan.
+// The visitor may keep proto_metric by setting it to nullptr, a new one is
+// then allocated for the next metric.
+typedef std::function<bool(fty_proto_t*& proto_metric)> ScanVisitor;
+
+// Read the valid metrics of family, from metric files and bundles, whose
+// names match the asset and type filters. The fty_proto_t are taken from
+// pool if given. Returns 0 on success, -1 on error
+int scan_family(const char* family, const fty::shm::Filter& asset, const fty::shm::Filter& type,
+    const ScanVisitor& visitor, fty::shm::ProtoPool* pool = nullptr);
+
+// Visit the valid records of the bundle filename of asset whose names match
+// type, as scan_family() does. Returns false if the visitor stopped
+bool scan_bundle(const char* filename, const char* asset, const fty::shm::Filter& type, fty_proto_t*& proto_metric,
+    const ScanVisitor& visitor, fty::shm::ProtoPool* pool);
+
+// Build "<shm_dir>/<type>/@<asset>" in buf (at least PATH_MAX bytes)
+// Returns 0 on success. On error, returns -1 and sets errno accordingly
+int prepare_bundle_filename(char* buf, const char* asset, size_t a_len, const char* type);
+
+// Replace the bundle filename by metrics (all of the same asset) in one
+// rename, their ttl cut to the retention of policy, without publishing them
+int write_bundle_file(
+    const char* filename, const std::vector<fty_proto_t*>& metrics, const fty::shm::FamilyPolicy& policy);
+
+// Parser of a bundle, loaded with a single read
+class BundleReader
+{
+public:
+    // Load filename. Returns 0 on success, -1 on error (errno is set)
+    int open(const char* filename);
+    // True when all the records are outdated
+    bool outdated(time_t now) const;
+    // Move to the next record, returns false at the end of the bundle
+    bool next();
+    // Move to the record of metric. Returns 0 on success, -1 on error (errno
+    // is ESTALE if the record is outdated, ENOENT if there is none)
+    int find(const char* metric, time_t now);
+
+    // Current record
+    const char* metric() const
+    {
+        return m_metric;
+    }
+    const char* value() const
+    {
+        return m_value;
+    }
+    const char* unit() const
+    {
+        return m_unit;
+    }
+    time_t ttl() const
+    {
+        return m_record_ttl;
+    }
+    time_t time() const
+    {
+        return m_time;
+    }
+    bool valid(time_t now) const;
+    // Set ttl, time, unit, value and aux of proto_metric (once per record)
+    void fill(fty_proto_t* proto_metric);
+
+private:
+    char* line();
+
+    std::string m_data;
+    size_t      m_pos      = 0;
+    time_t      m_time     = 0;
+    time_t      m_ttl      = 0;
+    const char* m_metric   = nullptr;
+    time_t      m_record_ttl = 0;
+    const char* m_unit     = nullptr;
+    const char* m_value    = nullptr;
+    size_t      m_aux_left = 0;
+};
+
+// Find the record of filename ("<dir>/<metric>@<asset>") in the bundle of
+// its asset. Returns 0 on success with reader on the record, -1 on error
+// (errno is ENOENT if there is no such record, ESTALE if it is outdated)
+int find_in_bundle(const char* filename, BundleReader& reader);
+
+// Compute the ops (AggregateOp) of aggregate over count values
+void aggregate_column(const double* values, size_t count, unsigned ops, fty::shm::Aggregate& aggregate);
+
+// Test a directory entry name (metric@asset) against the asset and metric
+// filters. delim points to the separator in filename
+bool match_metric_filename(
+    const char* filename, const char* delim, const fty::shm::Filter& asset, const fty::shm::Filter& type);
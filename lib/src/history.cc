@@ -0,0 +1,280 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Metric history: a ring of the last samples of each metric
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include "stats.h"
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// The history of "<family>/<metric>@<asset>" is "<family>/.history/<metric>@<asset>":
+//   the usual ttl header (the ttl of the metric times the number of slots,
+//   so that fty-shm-cleanup removes the history of a metric gone for good),
+//   "HIST", the number of slots and the last sequence number, then the slots.
+// A slot holds a sample and its sequence number (0 for an empty slot),
+// sample n going to slot (n - 1) % slots. The writer locks the file (flock,
+// released by the close), reads the header only, then writes the next slot
+// and the header: open, flock, pread, two pwrite and close, plus ftruncate
+// for a new file. The lock keeps the writers of a metric from taking the
+// same slot; readers don't take it, the check field catches a slot read
+// while it was written.
+//
+// Only the numeric values of the default family are recorded.
+
+#define HISTORY_MAGIC       "HIST"
+#define HISTORY_HEADER_SIZE 32
+#define HISTORY_MAX_SLOTS   4096
+#define HISTORY_CHECK_SEED  0x9e3779b97f4a7c15ULL
+
+using namespace fty::shm;
+
+namespace {
+
+struct HistorySlot
+{
+    uint64_t seq;
+    int64_t  time;
+    double   value;
+    uint64_t check;
+};
+static_assert(sizeof(HistorySlot) == 32, "history slots have a fixed size");
+
+uint64_t slot_check(const HistorySlot& slot)
+{
+    uint64_t bits;
+    memcpy(&bits, &slot.value, sizeof(bits));
+    return (slot.seq * HISTORY_CHECK_SEED) ^ uint64_t(slot.time) ^ bits;
+}
+
+bool slot_valid(const HistorySlot& slot)
+{
+    return slot.seq != 0 && slot.check == slot_check(slot);
+}
+
+struct HistoryHeader
+{
+    char     ttl[TTL_LEN];
+    char     magic[5];
+    uint32_t slots;
+    uint32_t reserved;
+    // Sequence number of the last sample written
+    uint64_t head;
+};
+static_assert(sizeof(HistoryHeader) == HISTORY_HEADER_SIZE, "history header has a fixed size");
+
+// Number of slots of the histories written by this process, from
+// FTY_SHM_HISTORY (read again after a reset), 0 if they are not kept
+std::atomic<int> history_slots{-1};
+
+unsigned slots_per_history()
+{
+    int slots = history_slots.load(std::memory_order_relaxed);
+    if (slots < 0) {
+        const char* valenv = getenv("FTY_SHM_HISTORY");
+        slots              = valenv ? int(std::min(strtoul(valenv, nullptr, 10), HISTORY_MAX_SLOTS + 0UL)) : 0;
+        history_slots.store(slots, std::memory_order_relaxed);
+    }
+    return unsigned(slots);
+}
+
+// Parse the history read in data, false if it is not one
+bool parse_history(const char* data, size_t len, HistoryHeader& header, const HistorySlot*& slots, size_t& count)
+{
+    if (len < HISTORY_HEADER_SIZE)
+        return false;
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, HISTORY_MAGIC "\n", 5) != 0 || header.slots == 0 ||
+        header.slots > HISTORY_MAX_SLOTS)
+        return false;
+    slots = reinterpret_cast<const HistorySlot*>(data + HISTORY_HEADER_SIZE);
+    count = std::min(size_t(header.slots), (len - HISTORY_HEADER_SIZE) / sizeof(HistorySlot));
+    return true;
+}
+
+void append_sample(
+    const char* dir, size_t dir_len, const char* name, size_t name_len, const char* value, uint32_t ttl)
+{
+    unsigned slots = slots_per_history();
+    char*    end;
+    double   number = strtod(value, &end);
+    if (!slots || end == value || *end != '\0')
+        return;
+
+    std::string filename(dir, dir_len);
+    filename.append("/" HISTORY_DIR "/").append(name, name_len);
+
+    stat_add(STAT_SYSCALLS, 2); // open, close
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0 && errno == ENOENT) {
+        std::string history_dir(dir, dir_len);
+        history_dir.append("/" HISTORY_DIR);
+        stat_add(STAT_SYSCALLS);
+        mkdir(history_dir.c_str(), 0777);
+        fd = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    }
+    if (fd < 0)
+        return;
+    stat_add(STAT_SYSCALLS);
+    if (flock(fd, LOCK_EX) < 0) {
+        close(fd);
+        return;
+    }
+
+    stat_add(STAT_SYSCALLS, 3); // pread, pwrite, pwrite
+    char               buf[HISTORY_HEADER_SIZE];
+    HistoryHeader      header;
+    const HistorySlot* current;
+    size_t             count;
+    ssize_t            len = pread(fd, buf, sizeof(buf), 0);
+    if (len > 0)
+        stat_add(STAT_BYTES_READ, uint64_t(len));
+    if (len < 0 || !parse_history(buf, size_t(len), header, current, count) || header.slots != slots) {
+        // New history, or kept with another number of slots: emptied
+        memset(&header, 0, sizeof(header));
+        stat_add(STAT_SYSCALLS, 2);
+        if (ftruncate(fd, 0) < 0 || ftruncate(fd, off_t(HISTORY_HEADER_SIZE + slots * sizeof(HistorySlot))) < 0) {
+            close(fd);
+            return;
+        }
+    }
+
+    HistorySlot slot;
+    slot.seq   = header.head + 1;
+    slot.time  = int64_t(time(nullptr));
+    slot.value = number;
+    slot.check = slot_check(slot);
+    size_t index = size_t((slot.seq - 1) % slots);
+    len = pwrite(fd, &slot, sizeof(slot), off_t(HISTORY_HEADER_SIZE + index * sizeof(HistorySlot)));
+
+    // Then the header, with the ttl of this write
+    char ttl_line[TTL_LEN + 1];
+    snprintf(ttl_line, sizeof(ttl_line), TTL_FMT, int(std::min<uint64_t>(uint64_t(ttl) * slots, INT_MAX)));
+    memcpy(header.ttl, ttl_line, TTL_LEN);
+    memcpy(header.magic, HISTORY_MAGIC "\n", 5);
+    header.slots    = slots;
+    header.reserved = 0;
+    header.head     = slot.seq;
+    if (len == sizeof(slot) && pwrite(fd, &header, sizeof(header), 0) == sizeof(header))
+        len += sizeof(header);
+    close(fd);
+    if (len > 0)
+        stat_add(STAT_BYTES_WRITTEN, uint64_t(len));
+}
+
+} // namespace
+
+void record_history(const char* filename, const char* value, uint32_t ttl)
+{
+    if (!slots_per_history() || !in_default_family(filename))
+        return;
+    const char* name = strrchr(filename, '/');
+    append_sample(filename, size_t(name - filename), name + 1, strlen(name + 1), value, ttl);
+}
+
+void record_history(const char* filename, fty_proto_t* metric)
+{
+    if (!slots_per_history() || !in_default_family(filename))
+        return;
+    const char* name = strrchr(filename, '/');
+    std::string metric_name(fty_proto_type(metric));
+    metric_name.append("@").append(fty_proto_name(metric));
+    append_sample(filename, size_t(name - filename), metric_name.c_str(), metric_name.length(),
+        fty_proto_value(metric), fty_proto_ttl(metric));
+}
+
+void reset_history()
+{
+    history_slots.store(-1);
+}
+
+int fty::shm::read_metric_history(
+    const std::string& asset, const std::string& metric, uint64_t since, std::vector<MetricSample>& samples)
+{
+    char filename[PATH_MAX];
+    if (prepare_filename(
+            filename, asset.c_str(), asset.length(), metric.c_str(), metric.length(), FTY_SHM_METRIC_TYPE) < 0)
+        return -1;
+    // "<dir>/<metric>@<asset>" to "<dir>/.history/<metric>@<asset>"
+    const char* name = strrchr(filename, '/');
+    std::string history(filename, size_t(name - filename));
+    history.append("/" HISTORY_DIR).append(name);
+
+    struct stat st;
+    stat_add(STAT_SYSCALLS, 4); // open, fstat, read, close
+    int fd = open(history.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    std::vector<HistorySlot> buf(size_t(st.st_size) / sizeof(HistorySlot) + 1);
+    ssize_t                  len = read(fd, buf.data(), buf.size() * sizeof(HistorySlot));
+    int                      err = errno;
+    close(fd);
+    if (len < 0) {
+        errno = err;
+        return -1;
+    }
+    stat_add(STAT_BYTES_READ, uint64_t(len));
+
+    HistoryHeader      header;
+    const HistorySlot* slots;
+    size_t             count;
+    const char*        data = reinterpret_cast<const char*>(buf.data());
+    if (!parse_history(data, size_t(len), header, slots, count)) {
+        errno = EBADMSG;
+        return -1;
+    }
+    // The whole history is outdated along with its ttl header
+    char   ttl_line[TTL_LEN + 1];
+    time_t ttl;
+    memcpy(ttl_line, header.ttl, TTL_LEN);
+    ttl_line[TTL_LEN] = '\0';
+    if (parse_ttl(ttl_line, ttl) == 0 && ttl && time(nullptr) - st.st_mtime > ttl) {
+        remove_stale(history.c_str());
+        errno = ESTALE;
+        return -1;
+    }
+
+    std::vector<HistorySlot> valid;
+    for (size_t i = 0; i < count; i++) {
+        if (slot_valid(slots[i]) && uint64_t(slots[i].time) >= since)
+            valid.push_back(slots[i]);
+    }
+    std::sort(valid.begin(), valid.end(), [](const HistorySlot& a, const HistorySlot& b) {
+        return a.seq < b.seq;
+    });
+    samples.clear();
+    for (auto& slot : valid)
+        samples.push_back({uint64_t(slot.time), slot.value});
+    return 0;
+}
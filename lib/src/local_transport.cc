@@ -0,0 +1,324 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Publication of the writes to the local subscribers, without a broker
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include "stats.h"
+#include <atomic>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// A LocalSubscriber binds a datagram socket "<shm_dir>/.subscribers/<pid>.<n>",
+// after writing its asset and metric filters in "<pid>.<n>.filter". The
+// publishers keep the list of the subscribers, read again when the directory
+// changes, and send a datagram to each subscriber whose filters match,
+// without waiting: a subscriber too slow to empty its socket loses the
+// updates. The sockets of the subscribers gone are removed by the
+// publishers. A datagram is the asset, metric, value, unit, ttl and time
+// fields, each ended by a NUL.
+
+#define FILTER_SUFFIX ".filter"
+
+// Largest update received, the longer ones are truncated
+#define LOCAL_MAX_MESSAGE 65536
+
+// Receive queue of a subscriber, for the bursts of a poll
+#define LOCAL_RCVBUF (1024 * 1024)
+
+using namespace fty::shm;
+
+namespace {
+
+struct Subscriber
+{
+    std::string path;
+    Filter      asset;
+    Filter      metric;
+};
+
+struct SubscriberList
+{
+    std::mutex              mutex;
+    std::string             dir;
+    struct timespec         mtime = {0, 0};
+    bool                    loaded = false;
+    std::vector<Subscriber> subscribers;
+    // Unbound socket the datagrams are sent from
+    int fd = -1;
+};
+
+SubscriberList subscriber_list;
+
+bool ends_with(const char* name, const char* suffix)
+{
+    size_t len = strlen(name), suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(name + len - suffix_len, suffix) == 0;
+}
+
+// Read the subscribers registered in dir
+void load_subscribers(const std::string& dir, std::vector<Subscriber>& subscribers)
+{
+    subscribers.clear();
+    DIR* d;
+    stat_add(STAT_SYSCALLS, 2); // open, close
+    if (!(d = opendir(dir.c_str())))
+        return;
+    struct dirent* de;
+    while ((de = readdir(d))) {
+        if (de->d_name[0] == '.' || ends_with(de->d_name, FILTER_SUFFIX))
+            continue;
+        std::string path(dir + "/" + de->d_name);
+        char        buf[1024];
+        stat_add(STAT_SYSCALLS, 3); // open, read, close
+        int fd = open((path + FILTER_SUFFIX).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        ssize_t len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+        if (len <= 0)
+            continue;
+        buf[len]     = '\0';
+        char* metric = strchr(buf, '\n');
+        if (!metric)
+            continue;
+        *metric++ = '\0';
+        metric[strcspn(metric, "\n")] = '\0';
+        Filter asset_filter(buf), metric_filter(metric);
+        if (asset_filter.valid() && metric_filter.valid())
+            subscribers.push_back({path, asset_filter, metric_filter});
+    }
+    closedir(d);
+}
+
+bool fill_address(struct sockaddr_un& addr, const std::string& path)
+{
+    if (path.size() >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+
+} // namespace
+
+void publish_local(const char* asset, const char* metric, const char* value, const char* unit, uint32_t ttl)
+{
+    std::string dir = family_directory(SUBSCRIBERS_DIR);
+    struct stat st;
+    stat_add(STAT_SYSCALLS);
+    // Nobody ever subscribed
+    if (stat(dir.c_str(), &st) < 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(subscriber_list.mutex);
+    SubscriberList&             list = subscriber_list;
+    if (!list.loaded || list.dir != dir || list.mtime.tv_sec != st.st_mtim.tv_sec ||
+        list.mtime.tv_nsec != st.st_mtim.tv_nsec) {
+        load_subscribers(dir, list.subscribers);
+        list.dir    = dir;
+        list.mtime  = st.st_mtim;
+        list.loaded = true;
+    }
+    if (list.subscribers.empty())
+        return;
+
+    std::string message;
+    size_t      asset_len = strlen(asset), metric_len = strlen(metric);
+    for (auto it = list.subscribers.begin(); it != list.subscribers.end();) {
+        if (!it->asset.match(asset, asset_len) || !it->metric.match(metric, metric_len)) {
+            ++it;
+            continue;
+        }
+        if (message.empty()) {
+            message.append(asset).push_back('\0');
+            message.append(metric).push_back('\0');
+            message.append(value).push_back('\0');
+            message.append(unit).push_back('\0');
+            message.append(std::to_string(ttl)).push_back('\0');
+            message.append(std::to_string(time(nullptr))).push_back('\0');
+        }
+        if (list.fd < 0) {
+            stat_add(STAT_SYSCALLS);
+            if ((list.fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+                stat_add(STAT_PUBLISH_SEND_ERROR);
+                return;
+            }
+        }
+        struct sockaddr_un addr;
+        if (!fill_address(addr, it->path)) {
+            ++it;
+            continue;
+        }
+        stat_add(STAT_SYSCALLS);
+        if (sendto(list.fd, message.data(), message.size(), MSG_DONTWAIT | MSG_NOSIGNAL,
+                reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) >= 0) {
+            stat_add(STAT_PUBLISH_LOCAL);
+        } else if (errno == ECONNREFUSED || errno == ENOENT) {
+            // The subscriber is gone without closing
+            stat_add(STAT_SYSCALLS, 2);
+            unlink(it->path.c_str());
+            unlink((it->path + FILTER_SUFFIX).c_str());
+            it = list.subscribers.erase(it);
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            stat_add(STAT_PUBLISH_LOCAL_DROPPED);
+        } else {
+            stat_add(STAT_PUBLISH_SEND_ERROR);
+        }
+        ++it;
+    }
+}
+
+fty::shm::LocalSubscriber::LocalSubscriber()
+    : m_fd(-1)
+{
+}
+
+fty::shm::LocalSubscriber::~LocalSubscriber()
+{
+    close();
+}
+
+int fty::shm::LocalSubscriber::open(const std::string& asset, const std::string& metric)
+{
+    static std::atomic<unsigned> count{0};
+
+    if (m_fd >= 0)
+        return 0;
+    if (!Filter(asset).valid() || !Filter(metric).valid() || asset.find('\n') != std::string::npos ||
+        metric.find('\n') != std::string::npos) {
+        errno = EINVAL;
+        return -1;
+    }
+    std::string dir = family_directory(SUBSCRIBERS_DIR);
+    stat_add(STAT_SYSCALLS);
+    if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST)
+        return -1;
+    std::string path(dir + "/" + std::to_string(getpid()) + "." + std::to_string(count.fetch_add(1)));
+    struct sockaddr_un addr;
+    if (!fill_address(addr, path))
+        return -1;
+
+    // The filters first: the publishers take the socket as soon as it exists
+    std::string filter(asset + "\n" + metric + "\n");
+    stat_add(STAT_SYSCALLS, 3); // open, write, close
+    int fd = ::open((path + FILTER_SUFFIX).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return -1;
+    bool ok = write(fd, filter.data(), filter.size()) == ssize_t(filter.size());
+    ::close(fd);
+    int rcvbuf = LOCAL_RCVBUF;
+    stat_add(STAT_SYSCALLS, 3); // socket, setsockopt, bind
+    if (!ok || (m_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0) {
+        int err = ok ? errno : EIO;
+        unlink((path + FILTER_SUFFIX).c_str());
+        errno = err;
+        return -1;
+    }
+    setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    unlink(path.c_str());
+    if (bind(m_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        int err = errno;
+        ::close(m_fd);
+        m_fd = -1;
+        unlink((path + FILTER_SUFFIX).c_str());
+        errno = err;
+        return -1;
+    }
+    m_path = path;
+    m_buffer.resize(LOCAL_MAX_MESSAGE);
+    return 0;
+}
+
+void fty::shm::LocalSubscriber::close()
+{
+    if (m_fd < 0)
+        return;
+    ::close(m_fd);
+    m_fd = -1;
+    unlink(m_path.c_str());
+    unlink((m_path + FILTER_SUFFIX).c_str());
+    m_path.clear();
+}
+
+int fty::shm::LocalSubscriber::fd() const
+{
+    return m_fd;
+}
+
+int fty::shm::LocalSubscriber::next(MetricUpdate& update)
+{
+    if (m_fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    stat_add(STAT_SYSCALLS);
+    ssize_t len = recv(m_fd, &m_buffer[0], m_buffer.size(), MSG_TRUNC);
+    if (len < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    update.truncated = size_t(len) > m_buffer.size();
+    len              = std::min(len, ssize_t(m_buffer.size()));
+
+    // asset, metric, value, unit, ttl and time
+    const char* fields[6] = {nullptr};
+    const char* p         = m_buffer.data();
+    const char* end       = p + len;
+    for (auto& field : fields) {
+        const char* nul = static_cast<const char*>(memchr(p, '\0', size_t(end - p)));
+        if (!nul)
+            break;
+        field = p;
+        p     = nul + 1;
+    }
+    update.seq = 0;
+    update.asset.assign(fields[0] ? fields[0] : "");
+    update.metric.assign(fields[1] ? fields[1] : "");
+    update.value.assign(fields[2] ? fields[2] : "");
+    update.unit.assign(fields[3] ? fields[3] : "");
+    update.ttl  = fields[4] ? uint32_t(strtoul(fields[4], nullptr, 10)) : 0;
+    update.time = fields[5] ? strtoull(fields[5], nullptr, 10) : 0;
+    if (!fields[5])
+        update.truncated = true;
+    return 1;
+}
+
+int fty::shm::LocalSubscriber::wait(int timeout_ms)
+{
+    if (m_fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    struct pollfd pfd = {m_fd, POLLIN, 0};
+    stat_add(STAT_SYSCALLS);
+    int r = poll(&pfd, 1, timeout_ms);
+    return r < 0 ? -1 : (r > 0 ? 1 : 0);
+}
@@ -0,0 +1,189 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Parallel scan of a family, for large stores
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include "probes.h"
+#include "stats.h"
+#include <atomic>
+#include <dirent.h>
+#include <string.h>
+#include <system_error>
+#include <thread>
+
+// The directory is listed on the calling thread, then the workers take the
+// entries by chunks and match, open and parse them. Each entry has its slot
+// in the result, so that the merge keeps the order of the serial scan.
+
+// Below this number of entries per worker, threads cost more than they save
+#define MIN_ENTRIES_PER_WORKER 512
+#define CHUNK_SIZE             64
+
+using namespace fty::shm;
+
+namespace {
+
+struct Entry
+{
+    std::string name;
+    // Metrics read from the entry: one for a metric file, any for a bundle
+    std::vector<fty_proto_t*> metrics;
+};
+
+class ParallelScan
+{
+public:
+    ParallelScan(std::vector<Entry>& entries, const std::string& family_dir, const Filter& asset,
+        const Filter& type, ProtoPool* pool)
+        : m_entries(entries)
+        , m_family_dir(family_dir)
+        , m_asset(asset)
+        , m_type(type)
+        , m_pool(pool)
+        , m_next(0)
+    {
+    }
+    void work();
+
+private:
+    void read_entry(Entry& entry, std::string& filename, fty_proto_t*& proto_metric);
+
+    std::vector<Entry>& m_entries;
+    const std::string&  m_family_dir;
+    const Filter&       m_asset;
+    const Filter&       m_type;
+    ProtoPool*          m_pool;
+    std::atomic<size_t> m_next;
+};
+
+void ParallelScan::read_entry(Entry& entry, std::string& filename, fty_proto_t*& proto_metric)
+{
+    const char* name  = entry.name.c_str();
+    const char* delim = strchr(name, '@');
+    filename.resize(m_family_dir.length() + 1);
+    filename.append(entry.name);
+
+    auto keep = [&entry](fty_proto_t*& metric) {
+        entry.metrics.push_back(metric);
+        metric = nullptr;
+        return true;
+    };
+    if (delim == name) {
+        if (m_asset.match(delim + 1, strlen(delim + 1)))
+            scan_bundle(filename.c_str(), delim + 1, m_type, proto_metric, keep, m_pool);
+        return;
+    }
+    if (!match_metric_filename(name, delim, m_asset, m_type))
+        return;
+    if (!proto_metric)
+        proto_metric = m_pool ? m_pool->acquire() : fty_proto_new(FTY_PROTO_METRIC);
+    else if (fty_proto_aux(proto_metric))
+        zhash_purge(fty_proto_aux(proto_metric));
+    if (read_data_metric(filename.c_str(), proto_metric) != 0)
+        return;
+    fty_proto_set_name(proto_metric, "%s", delim + 1);
+    fty_proto_set_type(proto_metric, "%.*s", int(delim - name), name);
+    keep(proto_metric);
+}
+
+void ParallelScan::work()
+{
+    std::string  filename(m_family_dir);
+    fty_proto_t* proto_metric = nullptr;
+    filename.append("/");
+
+    while (true) {
+        size_t first = m_next.fetch_add(CHUNK_SIZE, std::memory_order_relaxed);
+        if (first >= m_entries.size())
+            break;
+        size_t last = std::min(first + CHUNK_SIZE, m_entries.size());
+        for (size_t i = first; i < last; i++)
+            read_entry(m_entries[i], filename, proto_metric);
+    }
+    if (m_pool && proto_metric)
+        m_pool->release(proto_metric);
+    else
+        fty_proto_destroy(&proto_metric);
+}
+
+} // namespace
+
+static int read_metrics_parallel(
+    const std::string& asset, const std::string& type, shmMetrics& result, unsigned threads, ProtoPool* pool)
+{
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::string family_dir = family_directory(FTY_SHM_METRIC_TYPE);
+    Filter      assetFilter(asset), typeFilter(type);
+    if (!assetFilter.valid() || !typeFilter.valid())
+        return -1;
+
+    FTY_SHM_PROBE3(read_family_entry, FTY_SHM_METRIC_TYPE, asset.c_str(), type.c_str());
+    DIR* dir;
+    stat_add(STAT_SCAN);
+    stat_add(STAT_SYSCALLS, 2); // open, close
+    if (!(dir = opendir(family_dir.c_str()))) {
+        FTY_SHM_PROBE3(read_family_return, FTY_SHM_METRIC_TYPE, -1, 0);
+        return -1;
+    }
+    std::vector<Entry> entries;
+    struct dirent*     de;
+    while ((de = readdir(dir))) {
+        stat_add(STAT_SCAN_ENTRIES);
+        // Skip the temporary files, and what is not a metric
+        if (de->d_name[0] == '.' || !strchr(de->d_name, '@'))
+            continue;
+        entries.push_back({de->d_name, {}});
+    }
+    closedir(dir);
+
+    ParallelScan scan(entries, family_dir, assetFilter, typeFilter, pool);
+    size_t       workers = std::min(size_t(threads), std::max(size_t(1), entries.size() / MIN_ENTRIES_PER_WORKER));
+    std::vector<std::thread> worker_threads;
+    try {
+        for (size_t i = 1; i < workers; i++)
+            worker_threads.emplace_back(&ParallelScan::work, &scan);
+    } catch (const std::system_error& e) {
+        // Fewer workers, the calling thread is one of them anyway
+    }
+    scan.work();
+    for (auto& thread : worker_threads)
+        thread.join();
+
+    size_t count = result.size();
+    for (auto& entry : entries) {
+        for (auto metric : entry.metrics)
+            result.add(metric);
+    }
+    FTY_SHM_PROBE3(read_family_return, FTY_SHM_METRIC_TYPE, 0, result.size() - count);
+    return 0;
+}
+
+int fty::shm::read_metrics(const std::string& asset, const std::string& type, shmMetrics& result, unsigned threads)
+{
+    return read_metrics_parallel(asset, type, result, threads, nullptr);
+}
+
+int fty::shm::read_metrics(const std::string& asset, const std::string& type, PooledMetrics& result, unsigned threads)
+{
+    return read_metrics_parallel(asset, type, result, threads, result.pool());
+}
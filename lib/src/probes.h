@@ -0,0 +1,46 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+#pragma once
+
+// USDT static tracepoints of the fty_shm provider (see bpftrace/README.md).
+// A probe is a single nop until a tracer attaches to it. Arguments must be
+// values the code computes anyway, so that an idle probe costs nothing.
+// Probes are compiled in when sys/sdt.h (systemtap-sdt-dev) is available,
+// define FTY_SHM_NO_USDT to leave them out.
+
+#if !defined(FTY_SHM_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define FTY_SHM_HAVE_USDT
+#endif
+#endif
+
+#ifdef FTY_SHM_HAVE_USDT
+#define FTY_SHM_PROBE1(name, a1)             DTRACE_PROBE1(fty_shm, name, a1)
+#define FTY_SHM_PROBE2(name, a1, a2)         DTRACE_PROBE2(fty_shm, name, a1, a2)
+#define FTY_SHM_PROBE3(name, a1, a2, a3)     DTRACE_PROBE3(fty_shm, name, a1, a2, a3)
+#define FTY_SHM_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(fty_shm, name, a1, a2, a3, a4)
+#else
+// sizeof() keeps the arguments "used" without evaluating them
+#define FTY_SHM_PROBE1(name, a1)             do { (void)sizeof(a1); } while (0)
+#define FTY_SHM_PROBE2(name, a1, a2)         do { (void)sizeof(a1); (void)sizeof(a2); } while (0)
+#define FTY_SHM_PROBE3(name, a1, a2, a3)     do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); } while (0)
+#define FTY_SHM_PROBE4(name, a1, a2, a3, a4) \
+    do { (void)sizeof(a1); (void)sizeof(a2); (void)sizeof(a3); (void)sizeof(a4); } while (0)
+#endif
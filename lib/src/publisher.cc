@@ -17,7 +17,10 @@
     =========================================================================
 */
 
+#include "fty_shm_internal.h"
+#include "probes.h"
 #include "publisher.h"
+#include "stats.h"
 
 #include <fty_common.h>
 #include <fty_proto.h>
@@ -30,51 +33,592 @@
 
 #include <fty/expected.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+// The messages are sent by the thread of the Publisher, which connects to the
+// bus (retrying with a backoff while it fails), so that the writes never wait
+// for the broker: they only queue their messages. While the bus is out of
+// reach, the oldest messages are dropped past PUBLISH_QUEUE_MAX. In the
+// batched modes, the metrics are kept per asset until the message of the
+// asset is queued: by the thread once the window of its first metric is over,
+// or at the end of the batch write which published them. A shutdown doesn't
+// wait past its timeout for a thread blocked in the bus: the thread is left
+// behind, with its own reference to the bus, and the Publisher is never
+// destroyed.
+
 using namespace fty::messagebus;
 
-static int metric2JSON(fty_proto_t* metric, std::string& json);
 static fty_proto_t* protoMetric(const std::string& metric, const std::string& asset, const std::string& value, const std::string& unit, uint32_t ttl);
 
+// FTY_SHM_PUBLISH and FTY_SHM_PUBLISH_WINDOW, read again after a reset
+#define DEFAULT_PUBLISH_WINDOW 100
+static std::atomic<int>      publish_mode{-1};
+static std::atomic<unsigned> publish_window{DEFAULT_PUBLISH_WINDOW};
+// FTY_SHM_TRANSPORT, read again after a reset
+static std::atomic<int> publish_transports{-1};
+
+// Messages kept while the bus can't be reached
+#define PUBLISH_QUEUE_MAX 10000
+// Delays between the connection attempts, doubled at each failure (ms)
+#define CONNECT_RETRY_MIN 100
+#define CONNECT_RETRY_MAX 5000
+// Time given to the pending messages at exit (ms)
+#define SHUTDOWN_TIMEOUT 1000
+
+// Publisher::Batch nesting of the thread, and the assets published within
+static thread_local int                      batch_depth = 0;
+static thread_local std::vector<std::string> batch_assets;
+
+static fty::shm::PublishMode publishMode(unsigned& window)
+{
+    int mode = publish_mode.load(std::memory_order_relaxed);
+    if (mode < 0) {
+        const char* valenv = getenv("FTY_SHM_PUBLISH");
+        mode = fty::shm::PUBLISH_METRIC;
+        if (valenv && strcmp(valenv, "asset") == 0)
+            mode = fty::shm::PUBLISH_ASSET;
+        else if (valenv && strcmp(valenv, "both") == 0)
+            mode = fty::shm::PUBLISH_BOTH;
+        valenv = getenv("FTY_SHM_PUBLISH_WINDOW");
+        if (valenv)
+            publish_window.store(unsigned(strtoul(valenv, nullptr, 10)), std::memory_order_relaxed);
+        publish_mode.store(mode, std::memory_order_relaxed);
+    }
+    window = publish_window.load(std::memory_order_relaxed);
+    return fty::shm::PublishMode(mode);
+}
+
+static unsigned publishTransports()
+{
+    int transports = publish_transports.load(std::memory_order_relaxed);
+    if (transports < 0) {
+        const char* valenv = getenv("FTY_SHM_TRANSPORT");
+        transports = fty::shm::TRANSPORT_MQTT;
+        if (valenv && strcmp(valenv, "local") == 0)
+            transports = fty::shm::TRANSPORT_LOCAL;
+        else if (valenv && strcmp(valenv, "both") == 0)
+            transports = fty::shm::TRANSPORT_MQTT | fty::shm::TRANSPORT_LOCAL;
+        publish_transports.store(transports, std::memory_order_relaxed);
+    }
+    return unsigned(transports);
+}
+
+namespace {
+
+// The broker
+class MqttBus : public fty::shm::PublishBus
+{
+public:
+    MqttBus()
+        : msgBus(std::make_shared<mqtt::MessageBusMqtt>("fty-shm"))
+    {
+    }
+
+    int connect(std::string& error) override
+    {
+        fty::Expected<void> connectionRet = msgBus->connect();
+        if (!connectionRet) {
+            error = connectionRet.error();
+            return -1;
+        }
+        return 0;
+    }
+
+    int send(const std::string& topic, const std::string& payload, std::string& error) override
+    {
+        Message msg = Message::buildMessage("fty-shm", topic, "MESSAGE", payload);
+        fty::Expected<void> sendRet = msgBus->send(msg);
+        if (!sendRet) {
+            error = sendRet.error();
+            return -1;
+        }
+        return 0;
+    }
+
+private:
+    std::shared_ptr<MessageBus> msgBus;
+};
+
+} // namespace
+
+void reset_publish_mode()
+{
+    publish_window.store(DEFAULT_PUBLISH_WINDOW);
+    publish_mode.store(-1);
+    publish_transports.store(-1);
+}
+
+void fty::shm::set_publish_transport(unsigned transports)
+{
+    publish_transports.store(int(transports & (TRANSPORT_MQTT | TRANSPORT_LOCAL)), std::memory_order_relaxed);
+}
+
+void fty::shm::set_publish_mode(PublishMode mode, unsigned window_ms)
+{
+    publish_window.store(window_ms, std::memory_order_relaxed);
+    publish_mode.store(mode, std::memory_order_relaxed);
+}
+
+int fty::shm::init()
+{
+    Publisher::init();
+    return 0;
+}
+
+int fty::shm::flush(int timeout_ms)
+{
+    return Publisher::flush(timeout_ms);
+}
+
+int fty::shm::shutdown(int timeout_ms)
+{
+    return Publisher::shutdown(timeout_ms);
+}
+
+void fty::shm::set_publish_bus(std::shared_ptr<PublishBus> bus)
+{
+    Publisher::setBus(std::move(bus));
+}
+
+fty::shm::MockPublishBus::MockPublishBus(bool record)
+    : m_record(record)
+    , m_count(0)
+{
+}
+
+int fty::shm::MockPublishBus::connect(std::string& /*error*/)
+{
+    return 0;
+}
+
+int fty::shm::MockPublishBus::send(const std::string& topic, const std::string& payload, std::string& /*error*/)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_count++;
+    if (m_record)
+        m_messages.push_back({topic, payload});
+    return 0;
+}
+
+size_t fty::shm::MockPublishBus::count() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_count;
+}
+
+std::vector<fty::shm::MockPublishBus::Message> fty::shm::MockPublishBus::messages() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_messages;
+}
+
+void fty::shm::MockPublishBus::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_count = 0;
+    m_messages.clear();
+}
+
+int fty_shm_init(void)
+{
+    return fty::shm::init();
+}
+
+int fty_shm_flush(int timeout_ms)
+{
+    return fty::shm::flush(timeout_ms);
+}
+
+int fty_shm_shutdown(void)
+{
+    return fty::shm::shutdown(SHUTDOWN_TIMEOUT);
+}
+
 namespace fty::shm
 {
     Publisher::Publisher()
-    { 
-        //Create the bus object
-        msgBus = std::make_shared<mqtt::MessageBusMqtt>("fty-shm");
+    {
+    }
 
-        //Connect to the bus
-        fty::Expected<void> connectionRet = msgBus->connect();
-        if(! connectionRet) {
-            throw std::runtime_error(connectionRet.error());
+    void Publisher::init()
+    {
+        Publisher& publisher = getInstance();
+        std::lock_guard<std::mutex> lock(publisher.mutex);
+        publisher.ensureThread();
+    }
+
+    int Publisher::flush(int timeout_ms)
+    {
+        return getInstance().flushQueue(timeout_ms);
+    }
+
+    int Publisher::shutdown(int timeout_ms)
+    {
+        return getInstance().stop(timeout_ms);
+    }
+
+    void Publisher::setBus(std::shared_ptr<PublishBus> newBus)
+    {
+        Publisher& publisher = getInstance();
+        publisher.stop(SHUTDOWN_TIMEOUT);
+        std::lock_guard<std::mutex> lock(publisher.mutex);
+        publisher.injectedBus = std::move(newBus);
+    }
+
+    int Publisher::flushQueue(int timeout_ms)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(timeout_ms, 0));
+        queueBatches(nullptr);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        auto done = [this] { return queue.empty() && !sending; };
+        if (timeout_ms < 0) {
+            sent.wait(lock, done);
+        }
+        else if (!sent.wait_until(lock, deadline, done)) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        return 0;
+    }
+
+    int Publisher::stop(int timeout_ms)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(timeout_ms, 0));
+        flushQueue(timeout_ms);
+
+        std::thread       stopped;
+        std::future<void> done;
+        bool              blocked;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            generation++;
+            stopped.swap(thread);
+            done    = std::move(threadDone);
+            blocked = sending || connecting;
+        }
+        wake.notify_all();
+        // Otherwise the thread is about to see the new generation
+        bool left = false;
+        if (stopped.joinable()) {
+            if (!blocked || timeout_ms < 0 || done.wait_until(deadline) == std::future_status::ready) {
+                stopped.join();
+            }
+            else {
+                logError("publisher thread blocked on the bus, left behind");
+                stopped.detach();
+                left = true;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t dropped = queue.size() + batches.size();
+        queue.clear();
+        batches.clear();
+        sending    = false;
+        connecting = false;
+        stopping   = false;
+        sent.notify_all();
+        if (dropped) {
+            logError("{} messages dropped at shutdown", dropped);
+            stat_add(STAT_PUBLISH_DROPPED, dropped);
+        }
+        if (dropped || left) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        return 0;
+    }
+
+    void Publisher::ensureThread()
+    {
+        if (!stopping && !thread.joinable()) {
+            std::promise<void> done;
+            threadDone = done.get_future();
+            thread     = std::thread(&Publisher::run, this, generation, injectedBus, std::move(done));
+        }
+    }
+
+    void Publisher::enqueue(Outgoing&& message)
+    {
+        if (queue.size() >= PUBLISH_QUEUE_MAX) {
+            // Not connected for long: the oldest updates are the least useful
+            queue.pop_front();
+            stat_add(STAT_PUBLISH_DROPPED);
+        }
+        queue.push_back(std::move(message));
+        ensureThread();
+        wake.notify_one();
+    }
+
+    void Publisher::run(unsigned runGeneration, std::shared_ptr<PublishBus> bus, std::promise<void> done)
+    {
+        using clock = std::chrono::steady_clock;
+
+        done.set_value_at_thread_exit();
+        auto retry     = clock::time_point::min();
+        auto backoff   = std::chrono::milliseconds(CONNECT_RETRY_MIN);
+        bool connected = false;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (runGeneration == generation) {
+            auto now  = clock::now();
+            auto next = clock::time_point::max();
+            std::vector<std::pair<std::string, AssetBatch>> due;
+            for (auto it = batches.begin(); it != batches.end();) {
+                if (it->second.deadline <= now) {
+                    due.emplace_back(it->first, std::move(it->second));
+                    it = batches.erase(it);
+                }
+                else {
+                    next = std::min(next, it->second.deadline);
+                    ++it;
+                }
+            }
+            if (!due.empty()) {
+                lock.unlock();
+                std::vector<Outgoing> messages(due.size());
+                for (size_t i = 0; i < due.size(); i++) {
+                    if (!batchMessage(due[i].first, due[i].second, messages[i])) {
+                        messages[i].topic.clear();
+                    }
+                }
+                lock.lock();
+                for (auto& message : messages) {
+                    if (!message.topic.empty()) {
+                        enqueue(std::move(message));
+                    }
+                }
+                continue;
+            }
+
+            if (!connected && now >= retry) {
+                connecting = true;
+                lock.unlock();
+                if (!bus) {
+                    bus = std::make_shared<MqttBus>();
+                }
+                std::string error;
+                int         r = bus->connect(error);
+                lock.lock();
+                if (runGeneration != generation) {
+                    break;
+                }
+                connecting = false;
+                if (r == 0) {
+                    connected = true;
+                    backoff   = std::chrono::milliseconds(CONNECT_RETRY_MIN);
+                }
+                else {
+                    logError("Error while connecting to the bus {}", error);
+                    retry   = clock::now() + backoff;
+                    backoff = std::min(backoff * 2, std::chrono::milliseconds(CONNECT_RETRY_MAX));
+                }
+                continue;
+            }
+
+            if (connected && !queue.empty()) {
+                Outgoing message = std::move(queue.front());
+                queue.pop_front();
+                sending = true;
+                lock.unlock();
+
+                std::string error;
+                if (bus->send(message.topic, message.json, error) < 0) {
+                    logError("Error while sending {}", error);
+                    stat_add(STAT_PUBLISH_SEND_ERROR);
+                }
+                else {
+                    stat_add(STAT_PUBLISH);
+                    if (message.batched) {
+                        stat_add(STAT_PUBLISH_BATCHED, message.batched);
+                    }
+                }
+
+                lock.lock();
+                if (runGeneration != generation) {
+                    break;
+                }
+                sending = false;
+                if (queue.empty()) {
+                    sent.notify_all();
+                }
+                continue;
+            }
+
+            if (!connected && !queue.empty()) {
+                next = std::min(next, retry);
+            }
+            if (next == clock::time_point::max()) {
+                wake.wait(lock);
+            }
+            else {
+                wake.wait_until(lock, next);
+            }
         }
     }
 
     int Publisher::publishMetric(fty_proto_t* metric)
+    {
+        const char* asset = metric ? fty_proto_name(metric) : nullptr;
+        const char* type  = metric ? fty_proto_type(metric) : nullptr;
+
+        FTY_SHM_PROBE2(publish_entry, asset, type);
+        unsigned transports = publishTransports();
+        if (metric && (transports & TRANSPORT_LOCAL)) {
+            const char* value = fty_proto_value(metric);
+            const char* unit  = fty_proto_unit(metric);
+            publish_local(
+                asset ? asset : "", type ? type : "", value ? value : "", unit ? unit : "", fty_proto_ttl(metric));
+        }
+        if (!(transports & TRANSPORT_MQTT)) {
+            FTY_SHM_PROBE3(publish_return, asset, type, 0);
+            return 0;
+        }
+
+        unsigned    window;
+        PublishMode mode = publishMode(window);
+        int r = 0;
+        if (mode != PUBLISH_ASSET) {
+            r = sendMetric(metric, asset, type);
+        }
+        if (mode != PUBLISH_METRIC && metric) {
+            getInstance().queueMetric(metric, window);
+        }
+        FTY_SHM_PROBE3(publish_return, asset, type, r);
+        return r;
+    }
+
+    void Publisher::queueMetric(fty_proto_t* metric, unsigned window)
+    {
+        std::string asset{fty_proto_name(metric)};
+        bool now = window == 0 && batch_depth == 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = batches.find(asset);
+            if (it == batches.end()) {
+                it = batches.emplace(asset, AssetBatch()).first;
+                it->second.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(window);
+            }
+            it->second.metrics[fty_proto_type(metric)] = {
+                fty_proto_value(metric), fty_proto_unit(metric), fty_proto_ttl(metric)};
+
+            if (batch_depth > 0) {
+                if (std::find(batch_assets.begin(), batch_assets.end(), asset) == batch_assets.end()) {
+                    batch_assets.push_back(asset);
+                }
+            } else if (!now) {
+                ensureThread();
+                wake.notify_one();
+            }
+        }
+        if (now) {
+            std::vector<std::string> assets{asset};
+            queueBatches(&assets);
+        }
+    }
+
+    void Publisher::queueBatches(const std::vector<std::string>* assets)
+    {
+        std::vector<std::pair<std::string, AssetBatch>> due;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!assets) {
+                for (auto& batch : batches) {
+                    due.emplace_back(batch.first, std::move(batch.second));
+                }
+                batches.clear();
+            }
+            else {
+                for (auto& asset : *assets) {
+                    auto it = batches.find(asset);
+                    if (it != batches.end()) {
+                        due.emplace_back(it->first, std::move(it->second));
+                        batches.erase(it);
+                    }
+                }
+            }
+        }
+        if (due.empty()) {
+            return;
+        }
+        std::vector<Outgoing> messages;
+        for (auto& batch : due) {
+            Outgoing message;
+            if (batchMessage(batch.first, batch.second, message)) {
+                messages.push_back(std::move(message));
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& message : messages) {
+            enqueue(std::move(message));
+        }
+    }
+
+    bool Publisher::batchMessage(const std::string& asset, const AssetBatch& batch, Outgoing& message)
+    {
+        // build asset json payload, the metrics by name
+        std::string json;
+        try {
+            cxxtools::SerializationInfo si;
+            si.addMember("asset") <<= asset;
+            si.addMember("timestamp") <<= std::to_string(std::time(nullptr)); // epoch time (now)
+            cxxtools::SerializationInfo& metrics = si.addMember("metrics");
+            for (auto& metric : batch.metrics) {
+                cxxtools::SerializationInfo& entry = metrics.addMember(metric.first);
+                entry.addMember("value") <<= metric.second.value;
+                entry.addMember("unit") <<= (metric.second.unit == " " ? std::string() : metric.second.unit);
+                entry.addMember("ttl") <<= metric.second.ttl;
+            }
+            json = JSON::writeToString(si, false/*beautify*/);
+        }
+        catch (const std::exception& e) {
+            logError("asset json serialization failed (e: '{}')", e.what());
+        }
+        if (json.empty()) {
+            stat_add(STAT_PUBLISH_ERROR);
+            return false;
+        }
+
+        message = {"/etn/metrics/" + asset, std::move(json), batch.metrics.size()};
+        return true;
+    }
+
+    Publisher::Batch::Batch()
+    {
+        batch_depth++;
+    }
+
+    Publisher::Batch::~Batch()
+    {
+        if (--batch_depth == 0 && !batch_assets.empty()) {
+            std::vector<std::string> assets;
+            assets.swap(batch_assets);
+            getInstance().queueBatches(&assets);
+        }
+    }
+
+    int Publisher::sendMetric(fty_proto_t* metric, const char* asset, const char* type)
     {
        // build metric json payload
         std::string json;
         int r = metric2JSON(metric, json);
-        if (r != 0) return -1;
+        if (r != 0) {
+            stat_add(STAT_PUBLISH_ERROR);
+            return -1;
+        }
 
         // publish on metric topic
         // see https://confluence-prod.tcc.etn.com/display/BiosWiki/MQTT+on+IPM2
-        std::string assetStr{fty_proto_name(metric)};
-        std::string metricStr{fty_proto_type(metric)};
-
-        //Build the message to send
-        Message msg = Message::buildMessage(
-            "fty-shm",
-            "/etn/metrics/" + assetStr + "/" + metricStr,
-            "MESSAGE",
-            json);
-
-        //Send the message
-        fty::Expected<void> sendRet = getInstance().msgBus->send(msg);
-        if(!sendRet) {
-            logError("Error while sending {}", sendRet.error());
-            return -2;
-        }
+        std::string assetStr{asset};
+        std::string metricStr{type};
 
+        //Queue the message, sent by the thread
+        Publisher& publisher = getInstance();
+        std::lock_guard<std::mutex> lock(publisher.mutex);
+        publisher.enqueue({"/etn/metrics/" + assetStr + "/" + metricStr, std::move(json), 0});
         return 0;
     }
 
@@ -107,14 +651,23 @@ namespace fty::shm
 
     Publisher& Publisher::getInstance()
     {
-        static Publisher instance; // Guaranteed to be destroyed.
-        return instance;
+        // Never destroyed, a thread left behind may still use it
+        static Publisher* instance = new Publisher();
+        // The pending messages are given SHUTDOWN_TIMEOUT at exit
+        static struct AtExit
+        {
+            ~AtExit()
+            {
+                instance->stop(SHUTDOWN_TIMEOUT);
+            }
+        } atExit;
+        return *instance;
     }
 }
 
 // proto metric json serializer
 // returns 0 if success, else <0
-static int metric2JSON(fty_proto_t* metric, std::string& json)
+int metric2JSON(fty_proto_t* metric, std::string& json)
 {
     json.clear();
 
@@ -18,17 +18,31 @@
 */
 #pragma once
 
+#include "fty_shm.h"
 #include <fty_proto.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
 #include <string>
 #include <memory>
+#include <thread>
+#include <vector>
 
-namespace fty::messagebus
-{
-        class MessageBus;
-}
+// proto metric json serializer (returns 0 if success, else <0)
+int metric2JSON(fty_proto_t* metric, std::string& json);
+
+// Read FTY_SHM_PUBLISH and FTY_SHM_PUBLISH_WINDOW again, when the store is
+// deleted
+void reset_publish_mode();
 
 namespace fty::shm
 {
+    // Sends the publications on the message bus from a thread of its own:
+    // the writes only queue them, and never wait for the connection to the
+    // bus, made by the thread (again after a failure).
     class Publisher
     {
     public:
@@ -37,10 +51,90 @@ namespace fty::shm
         static int publishMetric(const std::string& metric, const std::string& asset, const std::string& value, const std::string& unit, uint32_t ttl);
         static int publishMetric(const std::string& fileName, const std::string& value, const std::string& unit, uint32_t ttl);
 
+        // Start the thread, which connects to the bus
+        static void init();
+        // Queue the pending batches, and wait at most timeout_ms (forever if
+        // < 0) for the queue to be sent. Returns 0 if it was, -1 otherwise
+        // (errno is ETIMEDOUT)
+        static int flush(int timeout_ms);
+        // Flush, then stop the thread and drop what is left, counted by
+        // STAT_PUBLISH_DROPPED. A thread still blocked on the bus at the end
+        // of timeout_ms is left behind, to end on its own. The next
+        // publication starts a new one. Returns 0 if nothing was dropped
+        // and the thread stopped, -1 otherwise (errno is ETIMEDOUT)
+        static int shutdown(int timeout_ms);
+        // Shut down, then send to bus (the broker if nullptr)
+        static void setBus(std::shared_ptr<PublishBus> bus);
+
+        // Groups the publications of a batch write: in the batched modes,
+        // the assets published while it lives are sent when the outermost
+        // one ends, whatever the window
+        class Batch
+        {
+        public:
+            Batch();
+            ~Batch();
+            Batch(const Batch&) = delete;
+            Batch& operator=(const Batch&) = delete;
+        };
+
     private:
+        // Last write of a metric, waiting for the message of its asset
+        struct Pending
+        {
+            std::string value;
+            std::string unit;
+            uint32_t    ttl;
+        };
+        struct AssetBatch
+        {
+            std::chrono::steady_clock::time_point deadline;
+            std::map<std::string, Pending>        metrics;
+        };
+        // A message waiting for the thread
+        struct Outgoing
+        {
+            std::string topic;
+            std::string json;
+            // Metrics in it, for a batch
+            size_t batched;
+        };
+
         Publisher();
+        static int sendMetric(fty_proto_t* metric, const char* asset, const char* type);
         static Publisher& getInstance();
 
-        std::shared_ptr<fty::messagebus::MessageBus> msgBus;
+        // Add metric to the batch of its asset, sent after window ms (at once
+        // for 0) or at the end of the current Batch
+        void queueMetric(fty_proto_t* metric, unsigned window);
+        // Build the message of the batch of asset
+        static bool batchMessage(const std::string& asset, const AssetBatch& batch, Outgoing& message);
+        // Queue the batches of assets (all of them if nullptr)
+        void queueBatches(const std::vector<std::string>* assets);
+        // Queue a message, with the lock held
+        void enqueue(Outgoing&& message);
+        // Start the thread if needed, with the lock held
+        void ensureThread();
+        void run(unsigned generation, std::shared_ptr<PublishBus> bus, std::promise<void> done);
+        int flushQueue(int timeout_ms);
+        int stop(int timeout_ms);
+
+        // Set by setBus()
+        std::shared_ptr<PublishBus>       injectedBus;
+
+        std::mutex                        mutex;
+        std::condition_variable           wake;
+        std::condition_variable           sent;
+        std::map<std::string, AssetBatch> batches;
+        std::deque<Outgoing>              queue;
+        // Taken from the queue, being sent
+        bool                              sending = false;
+        // In bus->connect()
+        bool                              connecting = false;
+        bool                              stopping = false;
+        // Of the current thread, the threads left behind see it changed
+        unsigned                          generation = 0;
+        std::thread                       thread;
+        std::future<void>                 threadDone;
     };
 }
@@ -0,0 +1,378 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Read cache: the parsed metric files of the process, while they are valid
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include "stats.h"
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <list>
+#include <mutex>
+#include <string.h>
+#include <string_view>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+// An entry is the parsed content of a metric file, with the inode, size,
+// mtime and ctime the file had when it was read. It is good as long as the
+// file still has them: a rewrite changes the mtime, a replacement the
+// inode. This is checked with one fstatat per hit, or, in notify mode, by
+// draining an inotify watch of the family: a hit then costs a read() of the
+// watch, which fails with EAGAIN without any path lookup until the next
+// write.
+//
+// Outdated entries are never served: the read goes to the file, which
+// handles the expiry (and the removal) as usual. Metrics read from bundles
+// are not cached.
+
+// Changes of a metric file, as for the watcher, plus the in place ones
+#define CACHE_WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_MODIFY | IN_ATTRIB)
+
+// Below this age, the times of a file may not tell a rewrite (see put())
+#define CACHE_RACY_NS 20000000
+
+// Accounted size of an entry, on top of its strings
+#define CACHE_ENTRY_COST 160
+
+using namespace fty::shm;
+
+namespace {
+
+// What tells a version of a file from another
+struct FileId
+{
+    ino_t           ino;
+    off_t           size;
+    struct timespec mtime;
+    struct timespec ctime;
+
+    bool operator==(const FileId& other) const
+    {
+        return ino == other.ino && size == other.size && mtime.tv_sec == other.mtime.tv_sec &&
+               mtime.tv_nsec == other.mtime.tv_nsec && ctime.tv_sec == other.ctime.tv_sec &&
+               ctime.tv_nsec == other.ctime.tv_nsec;
+    }
+};
+
+FileId file_id(const struct stat& st)
+{
+    return {st.st_ino, st.st_size, st.st_mtim, st.st_ctim};
+}
+
+struct Entry
+{
+    std::string filename;
+    FileId      id;
+    time_t      ttl;
+    std::string unit;
+    std::string value;
+    // Read by read_value(), which does not parse the aux
+    bool                                             has_aux;
+    std::vector<std::pair<std::string, std::string>> aux;
+    size_t                                           cost;
+};
+
+class ReadCache
+{
+public:
+    void configure(size_t budget, bool notify);
+    bool enabled() const
+    {
+        return m_budget.load(std::memory_order_relaxed) > 0;
+    }
+    bool get(const char* filename, fty_proto_t* proto_metric);
+    bool get(const char* filename, std::string& value, std::string& unit);
+    void put(const char* filename, const struct stat& st, time_t ttl, const char* unit, const char* value,
+        zhash_t* aux, bool has_aux);
+    void clear();
+
+private:
+    typedef std::list<Entry>::iterator Iterator;
+
+    bool watched(const char* filename) const;
+    bool lookup(std::unique_lock<std::mutex>& lock, const char* filename, bool need_aux, Iterator& it);
+    void drain();
+    void erase(Iterator it);
+    void clear_locked();
+
+    std::mutex                                     m_mutex;
+    std::atomic<size_t>                            m_budget{0};
+    size_t                                         m_used = 0;
+    std::list<Entry>                               m_lru;
+    std::unordered_map<std::string_view, Iterator> m_index;
+    // Notify mode
+    int         m_notify_fd = -1;
+    std::string m_notify_dir;
+};
+
+ReadCache read_cache;
+
+void ReadCache::configure(size_t budget, bool notify)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    clear_locked();
+    if (m_notify_fd >= 0) {
+        close(m_notify_fd);
+        m_notify_fd = -1;
+        m_notify_dir.clear();
+    }
+    if (budget && notify) {
+        // Without the watch, the cache falls back to fstatat
+        m_notify_dir = family_directory(FTY_SHM_METRIC_TYPE);
+        m_notify_fd  = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (m_notify_fd >= 0 && inotify_add_watch(m_notify_fd, m_notify_dir.c_str(), CACHE_WATCH_MASK) < 0) {
+            close(m_notify_fd);
+            m_notify_fd = -1;
+        }
+    }
+    m_budget.store(budget, std::memory_order_relaxed);
+}
+
+void ReadCache::erase(Iterator it)
+{
+    m_used -= it->cost;
+    m_index.erase(it->filename);
+    m_lru.erase(it);
+}
+
+void ReadCache::clear_locked()
+{
+    m_index.clear();
+    m_lru.clear();
+    m_used = 0;
+}
+
+void ReadCache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    clear_locked();
+}
+
+// Whether the changes of filename are notified
+bool ReadCache::watched(const char* filename) const
+{
+    size_t dir_len = m_notify_dir.length();
+    return m_notify_fd >= 0 && strncmp(filename, m_notify_dir.c_str(), dir_len) == 0 && filename[dir_len] == '/' &&
+           !strchr(filename + dir_len + 1, '/');
+}
+
+// Forget the entries of the files changed since the last call
+void ReadCache::drain()
+{
+    alignas(struct inotify_event) char buf[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+    std::string                        filename(m_notify_dir);
+    filename.append("/");
+    size_t dir_len = filename.length();
+
+    while (true) {
+        stat_add(STAT_SYSCALLS);
+        ssize_t len = read(m_notify_fd, buf, sizeof(buf));
+        if (len <= 0)
+            break;
+        // Room for another event: the queue was empty, no need to read again
+        bool drained = size_t(len) + sizeof(struct inotify_event) + NAME_MAX + 1 <= sizeof(buf);
+        for (char* p = buf; p < buf + len;) {
+            struct inotify_event* event = reinterpret_cast<struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                clear_locked();
+                continue;
+            }
+            if (event->len == 0)
+                continue;
+            filename.resize(dir_len);
+            filename.append(event->name);
+            auto it = m_index.find(filename);
+            if (it != m_index.end())
+                erase(it->second);
+        }
+        if (drained)
+            break;
+    }
+}
+
+// Find the entry of filename, if it is still the content of the file and
+// not outdated, and make it the most recently used. The lock is released
+// meanwhile for the fstatat.
+bool ReadCache::lookup(std::unique_lock<std::mutex>& lock, const char* filename, bool need_aux, Iterator& it)
+{
+    bool notified = watched(filename);
+    if (notified)
+        drain();
+
+    auto index = m_index.find(filename);
+    if (index == m_index.end() || (need_aux && !index->second->has_aux))
+        return false;
+    it = index->second;
+    if (it->ttl && time(nullptr) - it->id.mtime.tv_sec > it->ttl) {
+        erase(it);
+        return false;
+    }
+    if (!notified) {
+        FileId      id = it->id;
+        struct stat st;
+        lock.unlock();
+        stat_add(STAT_SYSCALLS);
+        bool valid = fstatat(AT_FDCWD, filename, &st, 0) == 0 && file_id(st) == id;
+        lock.lock();
+        // The entry may have changed meanwhile
+        index = m_index.find(filename);
+        if (index == m_index.end() || !(index->second->id == id))
+            return false;
+        it = index->second;
+        if (!valid) {
+            erase(it);
+            return false;
+        }
+    }
+    m_lru.splice(m_lru.begin(), m_lru, it);
+    return true;
+}
+
+bool ReadCache::get(const char* filename, fty_proto_t* proto_metric)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    Iterator                     it;
+    if (!lookup(lock, filename, true, it)) {
+        stat_add(STAT_READ_CACHE_MISS);
+        return false;
+    }
+    fty_proto_set_ttl(proto_metric, uint32_t(it->ttl));
+    fty_proto_set_time(proto_metric, uint64_t(it->id.mtime.tv_sec));
+    fty_proto_set_unit(proto_metric, "%s", it->unit.c_str());
+    fty_proto_set_value(proto_metric, "%s", it->value.c_str());
+    for (auto& item : it->aux)
+        fty_proto_aux_insert(proto_metric, item.first.c_str(), "%s", item.second.c_str());
+    stat_add(STAT_READ_CACHE_HIT);
+    return true;
+}
+
+bool ReadCache::get(const char* filename, std::string& value, std::string& unit)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    Iterator                     it;
+    if (!lookup(lock, filename, false, it)) {
+        stat_add(STAT_READ_CACHE_MISS);
+        return false;
+    }
+    value = it->value;
+    unit  = it->unit;
+    stat_add(STAT_READ_CACHE_HIT);
+    return true;
+}
+
+void ReadCache::put(const char* filename, const struct stat& st, time_t ttl, const char* unit, const char* value,
+    zhash_t* aux, bool has_aux)
+{
+    Entry entry;
+    entry.filename = filename;
+    entry.id       = file_id(st);
+    entry.ttl      = ttl;
+    entry.unit     = unit;
+    entry.value    = value;
+    entry.has_aux  = has_aux;
+    entry.cost     = CACHE_ENTRY_COST + 2 * entry.filename.size() + entry.unit.size() + entry.value.size();
+    for (char* item = aux ? static_cast<char*>(zhash_first(aux)) : nullptr; item;
+         item       = static_cast<char*>(zhash_next(aux))) {
+        entry.aux.emplace_back(zhash_cursor(aux), item);
+        entry.cost += CACHE_ENTRY_COST / 2 + entry.aux.back().first.size() + entry.aux.back().second.size();
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t                      budget = m_budget.load(std::memory_order_relaxed);
+    if (entry.cost > budget)
+        return;
+    if (watched(filename)) {
+        // The notification of a change since the read may be drained already
+        struct stat now;
+        stat_add(STAT_SYSCALLS);
+        if (fstatat(AT_FDCWD, filename, &now, 0) < 0 || !(file_id(now) == entry.id))
+            return;
+    } else {
+        // File times have the granularity of a clock tick: a file read in
+        // the tick of its last write could still be rewritten with the same
+        // times. It is cached by a later read.
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t age = (int64_t(now.tv_sec) - entry.id.mtime.tv_sec) * 1000000000 + now.tv_nsec -
+                      entry.id.mtime.tv_nsec;
+        if (age < CACHE_RACY_NS)
+            return;
+    }
+    auto index = m_index.find(entry.filename);
+    if (index != m_index.end())
+        erase(index->second);
+    while (m_used + entry.cost > budget)
+        erase(std::prev(m_lru.end()));
+    m_used += entry.cost;
+    m_lru.push_front(std::move(entry));
+    m_index.emplace(m_lru.front().filename, m_lru.begin());
+}
+
+} // namespace
+
+bool read_cache_enabled()
+{
+    static bool configured = [] {
+        // Size in KiB
+        const char* valenv = getenv("FTY_SHM_READ_CACHE");
+        if (valenv && strtoul(valenv, nullptr, 10) > 0)
+            read_cache.configure(size_t(strtoul(valenv, nullptr, 10)) * 1024, false);
+        return true;
+    }();
+    return configured && read_cache.enabled();
+}
+
+bool read_cache_get(const char* filename, fty_proto_t* proto_metric)
+{
+    return read_cache.get(filename, proto_metric);
+}
+
+bool read_cache_get(const char* filename, std::string& value, std::string& unit)
+{
+    return read_cache.get(filename, value, unit);
+}
+
+void read_cache_put(const char* filename, const struct stat& st, fty_proto_t* proto_metric)
+{
+    read_cache.put(filename, st, time_t(fty_proto_ttl(proto_metric)), fty_proto_unit(proto_metric),
+        fty_proto_value(proto_metric), fty_proto_aux(proto_metric), true);
+}
+
+void read_cache_put(const char* filename, const struct stat& st, time_t ttl, const char* unit, const char* value)
+{
+    read_cache.put(filename, st, ttl, unit, value, nullptr, false);
+}
+
+void reset_read_cache()
+{
+    read_cache.clear();
+}
+
+void fty::shm::set_read_cache(size_t budget, bool notify)
+{
+    read_cache_enabled();
+    read_cache.configure(budget, notify);
+}
@@ -0,0 +1,223 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Snapshot of the whole store in a single file, to warm it up after a reboot
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// File layout, in host byte order (the snapshot does not leave the box):
+//   magic
+//   records: time (u64), ttl (u32), family, asset, metric, value, unit,
+//            aux count (u32), aux key/value pairs
+// where each string is its length (u32) followed by its bytes.
+#define SNAPSHOT_MAGIC     "FTYSHMS1"
+#define SNAPSHOT_MAGIC_LEN 8
+
+namespace {
+
+class SnapshotWriter
+{
+public:
+    explicit SnapshotWriter(FILE* file)
+        : m_file(file)
+    {
+    }
+    void u32(uint32_t v)
+    {
+        fwrite(&v, sizeof(v), 1, m_file);
+    }
+    void u64(uint64_t v)
+    {
+        fwrite(&v, sizeof(v), 1, m_file);
+    }
+    void str(const char* s)
+    {
+        uint32_t len = s ? uint32_t(strlen(s)) : 0;
+        u32(len);
+        fwrite(s, 1, len, m_file);
+    }
+
+private:
+    FILE* m_file;
+};
+
+class SnapshotReader
+{
+public:
+    SnapshotReader(const char* data, size_t len)
+        : m_p(data)
+        , m_end(data + len)
+    {
+    }
+    bool done() const
+    {
+        return m_p >= m_end;
+    }
+    bool u32(uint32_t& v)
+    {
+        return get(&v, sizeof(v));
+    }
+    bool u64(uint64_t& v)
+    {
+        return get(&v, sizeof(v));
+    }
+    bool str(std::string& s)
+    {
+        uint32_t len;
+        if (!u32(len) || size_t(m_end - m_p) < len)
+            return false;
+        s.assign(m_p, len);
+        m_p += len;
+        return true;
+    }
+
+private:
+    bool get(void* v, size_t len)
+    {
+        if (size_t(m_end - m_p) < len)
+            return false;
+        memcpy(v, m_p, len);
+        m_p += len;
+        return true;
+    }
+    const char* m_p;
+    const char* m_end;
+};
+
+} // namespace
+
+int fty::shm::save_snapshot(const std::string& path)
+{
+    shmMetrics metrics;
+    if (read_metrics(".*", ".*", metrics) < 0)
+        return -1;
+
+    // Write aside and rename, never leave a partial snapshot behind
+    std::string tmp_path(path);
+    tmp_path.append(".tmp");
+    FILE* file = fopen(tmp_path.c_str(), "w");
+    if (file == nullptr)
+        return -1;
+
+    SnapshotWriter writer(file);
+    fwrite(SNAPSHOT_MAGIC, 1, SNAPSHOT_MAGIC_LEN, file);
+    for (auto& metric : metrics) {
+        writer.u64(fty_proto_time(metric));
+        writer.u32(fty_proto_ttl(metric));
+        writer.str(FTY_SHM_METRIC_TYPE);
+        writer.str(fty_proto_name(metric));
+        writer.str(fty_proto_type(metric));
+        writer.str(fty_proto_value(metric));
+        writer.str(fty_proto_unit(metric));
+        zhash_t* aux = fty_proto_aux(metric);
+        writer.u32(aux ? uint32_t(zhash_size(aux)) : 0);
+        if (aux) {
+            for (char* item = static_cast<char*>(zhash_first(aux)); item;
+                 item       = static_cast<char*>(zhash_next(aux))) {
+                writer.str(zhash_cursor(aux));
+                writer.str(item);
+            }
+        }
+    }
+
+    bool failed = ferror(file) != 0;
+    if (fclose(file) < 0 || failed || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        int err = errno;
+        unlink(tmp_path.c_str());
+        errno = err;
+        return -1;
+    }
+    return int(metrics.size());
+}
+
+int fty::shm::restore_snapshot(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    // One pass: read the whole snapshot at once
+    std::vector<char> data(size_t(st.st_size));
+    ssize_t           len = read(fd, data.data(), data.size());
+    close(fd);
+    if (len != st.st_size || size_t(len) < SNAPSHOT_MAGIC_LEN ||
+        memcmp(data.data(), SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    SnapshotReader reader(data.data() + SNAPSHOT_MAGIC_LEN, data.size() - SNAPSHOT_MAGIC_LEN);
+    time_t         now      = time(nullptr);
+    int            restored = 0;
+    while (!reader.done()) {
+        uint64_t    timestamp;
+        uint32_t    ttl, aux_count;
+        std::string family, asset, metric, value, unit;
+        if (!reader.u64(timestamp) || !reader.u32(ttl) || !reader.str(family) || !reader.str(asset) ||
+            !reader.str(metric) || !reader.str(value) || !reader.str(unit) || !reader.u32(aux_count)) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        fty_proto_t* proto = fty_proto_new(FTY_PROTO_METRIC);
+        fty_proto_set_name(proto, "%s", asset.c_str());
+        fty_proto_set_type(proto, "%s", metric.c_str());
+        fty_proto_set_value(proto, "%s", value.c_str());
+        fty_proto_set_unit(proto, "%s", unit.c_str());
+        fty_proto_set_ttl(proto, ttl);
+        for (uint32_t i = 0; i < aux_count; i++) {
+            std::string key, item;
+            if (!reader.str(key) || !reader.str(item)) {
+                fty_proto_destroy(&proto);
+                errno = EINVAL;
+                return -1;
+            }
+            fty_proto_aux_insert(proto, key.c_str(), "%s", item.c_str());
+        }
+
+        // Outdated metrics are not restored, and a metric already written
+        // again since the snapshot is kept. So is a family which is not a
+        // directory of the store
+        char        filename[PATH_MAX];
+        struct stat current;
+        bool        outdated = ttl && now - time_t(timestamp) > time_t(ttl);
+        if (!outdated && valid_family_name(family) &&
+            prepare_filename(
+                filename, asset.c_str(), asset.length(), metric.c_str(), metric.length(), family.c_str()) == 0 &&
+            !(stat(filename, &current) == 0 && uint64_t(current.st_mtime) >= timestamp) &&
+            // Keep the original timestamp, the metric will expire on its own
+            write_metric_file(filename, proto, time_t(timestamp)) == 0) {
+            restored++;
+        }
+        fty_proto_destroy(&proto);
+    }
+    return restored;
+}
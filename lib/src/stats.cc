@@ -0,0 +1,218 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#include "stats.h"
+#include "fty_shm.h"
+#include <algorithm>
+#include <cstddef>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STATS_DIR    "/dev/shm"
+#define STATS_PREFIX "fty-shm-stats."
+#define STATS_MAGIC  0x46545953 // "FTYS"
+
+using namespace fty::shm;
+
+// Keep in sync with StatId
+static const char* stat_names[STAT_COUNT] = {"write", "write_error", "read", "read_enoent", "read_estale",
+    "read_error", "scan", "scan_entries", "publish", "publish_error", "publish_send_error", "stale_removed",
+    "bytes_written", "bytes_read", "syscalls", "update_log", "update_log_dropped",
+    "read_cache_hit", "read_cache_miss", "write_unchanged", "write_conflict", "publish_batched", "publish_local",
+    "publish_local_dropped", "publish_dropped"};
+
+// Layout of the shared stats page. Counters may only be appended, count
+// tells the readers how many of them the writer knows.
+struct StatsPage
+{
+    uint32_t              magic;
+    uint32_t              count;
+    int32_t               pid;
+    char                  process[32];
+    std::atomic<uint64_t> counters[STAT_COUNT];
+};
+
+static std::atomic<uint64_t>        local_counters[STAT_COUNT];
+std::atomic<std::atomic<uint64_t>*> fty::shm::stats_counters{local_counters};
+
+static StatsPage* shared_page = nullptr;
+static pid_t      shared_pid  = 0;
+
+static void stats_path(char* buf, size_t len, pid_t pid)
+{
+    snprintf(buf, len, STATS_DIR "/" STATS_PREFIX "%d", int(pid));
+}
+
+static void read_comm(pid_t pid, char* buf, size_t len)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/comm", int(pid));
+    buf[0]     = '\0';
+    FILE* file = fopen(path, "r");
+    if (file == nullptr)
+        return;
+    if (fgets(buf, int(len), file) != nullptr)
+        buf[strcspn(buf, "\n")] = '\0';
+    fclose(file);
+}
+
+// Move the counters of this process to a shared page if FTY_SHM_STATS is "ON"
+static void stats_attach()
+{
+    char* valenv = getenv("FTY_SHM_STATS");
+    if (!valenv || strcmp(valenv, "ON") != 0)
+        return;
+
+    char path[PATH_MAX];
+    stats_path(path, sizeof(path), getpid());
+    int fd = open(path, O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    if (ftruncate(fd, sizeof(StatsPage)) < 0) {
+        close(fd);
+        unlink(path);
+        return;
+    }
+    void* addr = mmap(nullptr, sizeof(StatsPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        unlink(path);
+        return;
+    }
+
+    StatsPage* page = static_cast<StatsPage*>(addr);
+    page->count     = STAT_COUNT;
+    page->pid       = getpid();
+    read_comm(getpid(), page->process, sizeof(page->process));
+    // Carry over what was counted so far
+    for (int i = 0; i < STAT_COUNT; i++)
+        page->counters[i].store(local_counters[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    page->magic = STATS_MAGIC;
+
+    shared_page = page;
+    shared_pid  = getpid();
+    stats_counters.store(page->counters, std::memory_order_release);
+}
+
+// Remove the shared page of this process from the ones listed
+static void stats_unlink()
+{
+    if (shared_page == nullptr || shared_pid != getpid())
+        return;
+    char path[PATH_MAX];
+    stats_path(path, sizeof(path), shared_pid);
+    unlink(path);
+    shared_pid = 0;
+}
+
+// A forked child gets its own counters, starting from 0. The page of the
+// parent is unmapped, the child has a single thread.
+static void stats_atfork_child()
+{
+    if (shared_page != nullptr) {
+        stats_counters.store(local_counters, std::memory_order_release);
+        munmap(shared_page, sizeof(StatsPage));
+        shared_page = nullptr;
+    }
+    for (int i = 0; i < STAT_COUNT; i++)
+        local_counters[i].store(0, std::memory_order_relaxed);
+    stats_attach();
+}
+
+static struct StatsInit
+{
+    StatsInit()
+    {
+        stats_attach();
+        pthread_atfork(nullptr, nullptr, stats_atfork_child);
+    }
+    // The page stays mapped: threads still running at exit (a publisher
+    // thread left behind) may count on
+    ~StatsInit()
+    {
+        stats_unlink();
+    }
+} stats_init;
+
+static void fill_stats(ProcessStats& stats, const std::atomic<uint64_t>* counters, int count)
+{
+    stats.counters.clear();
+    for (int i = 0; i < count && i < STAT_COUNT; i++)
+        stats.counters.emplace_back(stat_names[i], counters[i].load(std::memory_order_relaxed));
+}
+
+void fty::shm::get_stats(ProcessStats& stats)
+{
+    char process[32];
+    read_comm(getpid(), process, sizeof(process));
+    stats.pid     = getpid();
+    stats.process = process;
+    fill_stats(stats, stats_counters.load(std::memory_order_acquire), STAT_COUNT);
+}
+
+int fty::shm::read_shared_stats(std::vector<ProcessStats>& result)
+{
+    DIR* dir;
+    if (!(dir = opendir(STATS_DIR)))
+        return -1;
+
+    struct dirent* de;
+    while ((de = readdir(dir))) {
+        if (strncmp(de->d_name, STATS_PREFIX, strlen(STATS_PREFIX)) != 0)
+            continue;
+        std::string path(STATS_DIR "/");
+        path.append(de->d_name);
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || size_t(st.st_size) < offsetof(StatsPage, counters)) {
+            close(fd);
+            continue;
+        }
+        void* addr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED)
+            continue;
+
+        const StatsPage* page = static_cast<const StatsPage*>(addr);
+        char             process[32];
+        read_comm(page->pid, process, sizeof(process));
+        // Skip the pages left behind by dead processes (or whose pid was reused)
+        if (page->magic == STATS_MAGIC && (kill(page->pid, 0) == 0 || errno == EPERM) &&
+            strncmp(process, page->process, sizeof(process)) == 0) {
+            size_t       avail = (size_t(st.st_size) - offsetof(StatsPage, counters)) / sizeof(uint64_t);
+            ProcessStats stats;
+            stats.pid     = page->pid;
+            stats.process = std::string(page->process, strnlen(page->process, sizeof(page->process)));
+            fill_stats(stats, page->counters, int(std::min<size_t>(page->count, avail)));
+            result.push_back(stats);
+        }
+        munmap(addr, size_t(st.st_size));
+    }
+    closedir(dir);
+    return 0;
+}
@@ -0,0 +1,71 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+// Hot path counters. They are per process and updated with relaxed atomics,
+// so that counting costs one uncontended add. If FTY_SHM_STATS is "ON", the
+// counters live in a shared memory page (/dev/shm/fty-shm-stats.<pid>) which
+// fty-shm-cli --stats can read.
+
+namespace fty::shm {
+
+// Keep in sync with stat_names in stats.cc
+enum StatId
+{
+    STAT_WRITE,
+    STAT_WRITE_ERROR,
+    STAT_READ,
+    STAT_READ_ENOENT,
+    STAT_READ_ESTALE,
+    STAT_READ_ERROR,
+    STAT_SCAN,
+    STAT_SCAN_ENTRIES,
+    STAT_PUBLISH,
+    STAT_PUBLISH_ERROR,
+    STAT_PUBLISH_SEND_ERROR,
+    STAT_STALE_REMOVED,
+    STAT_BYTES_WRITTEN,
+    STAT_BYTES_READ,
+    STAT_SYSCALLS,
+    STAT_UPDATE_LOG,
+    STAT_UPDATE_LOG_DROPPED,
+    STAT_READ_CACHE_HIT,
+    STAT_READ_CACHE_MISS,
+    STAT_WRITE_UNCHANGED,
+    STAT_WRITE_CONFLICT,
+    STAT_PUBLISH_BATCHED,
+    STAT_PUBLISH_LOCAL,
+    STAT_PUBLISH_LOCAL_DROPPED,
+    STAT_PUBLISH_DROPPED,
+    STAT_COUNT
+};
+
+// Points either to a process local array or to the shared stats page,
+// switched at startup and in a forked child
+extern std::atomic<std::atomic<uint64_t>*> stats_counters;
+
+inline void stat_add(StatId id, uint64_t n = 1)
+{
+    stats_counters.load(std::memory_order_acquire)[id].fetch_add(n, std::memory_order_relaxed);
+}
+
+} // namespace fty::shm
@@ -0,0 +1,471 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Update log: a ring of the last metric writes, in shared memory
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include "stats.h"
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <memory>
+#include <mutex>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+// The log "<family>/.updates" is a header followed by a power of two of
+// fixed size slots. A writer claims position pos with a fetch_add on head,
+// which lands in slot pos % slots, then runs a seqlock on the slot: its seq
+// is 2 * pos + 1 while the record is written, 2 * pos + 2 once it is
+// committed. Seq only grows, so a writer lapped by a newer one gives up,
+// and a reader knows from seq whether the slot still holds the position it
+// wants, has not got it yet, or was overwritten since.
+//
+// A slot left busy by a writer killed while writing is taken over two laps
+// later, a live writer of the previous lap is waited for.
+//
+// Readers sleeping in wait() register in waiters, writers only wake them
+// (a futex on wake) when there are some.
+//
+// Only the default family has a log. A log stays mapped until the store is
+// deleted, as writers may still be appending to it.
+
+#define UPDATE_LOG_MAGIC   0x46545955 // "FTYU"
+#define UPDATE_LOG_VERSION 1
+#define UPDATE_LOG_SLOTS   4096
+#define UPDATE_SLOT_SIZE   512
+#define UPDATE_HEADER_SIZE 192
+
+// Spins (each yielding the CPU) on a slot whose writer is still in it
+#define UPDATE_SPINS 64
+
+// The record was too long for the slot, value and unit are left out
+#define UPDATE_TRUNCATED 0x01
+
+using namespace fty::shm;
+
+struct UpdateRecord
+{
+    int64_t  time;
+    uint32_t ttl;
+    uint16_t metric_len;
+    uint16_t asset_len;
+    uint16_t value_len;
+    uint16_t unit_len;
+    uint32_t flags;
+    // metric, asset, value and unit, one after the other
+    char data[UPDATE_SLOT_SIZE - 32];
+};
+
+struct UpdateSlot
+{
+    std::atomic<uint64_t> seq;
+    UpdateRecord          record;
+};
+static_assert(sizeof(UpdateSlot) == UPDATE_SLOT_SIZE, "update slots have a fixed size");
+
+struct fty::shm::UpdateRing
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;
+    // Next position to claim
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint32_t> wake;
+    std::atomic<uint32_t> waiters;
+
+    UpdateSlot& slot(uint64_t pos)
+    {
+        char* slots = reinterpret_cast<char*>(this) + UPDATE_HEADER_SIZE;
+        return *reinterpret_cast<UpdateSlot*>(slots + (pos & (slot_count - 1)) * UPDATE_SLOT_SIZE);
+    }
+};
+static_assert(sizeof(UpdateRing) <= UPDATE_HEADER_SIZE, "update log header too large");
+
+static size_t ring_size(uint32_t slot_count)
+{
+    return UPDATE_HEADER_SIZE + size_t(slot_count) * UPDATE_SLOT_SIZE;
+}
+
+static long futex(std::atomic<uint32_t>* addr, int op, uint32_t val, const struct timespec* timeout)
+{
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), op, val, timeout, nullptr, 0);
+}
+
+// Map the log of dir, created if needed. Returns nullptr on error (errno is set)
+static UpdateRing* map_ring(const std::string& dir, size_t& size)
+{
+    std::string path(dir);
+    path.append("/" UPDATE_LOG_FILE);
+
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        // Set up aside, so that nobody maps a log without its header
+        std::string tmp_path(path);
+        tmp_path.append(".").append(std::to_string(getpid()));
+        fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0)
+            return nullptr;
+        fchmod(fd, 0666);
+        UpdateRing header = {};
+        header.magic      = UPDATE_LOG_MAGIC;
+        header.version    = UPDATE_LOG_VERSION;
+        header.slot_count = UPDATE_LOG_SLOTS;
+        header.slot_size  = UPDATE_SLOT_SIZE;
+        if (ftruncate(fd, off_t(ring_size(UPDATE_LOG_SLOTS))) < 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header)) ||
+            (link(tmp_path.c_str(), path.c_str()) < 0 && errno != EEXIST)) {
+            int err = errno;
+            close(fd);
+            unlink(tmp_path.c_str());
+            errno = err;
+            return nullptr;
+        }
+        // Another process may have won the race, use its log
+        close(fd);
+        unlink(tmp_path.c_str());
+        fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    }
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    UpdateRing  header;
+    if (fstat(fd, &st) < 0 || pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header))) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return nullptr;
+    }
+    if (header.magic != UPDATE_LOG_MAGIC || header.version != UPDATE_LOG_VERSION ||
+        header.slot_size != UPDATE_SLOT_SIZE || header.slot_count == 0 ||
+        (header.slot_count & (header.slot_count - 1)) != 0 || size_t(st.st_size) < ring_size(header.slot_count)) {
+        close(fd);
+        errno = EPROTO;
+        return nullptr;
+    }
+    size       = ring_size(header.slot_count);
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return nullptr;
+    return static_cast<UpdateRing*>(addr);
+}
+
+namespace {
+
+// Log of the writes of this process
+class UpdateLog
+{
+public:
+    void append(const char* dir, size_t dir_len, const char* metric, size_t m_len, const char* asset,
+        size_t a_len, const char* value, const char* unit, uint32_t ttl);
+    // Whether FTY_SHM_UPDATE_LOG is "ON", read again after a reset
+    bool enabled();
+    void reset();
+
+private:
+    // The log of a directory, nullptr if it couldn't be mapped (not tried
+    // again on each write)
+    struct Mapping
+    {
+        std::string dir;
+        UpdateRing* ring;
+        size_t      size;
+
+        bool is(const char* other, size_t len) const
+        {
+            return dir.length() == len && memcmp(dir.data(), other, len) == 0;
+        }
+    };
+
+    UpdateRing* attach(const char* dir, size_t dir_len);
+
+    std::mutex                            m_mutex;
+    std::vector<std::unique_ptr<Mapping>> m_mappings;
+    // Last one attached
+    std::atomic<Mapping*>                 m_current{nullptr};
+    std::atomic<int>                      m_enabled{-1};
+};
+
+UpdateLog update_log;
+
+bool UpdateLog::enabled()
+{
+    int enabled = m_enabled.load(std::memory_order_relaxed);
+    if (enabled < 0) {
+        const char* valenv = getenv("FTY_SHM_UPDATE_LOG");
+        enabled            = valenv && strcmp(valenv, "ON") == 0;
+        m_enabled.store(enabled, std::memory_order_relaxed);
+    }
+    return enabled;
+}
+
+UpdateRing* UpdateLog::attach(const char* dir, size_t dir_len)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Mapping*                    mapping = nullptr;
+    for (auto& known : m_mappings) {
+        if (known->is(dir, dir_len))
+            mapping = known.get();
+    }
+    if (!mapping) {
+        m_mappings.emplace_back(new Mapping{std::string(dir, dir_len), nullptr, 0});
+        mapping       = m_mappings.back().get();
+        mapping->ring = map_ring(mapping->dir, mapping->size);
+    }
+    m_current.store(mapping, std::memory_order_release);
+    return mapping->ring;
+}
+
+void UpdateLog::reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_current.store(nullptr);
+    for (auto& mapping : m_mappings) {
+        if (mapping->ring)
+            munmap(mapping->ring, mapping->size);
+    }
+    m_mappings.clear();
+    m_enabled.store(-1);
+}
+
+void UpdateLog::append(const char* dir, size_t dir_len, const char* metric, size_t m_len, const char* asset,
+    size_t a_len, const char* value, const char* unit, uint32_t ttl)
+{
+    Mapping*    mapping = m_current.load(std::memory_order_acquire);
+    UpdateRing* ring    = mapping && mapping->is(dir, dir_len) ? mapping->ring : attach(dir, dir_len);
+    if (!ring)
+        return;
+
+    uint64_t    pos  = ring->head.fetch_add(1, std::memory_order_relaxed);
+    UpdateSlot& slot = ring->slot(pos);
+    uint64_t    busy = 2 * pos + 1;
+    uint64_t    lap  = 2 * uint64_t(ring->slot_count);
+    uint64_t    seq  = slot.seq.load(std::memory_order_relaxed);
+    for (int spin = 0;; spin++) {
+        if (seq >= busy) {
+            // Lapped by a newer writer already
+            stat_add(STAT_UPDATE_LOG_DROPPED);
+            return;
+        }
+        if ((seq & 1) && seq + lap >= busy) {
+            // The writer of the previous lap is still at it
+            if (spin >= UPDATE_SPINS) {
+                stat_add(STAT_UPDATE_LOG_DROPPED);
+                return;
+            }
+            sched_yield();
+            seq = slot.seq.load(std::memory_order_relaxed);
+            continue;
+        }
+        if (slot.seq.compare_exchange_weak(seq, busy, std::memory_order_acquire, std::memory_order_relaxed))
+            break;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+
+    UpdateRecord& record = slot.record;
+    size_t        v_len  = strlen(value);
+    size_t        u_len  = strlen(unit);
+    record.time          = int64_t(time(nullptr));
+    record.ttl           = ttl;
+    record.flags         = 0;
+    if (m_len + a_len > sizeof(record.data)) {
+        // Can't be with the names of the store (NAME_MAX)
+        m_len = 0;
+        a_len = 0;
+    }
+    if (m_len + a_len + v_len + u_len > sizeof(record.data)) {
+        record.flags |= UPDATE_TRUNCATED;
+        v_len = 0;
+        u_len = 0;
+    }
+    char* p = record.data;
+    memcpy(p, metric, m_len);
+    memcpy(p += m_len, asset, a_len);
+    memcpy(p += a_len, value, v_len);
+    memcpy(p += v_len, unit, u_len);
+    record.metric_len = uint16_t(m_len);
+    record.asset_len  = uint16_t(a_len);
+    record.value_len  = uint16_t(v_len);
+    record.unit_len   = uint16_t(u_len);
+
+    // Fails if the slot was taken over meanwhile, the record is then lost
+    slot.seq.compare_exchange_strong(busy, busy + 1, std::memory_order_release, std::memory_order_relaxed);
+    stat_add(STAT_UPDATE_LOG);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (ring->waiters.load(std::memory_order_relaxed) > 0) {
+        ring->wake.fetch_add(1, std::memory_order_relaxed);
+        stat_add(STAT_SYSCALLS);
+        futex(&ring->wake, FUTEX_WAKE, INT_MAX, nullptr);
+    }
+}
+
+} // namespace
+
+void log_update(const char* filename, const char* value, const char* unit, uint32_t ttl)
+{
+    if (!update_log.enabled() || !in_default_family(filename))
+        return;
+    // filename is "<dir>/<metric>@<asset>"
+    const char* name  = strrchr(filename, '/') + 1;
+    const char* delim = strchr(name, '@');
+    if (!delim)
+        return;
+    update_log.append(filename, size_t(name - filename - 1), name, size_t(delim - name), delim + 1,
+        strlen(delim + 1), value, unit, ttl);
+}
+
+void log_update(const char* filename, fty_proto_t* metric)
+{
+    if (!update_log.enabled() || !in_default_family(filename))
+        return;
+    const char* name = strrchr(filename, '/');
+    update_log.append(filename, size_t(name - filename), fty_proto_type(metric), strlen(fty_proto_type(metric)),
+        fty_proto_name(metric), strlen(fty_proto_name(metric)), fty_proto_value(metric), fty_proto_unit(metric),
+        fty_proto_ttl(metric));
+}
+
+void reset_update_log()
+{
+    update_log.reset();
+}
+
+fty::shm::UpdateLogReader::UpdateLogReader()
+    : m_ring(nullptr)
+    , m_size(0)
+    , m_cursor(0)
+    , m_lost(0)
+{
+}
+
+fty::shm::UpdateLogReader::~UpdateLogReader()
+{
+    if (m_ring)
+        munmap(m_ring, m_size);
+}
+
+int fty::shm::UpdateLogReader::open()
+{
+    if (m_ring)
+        return 0;
+    if (!(m_ring = map_ring(family_directory(FTY_SHM_METRIC_TYPE), m_size)))
+        return -1;
+    m_cursor = m_ring->head.load(std::memory_order_acquire);
+    return 0;
+}
+
+uint64_t fty::shm::UpdateLogReader::cursor() const
+{
+    return m_cursor;
+}
+
+void fty::shm::UpdateLogReader::seek(uint64_t cursor)
+{
+    m_cursor = cursor;
+}
+
+uint64_t fty::shm::UpdateLogReader::lost() const
+{
+    return m_lost;
+}
+
+int fty::shm::UpdateLogReader::next(MetricUpdate& update)
+{
+    if (!m_ring) {
+        errno = EBADF;
+        return -1;
+    }
+    uint64_t slot_count = m_ring->slot_count;
+    int      spin       = 0;
+    while (true) {
+        uint64_t head = m_ring->head.load(std::memory_order_acquire);
+        if (m_cursor >= head)
+            return 0;
+        if (head - m_cursor > slot_count) {
+            // Overwritten before we got there
+            m_lost += head - slot_count - m_cursor;
+            m_cursor = head - slot_count;
+        }
+
+        UpdateSlot& slot      = m_ring->slot(m_cursor);
+        uint64_t    committed = 2 * m_cursor + 2;
+        uint64_t    seq       = slot.seq.load(std::memory_order_acquire);
+        if (seq < committed) {
+            // Claimed, but not written yet: wait a little for the writer,
+            // then give the update up (its writer was lapped or died)
+            if (++spin <= UPDATE_SPINS) {
+                sched_yield();
+                continue;
+            }
+        } else if (seq == committed) {
+            UpdateRecord record;
+            memcpy(&record, &slot.record, sizeof(record));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seq.load(std::memory_order_relaxed) == committed &&
+                size_t(record.metric_len) + record.asset_len + record.value_len + record.unit_len <=
+                    sizeof(record.data)) {
+                const char* p = record.data;
+                update.seq    = m_cursor;
+                update.metric.assign(p, record.metric_len);
+                update.asset.assign(p += record.metric_len, record.asset_len);
+                update.value.assign(p += record.asset_len, record.value_len);
+                update.unit.assign(p += record.value_len, record.unit_len);
+                update.ttl       = record.ttl;
+                update.time      = uint64_t(record.time);
+                update.truncated = record.flags & UPDATE_TRUNCATED;
+                m_cursor++;
+                return 1;
+            }
+        }
+        // Overwritten while we read it
+        m_lost++;
+        m_cursor++;
+        spin = 0;
+    }
+}
+
+int fty::shm::UpdateLogReader::wait(int timeout_ms)
+{
+    if (!m_ring) {
+        errno = EBADF;
+        return -1;
+    }
+    m_ring->waiters.fetch_add(1, std::memory_order_seq_cst);
+    uint32_t wake  = m_ring->wake.load(std::memory_order_seq_cst);
+    int      ready = m_cursor < m_ring->head.load(std::memory_order_seq_cst);
+    if (!ready) {
+        struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+        stat_add(STAT_SYSCALLS);
+        futex(&m_ring->wake, FUTEX_WAIT, wake, timeout_ms < 0 ? nullptr : &timeout);
+        ready = m_cursor < m_ring->head.load(std::memory_order_acquire);
+    }
+    m_ring->waiters.fetch_sub(1, std::memory_order_relaxed);
+    return ready;
+}
@@ -0,0 +1,124 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+// A metric is complete when its writer closes it, or when it is renamed in
+// place. An unchanged metric written again only gets a new mtime (IN_ATTRIB).
+// Removal covers the cleanup of outdated metrics.
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB | IN_DELETE | IN_MOVED_FROM)
+
+fty::shm::Watcher::Watcher()
+    : m_fd(-1)
+{
+}
+
+fty::shm::Watcher::~Watcher()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+int fty::shm::Watcher::open()
+{
+    if (m_fd >= 0)
+        return 0;
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd < 0)
+        return -1;
+    if (inotify_add_watch(m_fd, family_directory(FTY_SHM_METRIC_TYPE).c_str(), WATCH_MASK) < 0) {
+        int err = errno;
+        close(m_fd);
+        m_fd  = -1;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int fty::shm::Watcher::fd() const
+{
+    return m_fd;
+}
+
+int fty::shm::Watcher::dispatch(const Callback& callback)
+{
+    // Enough for a batch of events, aligned as struct inotify_event
+    alignas(struct inotify_event) char buf[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+    int count = 0;
+
+    if (m_fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    while (true) {
+        ssize_t len = read(m_fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EAGAIN)
+                break;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (char* p = buf; p < buf + len;) {
+            struct inotify_event* event = reinterpret_cast<struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            // Events were lost, the caller has to read the store again
+            if (event->mask & IN_Q_OVERFLOW) {
+                callback(std::string(), std::string(), false);
+                count++;
+                continue;
+            }
+            // Skip the temporary files and everything which is not a metric
+            if (event->len == 0 || event->name[0] == '.')
+                continue;
+            const char* delim = strchr(event->name, '@');
+            if (!delim)
+                continue;
+            std::string filename(family_directory(FTY_SHM_METRIC_TYPE));
+            filename.append("/").append(event->name);
+            bool removed = (event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0;
+            // The conditional writes swap the files (RENAME_EXCHANGE): the
+            // metric moved away was replaced in the same rename
+            if ((event->mask & IN_MOVED_FROM) && access(filename.c_str(), F_OK) == 0)
+                removed = false;
+            if (delim == event->name && !removed) {
+                // A bundle stands for all the metrics it holds
+                BundleReader reader;
+                if (reader.open(filename.c_str()) < 0)
+                    continue;
+                while (reader.next()) {
+                    callback(std::string(delim + 1), std::string(reader.metric()), false);
+                    count++;
+                }
+                continue;
+            }
+            callback(std::string(delim + 1), std::string(event->name, size_t(delim - event->name)), removed);
+            count++;
+        }
+    }
+    return count;
+}
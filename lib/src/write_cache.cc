@@ -0,0 +1,128 @@
+/*  =========================================================================
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/// Last content written by this process, to skip the unchanged writes
+
+#include "fty_shm_internal.h"
+#include "stats.h"
+#include <atomic>
+#include <fcntl.h>
+#include <mutex>
+#include <string.h>
+#include <string_view>
+#include <unordered_map>
+
+// The cache keeps, per metric file, a hash of the content this process wrote
+// last and the inode and mtime of the file it made. A write of the same
+// content to a file still carrying them is done by moving the mtime forward
+// (stat and utimensat): the file is not rewritten, readers see no change but
+// its age. If another process wrote the file since, its inode or its mtime
+// differ and the write is done as usual.
+
+#define WRITE_CACHE_MAX_ENTRIES 65536
+
+using namespace fty::shm;
+
+namespace {
+
+struct LastWrite
+{
+    size_t          hash;
+    size_t          size;
+    ino_t           ino;
+    struct timespec mtime;
+};
+
+std::mutex                                 write_cache_mutex;
+std::unordered_map<std::string, LastWrite> write_cache;
+
+// FTY_SHM_SKIP_UNCHANGED, read again after a reset
+std::atomic<int> write_cache_state{-1};
+
+bool same_time(const struct timespec& a, const struct timespec& b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+} // namespace
+
+bool write_cache_enabled()
+{
+    int state = write_cache_state.load(std::memory_order_relaxed);
+    if (state < 0) {
+        const char* valenv = getenv("FTY_SHM_SKIP_UNCHANGED");
+        state              = (valenv && strcmp(valenv, "OFF") == 0) ? 0 : 1;
+        write_cache_state.store(state, std::memory_order_relaxed);
+    }
+    return state != 0;
+}
+
+bool refresh_unchanged(const char* filename, const std::string& data)
+{
+    LastWrite last;
+    {
+        std::lock_guard<std::mutex> lock(write_cache_mutex);
+        auto                        it = write_cache.find(filename);
+        if (it == write_cache.end())
+            return false;
+        last = it->second;
+    }
+    if (last.size != data.size() || last.hash != std::hash<std::string_view>()(data))
+        return false;
+
+    struct stat st;
+    stat_add(STAT_SYSCALLS);
+    if (stat(filename, &st) < 0 || st.st_ino != last.ino || size_t(st.st_size) != last.size ||
+        !same_time(st.st_mtim, last.mtime))
+        return false;
+
+    // The new mtime is set explicitly, to be known without another stat. The
+    // atime goes with it: the kernel notifies a change of both times as
+    // IN_ATTRIB (of the mtime alone as IN_MODIFY, like an in place write)
+    struct timespec times[2];
+    clock_gettime(CLOCK_REALTIME, &times[1]);
+    times[0] = times[1];
+    stat_add(STAT_SYSCALLS);
+    if (utimensat(AT_FDCWD, filename, times, 0) < 0)
+        return false;
+
+    std::lock_guard<std::mutex> lock(write_cache_mutex);
+    auto                        it = write_cache.find(filename);
+    if (it != write_cache.end() && it->second.ino == last.ino)
+        it->second.mtime = times[1];
+    return true;
+}
+
+void remember_write(const char* filename, const std::string& data, const struct stat& st)
+{
+    LastWrite last = {std::hash<std::string_view>()(data), data.size(), st.st_ino, st.st_mtim};
+
+    std::lock_guard<std::mutex> lock(write_cache_mutex);
+    // Writers have a steady set of metrics, a full cache is simply started over
+    if (write_cache.size() >= WRITE_CACHE_MAX_ENTRIES)
+        write_cache.clear();
+    write_cache[filename] = last;
+}
+
+void reset_write_cache()
+{
+    std::lock_guard<std::mutex> lock(write_cache_mutex);
+    write_cache.clear();
+    write_cache_state.store(-1);
+}
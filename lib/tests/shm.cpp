@@ -1,6 +1,19 @@
 #include <catch2/catch.hpp>
 #include <fty_proto.h>
 #include "public_include/fty_shm.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <map>
+#include <poll.h>
+#include <regex>
+#include <set>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
 
 // Version of assert() that prints the errno value for easier debugging
 #define check_err(expr)                                                                                                \
@@ -197,7 +210,9 @@ TEST_CASE("shm test")
     dir_metric.append("/").append(FTY_SHM_METRIC_TYPE);
     if ((dir = opendir(dir_metric.c_str())) != nullptr) {
         while ((ent = readdir(dir)) != nullptr) {
-            dir_number++;
+            // not counting the aux keys dictionary
+            if (strcmp(ent->d_name, ".auxkeys") != 0)
+                dir_number++;
         }
         closedir(dir);
     } else {
@@ -222,7 +237,9 @@ TEST_CASE("shm test")
     dir_number = 0;
     if ((dir = opendir(dir_metric.c_str())) != nullptr) {
         while ((ent = readdir(dir)) != nullptr) {
-            dir_number++;
+            // not counting the aux keys dictionary
+            if (strcmp(ent->d_name, ".auxkeys") != 0)
+                dir_number++;
         }
         closedir(dir);
     } else {
@@ -235,3 +252,1441 @@ TEST_CASE("shm test")
     CHECK(dir_number == 3);
     fty_shm_delete_test_dir();
 }
+
+static uint64_t stat_value(const fty::shm::ProcessStats& stats, const std::string& name)
+{
+    for (auto& counter : stats.counters) {
+        if (counter.first == name)
+            return counter.second;
+    }
+    return 0;
+}
+
+TEST_CASE("shm stats")
+{
+    std::string            value;
+    fty::shm::ProcessStats before, after;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    fty::shm::get_stats(before);
+    REQUIRE(fty::shm::write_metric("asset", "metric", "here_is_my_value", "unit?", 5) == 0);
+    REQUIRE(fty::shm::read_metric_value("asset", "metric", value) == 0);
+    REQUIRE(fty::shm::read_metric_value("asset", "nometric", value) < 0);
+    fty::shm::get_stats(after);
+
+    CHECK(after.pid == getpid());
+    CHECK(stat_value(after, "write") == stat_value(before, "write") + 1);
+    CHECK(stat_value(after, "read") == stat_value(before, "read") + 1);
+    CHECK(stat_value(after, "read_enoent") == stat_value(before, "read_enoent") + 1);
+    CHECK(stat_value(after, "bytes_written") > stat_value(before, "bytes_written"));
+    CHECK(stat_value(after, "syscalls") > stat_value(before, "syscalls"));
+
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm list names")
+{
+    std::vector<std::string> names;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    REQUIRE(fty::shm::write_metric("asset", "metric", "here_is_my_value", "unit?", 2) == 0);
+    REQUIRE(fty::shm::write_metric("asset", "metric2", "here_is_my_value", "unit?", 20) == 0);
+    REQUIRE(fty::shm::write_metric("asset2", "metric", "here_is_my_value", "unit?", 2) == 0);
+
+    REQUIRE(fty::shm::list_assets(names) == 0);
+    CHECK(names == std::vector<std::string>{"asset", "asset2"});
+    REQUIRE(fty::shm::list_metrics("asset", names) == 0);
+    CHECK(names == std::vector<std::string>{"metric", "metric2"});
+    REQUIRE(fty::shm::list_metrics("none", names) == 0);
+    CHECK(names.empty());
+
+    // wait the expiration of the metrics with a ttl of 2s
+    zclock_sleep(3000);
+    REQUIRE(fty::shm::list_assets(names) == 0);
+    CHECK(names.size() == 2);
+    REQUIRE(fty::shm::list_assets(names, true) == 0);
+    CHECK(names == std::vector<std::string>{"asset"});
+    REQUIRE(fty::shm::list_metrics("asset", names, true) == 0);
+    CHECK(names == std::vector<std::string>{"metric2"});
+
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm snapshot")
+{
+    std::string  value;
+    fty_proto_t* proto_metric;
+    std::string  snapshot(SELFTEST_RW "/snapshot");
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    REQUIRE(fty::shm::write_metric("asset", "metric", "here_is_my_value", "unit?", 2) == 0);
+    REQUIRE(fty::shm::write_metric("asset", "metric2", "here_is_my_value_2", "unit?", 0) == 0);
+    REQUIRE(fty::shm::read_metric("asset", "metric2", &proto_metric) == 0);
+    fty_proto_aux_insert(proto_metric, "myaux", "%s", "value_aux");
+    REQUIRE(fty::shm::write_metric(proto_metric) == 0);
+    fty_proto_destroy(&proto_metric);
+
+    REQUIRE(fty::shm::save_snapshot(snapshot) == 2);
+    fty_shm_delete_test_dir();
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    REQUIRE(fty::shm::restore_snapshot(snapshot) == 2);
+    REQUIRE(fty::shm::read_metric("asset", "metric2", &proto_metric) == 0);
+    CHECK(streq(fty_proto_value(proto_metric), "here_is_my_value_2"));
+    CHECK(streq(fty_proto_aux_string(proto_metric, "myaux", "none"), "value_aux"));
+    fty_proto_destroy(&proto_metric);
+
+    // the restored metrics keep their timestamp and expire on their own
+    zclock_sleep(3000);
+    CHECK(fty::shm::read_metric_value("asset", "metric", value) < 0);
+    CHECK(fty::shm::read_metric_value("asset", "metric2", value) == 0);
+    // outdated metrics are not restored
+    fty_shm_delete_test_dir();
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    REQUIRE(fty::shm::restore_snapshot(snapshot) == 1);
+
+    // The records of a family which is not a directory of the store are
+    // skipped
+    FILE* file = fopen(snapshot.c_str(), "w");
+    REQUIRE(file);
+    fwrite("FTYSHMS1", 1, 8, file);
+    auto put_str = [file](const std::string& str) {
+        uint32_t len = uint32_t(str.length());
+        fwrite(&len, sizeof(len), 1, file);
+        fwrite(str.data(), 1, len, file);
+    };
+    for (const std::string& family : {std::string(20000, 'x'), std::string("../.."), std::string(".hidden"),
+             std::string(FTY_SHM_METRIC_TYPE)}) {
+        uint64_t timestamp = uint64_t(time(nullptr));
+        uint32_t ttl = 0, aux_count = 0;
+        fwrite(&timestamp, sizeof(timestamp), 1, file);
+        fwrite(&ttl, sizeof(ttl), 1, file);
+        put_str(family);
+        put_str("crafted");
+        put_str("metric");
+        put_str("1");
+        put_str("");
+        fwrite(&aux_count, sizeof(aux_count), 1, file);
+    }
+    fclose(file);
+    fty_shm_delete_test_dir();
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    CHECK(fty::shm::restore_snapshot(snapshot) == 1);
+    CHECK(fty::shm::read_metric_value("crafted", "metric", value) == 0);
+    CHECK(access(SELFTEST_RW "/../../metric@crafted", F_OK) < 0);
+
+    remove(snapshot.c_str());
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm streaming read")
+{
+    std::set<std::string> seen;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    REQUIRE(fty::shm::write_metric("asset", "metric", "1", "unit?", 0) == 0);
+    REQUIRE(fty::shm::write_metric("asset", "metric2", "2", "unit?", 0) == 0);
+    REQUIRE(fty::shm::write_metric("asset2", "metric", "3", "unit?", 0) == 0);
+
+    REQUIRE(fty::shm::read_metrics("asset", ".*", [&seen](fty_proto_t* metric) {
+        seen.insert(fty_proto_type(metric));
+        return true;
+    }) == 0);
+    CHECK(seen == std::set<std::string>{"metric", "metric2"});
+
+    // the visitor stops the scan by returning false
+    int count = 0;
+    REQUIRE(fty::shm::read_metrics(".*", ".*", [&count](fty_proto_t*) {
+        count++;
+        return false;
+    }) == 0);
+    CHECK(count == 1);
+
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm bundle")
+{
+    std::vector<fty_proto_t*> batch;
+    std::vector<std::string>  names;
+    std::string               value;
+    fty_proto_t*              proto_metric;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    for (int i = 0; i < 3; i++) {
+        fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+        fty_proto_set_name(metric, "%s", "asset");
+        fty_proto_set_type(metric, "metric%d", i);
+        fty_proto_set_value(metric, "%d", i);
+        fty_proto_set_unit(metric, "%s", "unit?");
+        fty_proto_set_ttl(metric, i == 2 ? 2 : 0);
+        batch.push_back(metric);
+    }
+    fty_proto_aux_insert(batch[0], "myaux", "%s", "value_aux");
+    REQUIRE(fty::shm::write_metrics(batch, true) == 0);
+
+    // single metric reads are served from the bundle
+    REQUIRE(fty::shm::read_metric_value("asset", "metric1", value) == 0);
+    CHECK(value == "1");
+    REQUIRE(fty::shm::read_metric("asset", "metric0", &proto_metric) == 0);
+    CHECK(streq(fty_proto_aux_string(proto_metric, "myaux", "none"), "value_aux"));
+    fty_proto_destroy(&proto_metric);
+    CHECK(fty::shm::read_metric_value("asset", "none", value) < 0);
+    CHECK(errno == ENOENT);
+
+    {
+        fty::shm::shmMetrics result;
+        REQUIRE(fty::shm::read_metrics("asset", "metric[12]", result) == 0);
+        CHECK(result.size() == 2);
+    }
+    REQUIRE(fty::shm::list_assets(names) == 0);
+    CHECK(names == std::vector<std::string>{"asset"});
+    REQUIRE(fty::shm::list_metrics("asset", names) == 0);
+    CHECK(names == std::vector<std::string>{"metric0", "metric1", "metric2"});
+
+    // records expire one by one
+    zclock_sleep(3000);
+    CHECK(fty::shm::read_metric_value("asset", "metric2", value) < 0);
+    CHECK(errno == ESTALE);
+    REQUIRE(fty::shm::list_metrics("asset", names, true) == 0);
+    CHECK(names == std::vector<std::string>{"metric0", "metric1"});
+
+    // a new bundle replaces the previous one
+    fty_proto_destroy(&batch[2]);
+    batch.pop_back();
+    fty_proto_set_value(batch[1], "%s", "new");
+    REQUIRE(fty::shm::write_metrics(batch, true) == 0);
+    REQUIRE(fty::shm::read_metric_value("asset", "metric1", value) == 0);
+    CHECK(value == "new");
+    {
+        fty::shm::shmMetrics result;
+        REQUIRE(fty::shm::read_metrics(".*", ".*", result) == 0);
+        CHECK(result.size() == 2);
+    }
+
+    // The policy of the family applies to the bundles
+    auto                   bus = std::make_shared<fty::shm::MockPublishBus>(false);
+    fty::shm::FamilyPolicy policy;
+    policy.max_ttl = 100;
+    policy.publish = false;
+    fty::shm::set_publish_bus(bus);
+    REQUIRE(fty::shm::set_family_policy(FTY_SHM_METRIC_TYPE, policy) == 0);
+    REQUIRE(fty::shm::write_metrics(batch, true) == 0);
+    REQUIRE(fty::shm::flush(1000) == 0);
+    CHECK(bus->count() == 0);
+    REQUIRE(fty::shm::read_metric("asset", "metric1", &proto_metric) == 0);
+    CHECK(fty_proto_ttl(proto_metric) == 100);
+    fty_proto_destroy(&proto_metric);
+    fty::shm::set_publish_bus(nullptr);
+
+    for (auto& metric : batch)
+        fty_proto_destroy(&metric);
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm compact aux")
+{
+    fty_proto_t* proto_metric;
+    std::string  long_value(300, 'x');
+    std::string  family_dir(SELFTEST_RW "/" FTY_SHM_METRIC_TYPE);
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    proto_metric = fty_proto_new(FTY_PROTO_METRIC);
+    fty_proto_set_name(proto_metric, "%s", "asset");
+    fty_proto_set_type(proto_metric, "%s", "metric");
+    fty_proto_set_value(proto_metric, "%s", "1");
+    fty_proto_set_unit(proto_metric, "%s", "unit?");
+    fty_proto_aux_insert(proto_metric, "port", "%s", "0");
+    fty_proto_aux_insert(proto_metric, "long", "%s", long_value.c_str());
+
+    // text aux by default, for the older readers
+    REQUIRE(fty::shm::write_metric(proto_metric) == 0);
+    FILE* file = fopen((family_dir + "/metric@asset").c_str(), "r");
+    REQUIRE(file);
+    char text[512] = "";
+    CHECK(fread(text, 1, sizeof(text) - 1, file) > 0);
+    fclose(file);
+    CHECK(strstr(text, "\nport\n0") != nullptr);
+    CHECK(access((family_dir + "/.auxkeys").c_str(), F_OK) < 0);
+
+    setenv("FTY_SHM_COMPACT_AUX", "ON", 1);
+    fty_shm_delete_test_dir();
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    REQUIRE(fty::shm::write_metric(proto_metric) == 0);
+    fty_proto_destroy(&proto_metric);
+
+    // no truncation of the long values
+    REQUIRE(fty::shm::read_metric("asset", "metric", &proto_metric) == 0);
+    CHECK(streq(fty_proto_aux_string(proto_metric, "port", "none"), "0"));
+    CHECK(fty_proto_aux_string(proto_metric, "long", "none") == long_value);
+    fty_proto_destroy(&proto_metric);
+
+    // the keys are interned once
+    file = fopen((family_dir + "/.auxkeys").c_str(), "r");
+    REQUIRE(file);
+    char buf[64] = "";
+    CHECK(fread(buf, 1, sizeof(buf) - 1, file) == strlen("port\nlong\n"));
+    fclose(file);
+
+    // metric files with text aux are still readable
+    file = fopen((family_dir + "/metric2@asset").c_str(), "w");
+    REQUIRE(file);
+    fputs("0000000000\nunit?\n2\nkey\nvalue\nkey2\nvalue2", file);
+    fclose(file);
+    REQUIRE(fty::shm::read_metric("asset", "metric2", &proto_metric) == 0);
+    CHECK(streq(fty_proto_value(proto_metric), "2"));
+    CHECK(streq(fty_proto_aux_string(proto_metric, "key2", "none"), "value2"));
+    fty_proto_destroy(&proto_metric);
+
+    // each family has its dictionary, the ones in use stay cached
+    fty::shm::FamilyPolicy policy;
+    REQUIRE(fty::shm::set_family_policy("alpha", policy) == 0);
+    REQUIRE(fty::shm::set_family_policy("beta", policy) == 0);
+    fty::shm::Family alpha("alpha"), beta("beta");
+    proto_metric = fty_proto_new(FTY_PROTO_METRIC);
+    fty_proto_set_name(proto_metric, "%s", "asset");
+    fty_proto_set_type(proto_metric, "%s", "metric");
+    fty_proto_set_unit(proto_metric, "%s", "unit?");
+    fty_proto_aux_insert(proto_metric, "port", "%s", "1");
+    int                    round = 0;
+    fty::shm::ProcessStats before, middle, after;
+    auto                   write = [&](fty::shm::Family& family) {
+        fty_proto_set_value(proto_metric, "%d", round++);
+        REQUIRE(family.write_metric(proto_metric) == 0);
+    };
+    write(alpha);
+    write(beta);
+    fty::shm::get_stats(before);
+    write(beta);
+    write(beta);
+    fty::shm::get_stats(middle);
+    write(alpha);
+    write(beta);
+    fty::shm::get_stats(after);
+    CHECK(stat_value(after, "syscalls") - stat_value(middle, "syscalls") ==
+          stat_value(middle, "syscalls") - stat_value(before, "syscalls"));
+    fty_proto_destroy(&proto_metric);
+    REQUIRE(beta.read_metric("asset", "metric", &proto_metric) == 0);
+    CHECK(streq(fty_proto_aux_string(proto_metric, "port", "none"), "1"));
+    fty_proto_destroy(&proto_metric);
+
+    unsetenv("FTY_SHM_COMPACT_AUX");
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm proto pool")
+{
+    fty::shm::ProtoPool pool;
+    fty_proto_t*        proto_metric;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    REQUIRE(fty::shm::write_metric("asset", "metric", "1", "unit?", 0) == 0);
+    REQUIRE(fty::shm::write_metric("asset", "metric2", "2", "unit?", 0) == 0);
+    REQUIRE(fty::shm::write_metric("asset2", "metric", "3", "unit?", 0) == 0);
+    REQUIRE(fty::shm::read_metric("asset", "metric", &proto_metric) == 0);
+    fty_proto_aux_insert(proto_metric, "myaux", "%s", "value_aux");
+    REQUIRE(fty::shm::write_metric(proto_metric) == 0);
+    fty_proto_destroy(&proto_metric);
+
+    {
+        fty::shm::PooledMetrics result(pool);
+        REQUIRE(fty::shm::read_metrics(".*", ".*", result) == 0);
+        CHECK(result.size() == 3);
+        CHECK(pool.size() == 0);
+    }
+    CHECK(pool.size() == 3);
+
+    // the recycled metrics do not keep their previous aux
+    {
+        fty::shm::PooledMetrics result(pool);
+        REQUIRE(fty::shm::read_metrics(".*", ".*", result) == 0);
+        CHECK(result.size() == 3);
+        for (auto& metric : result) {
+            zhash_t* aux = fty_proto_aux(metric);
+            bool     has_aux = streq(fty_proto_name(metric), "asset") && streq(fty_proto_type(metric), "metric");
+            CHECK((aux ? zhash_size(aux) : 0) == (has_aux ? 1 : 0));
+        }
+    }
+    CHECK(pool.size() == 3);
+
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm parallel read")
+{
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    // enough entries for several workers
+    for (int i = 0; i < 2000; i++) {
+        std::string n = std::to_string(i);
+        REQUIRE(fty::shm::write_metric("asset" + std::to_string(i % 10), "metric" + n, n, "unit?", i % 3 ? 0 : 1) == 0);
+    }
+    std::vector<fty_proto_t*> batch;
+    for (int i = 0; i < 3; i++) {
+        fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+        fty_proto_set_name(metric, "%s", "bundled");
+        fty_proto_set_type(metric, "metric%d", i);
+        fty_proto_set_value(metric, "%d", i);
+        fty_proto_set_unit(metric, "%s", "unit?");
+        batch.push_back(metric);
+    }
+    REQUIRE(fty::shm::write_metrics(batch, true) == 0);
+    for (auto& metric : batch)
+        fty_proto_destroy(&metric);
+    // some of them outdated
+    zclock_sleep(2100);
+
+    for (const char* asset : {".*", "asset1", "bundled"}) {
+        fty::shm::shmMetrics serial, parallel;
+        REQUIRE(fty::shm::read_metrics(asset, ".*", serial) == 0);
+        REQUIRE(fty::shm::read_metrics(asset, ".*", parallel, 4) == 0);
+        REQUIRE(serial.size() == parallel.size());
+        int mismatches = 0;
+        for (int i = 0; i < int(serial.size()); i++) {
+            if (!streq(fty_proto_name(serial.get(i)), fty_proto_name(parallel.get(i))) ||
+                !streq(fty_proto_type(serial.get(i)), fty_proto_type(parallel.get(i))) ||
+                !streq(fty_proto_value(serial.get(i)), fty_proto_value(parallel.get(i))))
+                mismatches++;
+        }
+        CHECK(mismatches == 0);
+    }
+    {
+        fty::shm::shmMetrics result;
+        CHECK(fty::shm::read_metrics("(", ".*", result, 4) < 0);
+    }
+
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm async reader")
+{
+    fty::shm::AsyncReader reader;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    for (int i = 0; i < 100; i++) {
+        std::string n = std::to_string(i);
+        REQUIRE(fty::shm::write_metric("asset" + std::to_string(i % 2), "metric" + n, n, "unit?", 0) == 0);
+    }
+    std::vector<fty_proto_t*> batch(1, fty_proto_new(FTY_PROTO_METRIC));
+    fty_proto_set_name(batch[0], "%s", "bundled");
+    fty_proto_set_type(batch[0], "%s", "metric");
+    fty_proto_set_value(batch[0], "%s", "42");
+    fty_proto_set_unit(batch[0], "%s", "unit?");
+    REQUIRE(fty::shm::write_metrics(batch, true) == 0);
+    fty_proto_destroy(&batch[0]);
+
+    REQUIRE(reader.open(16) == 0);
+    REQUIRE(reader.fd() >= 0);
+
+    std::vector<std::string> scan, async_scan;
+    {
+        fty::shm::shmMetrics result;
+        REQUIRE(fty::shm::read_metrics(".*", ".*", result) == 0);
+        for (auto& metric : result)
+            scan.push_back(std::string(fty_proto_name(metric)) + fty_proto_type(metric) + fty_proto_value(metric));
+    }
+    std::sort(scan.begin(), scan.end());
+
+    size_t key_count = 0;
+    REQUIRE(reader.read_metrics(".*", ".*", [&async_scan](fty::shm::shmMetrics& result) {
+        for (auto& metric : result)
+            async_scan.push_back(
+                std::string(fty_proto_name(metric)) + fty_proto_type(metric) + fty_proto_value(metric));
+    }) == 0);
+    REQUIRE(reader.read_metrics({{"asset1", "metric1"}, {"asset1", "none"}, {"bundled", "metric"}},
+                [&key_count](fty::shm::shmMetrics& result) {
+                    key_count = result.size();
+                }) == 0);
+
+    // as an event loop would
+    int done = 0;
+    while (done < 2) {
+        struct pollfd pfd = {reader.fd(), POLLIN, 0};
+        REQUIRE(poll(&pfd, 1, 5000) == 1);
+        int r = reader.dispatch();
+        REQUIRE(r >= 0);
+        done += r;
+    }
+    std::sort(async_scan.begin(), async_scan.end());
+    CHECK(async_scan == scan);
+    CHECK(key_count == 2);
+
+    // wait() is the blocking version
+    key_count = 0;
+    REQUIRE(reader.read_metrics({{"asset0", "metric0"}}, [&key_count](fty::shm::shmMetrics& result) {
+        key_count = result.size();
+    }) == 0);
+    CHECK(reader.wait() == 1);
+    CHECK(key_count == 1);
+
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm update log")
+{
+    fty::shm::UpdateLogReader reader;
+    fty::shm::MetricUpdate    update;
+
+    setenv("FTY_SHM_UPDATE_LOG", "ON", 1);
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    REQUIRE(reader.open() == 0);
+    CHECK(reader.next(update) == 0);
+    CHECK(reader.wait(0) == 0);
+
+    REQUIRE(fty::shm::write_metric("asset", "metric", "42", "W", 10) == 0);
+    fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+    fty_proto_set_name(metric, "%s", "asset");
+    fty_proto_set_type(metric, "%s", "proto");
+    fty_proto_set_value(metric, "%s", "43");
+    fty_proto_set_unit(metric, "%s", "V");
+    fty_proto_set_ttl(metric, 20);
+    REQUIRE(fty::shm::write_metric(metric) == 0);
+    fty_proto_set_name(metric, "%s", "bundled");
+    REQUIRE(fty::shm::write_metrics({metric}, true) == 0);
+    fty_proto_set_value(metric, "%s", std::string(1000, 'x').c_str());
+    REQUIRE(fty::shm::write_metric(metric) == 0);
+    fty_proto_destroy(&metric);
+
+    CHECK(reader.wait(0) == 1);
+    uint64_t first = reader.cursor();
+    REQUIRE(reader.next(update) == 1);
+    CHECK(update.seq == first);
+    CHECK(update.asset == "asset");
+    CHECK(update.metric == "metric");
+    CHECK(update.value == "42");
+    CHECK(update.unit == "W");
+    CHECK(update.ttl == 10);
+    CHECK(update.time > 0);
+    CHECK(!update.truncated);
+    REQUIRE(reader.next(update) == 1);
+    CHECK(update.metric == "proto");
+    CHECK(update.value == "43");
+    CHECK(update.ttl == 20);
+    REQUIRE(reader.next(update) == 1);
+    CHECK(update.asset == "bundled");
+    CHECK(update.value == "43");
+    REQUIRE(reader.next(update) == 1);
+    CHECK(update.truncated);
+    CHECK(update.value.empty());
+    CHECK(reader.next(update) == 0);
+    CHECK(reader.lost() == 0);
+
+    // A second reader starts at the end, the first one falls behind
+    fty::shm::UpdateLogReader other;
+    REQUIRE(other.open() == 0);
+    CHECK(other.cursor() == first + 4);
+    for (int i = 0; i < 5000; i++)
+        REQUIRE(fty::shm::write_metric("asset", "metric", std::to_string(i), "W", 10) == 0);
+    REQUIRE(reader.next(update) == 1);
+    CHECK(reader.lost() > 0);
+    CHECK(reader.lost() + 1 < 5000);
+    int count = 1;
+    while (reader.next(update) == 1)
+        count++;
+    CHECK(update.value == "4999");
+    CHECK(reader.lost() + count == 5000);
+
+    other.seek(first);
+    REQUIRE(other.next(update) == 1);
+    CHECK(other.lost() > 4);
+
+    fty_shm_delete_test_dir();
+    unsetenv("FTY_SHM_UPDATE_LOG");
+}
+
+TEST_CASE("shm read cache")
+{
+    fty::shm::ProcessStats before, after;
+    std::string            value;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    for (bool notify : {false, true}) {
+        fty::shm::set_read_cache(1 << 20, notify);
+
+        fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+        fty_proto_set_name(metric, "%s", "asset");
+        fty_proto_set_type(metric, "%s", "metric");
+        fty_proto_set_value(metric, "%s", "42");
+        fty_proto_set_unit(metric, "%s", "W");
+        fty_proto_set_ttl(metric, 1);
+        fty_proto_aux_insert(metric, "key", "%s", "value");
+        REQUIRE(fty::shm::write_metric(metric) == 0);
+        // Old enough for its times to tell a rewrite
+        zclock_sleep(50);
+
+        fty_proto_t* read = nullptr;
+        REQUIRE(fty::shm::read_metric("asset", "metric", &read) == 0);
+        fty_proto_destroy(&read);
+        fty::shm::get_stats(before);
+        REQUIRE(fty::shm::read_metric("asset", "metric", &read) == 0);
+        REQUIRE(fty::shm::read_metric_value("asset", "metric", value) == 0);
+        fty::shm::get_stats(after);
+        CHECK(streq(fty_proto_value(read), "42"));
+        CHECK(streq(fty_proto_unit(read), "W"));
+        CHECK(fty_proto_ttl(read) == 1);
+        CHECK(streq(fty_proto_aux_string(read, "key", ""), "value"));
+        CHECK(value == "42");
+        CHECK(stat_value(after, "read_cache_hit") == stat_value(before, "read_cache_hit") + 2);
+        CHECK(stat_value(after, "read") == stat_value(before, "read") + 2);
+        fty_proto_destroy(&read);
+
+        // Rewritten with the same size: not served from the cache
+        fty_proto_set_value(metric, "%s", "43");
+        REQUIRE(fty::shm::write_metric(metric) == 0);
+        REQUIRE(fty::shm::read_metric_value("asset", "metric", value) == 0);
+        CHECK(value == "43");
+        REQUIRE(fty::shm::read_metric("asset", "metric", &read) == 0);
+        CHECK(streq(fty_proto_value(read), "43"));
+        fty_proto_destroy(&read);
+        fty_proto_destroy(&metric);
+
+        // Outdated as without the cache
+        zclock_sleep(2100);
+        CHECK(fty::shm::read_metric("asset", "metric", &read) < 0);
+        CHECK(fty::shm::read_metric_value("asset", "metric", value) < 0);
+    }
+
+    // A small budget keeps the last metrics read
+    fty::shm::set_read_cache(1024);
+    for (int i = 0; i < 20; i++)
+        REQUIRE(fty::shm::write_metric("asset", "metric" + std::to_string(i), std::to_string(i), "W", 0) == 0);
+    zclock_sleep(50);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < 20; i++) {
+            REQUIRE(fty::shm::read_metric_value("asset", "metric" + std::to_string(i), value) == 0);
+            CHECK(value == std::to_string(i));
+        }
+    }
+    fty::shm::get_stats(before);
+    REQUIRE(fty::shm::read_metric_value("asset", "metric19", value) == 0);
+    REQUIRE(fty::shm::read_metric_value("asset", "metric0", value) == 0);
+    fty::shm::get_stats(after);
+    CHECK(stat_value(after, "read_cache_hit") == stat_value(before, "read_cache_hit") + 1);
+
+    fty::shm::set_read_cache(0);
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm metric history")
+{
+    std::vector<fty::shm::MetricSample> samples;
+
+    setenv("FTY_SHM_HISTORY", "5", 1);
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    for (int i = 0; i < 4; i++)
+        REQUIRE(fty::shm::write_metric("asset", "metric", std::to_string(i), "W", 10) == 0);
+    REQUIRE(fty::shm::read_metric_history("asset", "metric", 0, samples) == 0);
+    REQUIRE(samples.size() == 4);
+    CHECK(samples[0].value == 0);
+    CHECK(samples[3].value == 3);
+    CHECK(samples[3].time >= samples[0].time);
+
+    // The ring keeps the last ones, whatever the write API
+    fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+    fty_proto_set_name(metric, "%s", "asset");
+    fty_proto_set_type(metric, "%s", "metric");
+    fty_proto_set_unit(metric, "%s", "W");
+    fty_proto_set_ttl(metric, 10);
+    for (int i = 4; i < 8; i++) {
+        fty_proto_set_value(metric, "%d.5", i);
+        REQUIRE(fty::shm::write_metric(metric) == 0);
+    }
+    fty_proto_set_value(metric, "%s", "not a number");
+    REQUIRE(fty::shm::write_metric(metric) == 0);
+    fty_proto_set_name(metric, "%s", "bundled");
+    fty_proto_set_value(metric, "%s", "1e3");
+    REQUIRE(fty::shm::write_metrics({metric}, true) == 0);
+    fty_proto_destroy(&metric);
+
+    REQUIRE(fty::shm::read_metric_history("asset", "metric", 0, samples) == 0);
+    REQUIRE(samples.size() == 5);
+    CHECK(samples[0].value == 3);
+    CHECK(samples[1].value == 4.5);
+    CHECK(samples[4].value == 7.5);
+    REQUIRE(fty::shm::read_metric_history("asset", "metric", samples[4].time + 1, samples) == 0);
+    CHECK(samples.empty());
+    REQUIRE(fty::shm::read_metric_history("bundled", "metric", 0, samples) == 0);
+    REQUIRE(samples.size() == 1);
+    CHECK(samples[0].value == 1000);
+
+    CHECK(fty::shm::read_metric_history("asset", "nometric", 0, samples) < 0);
+    CHECK(errno == ENOENT);
+
+    // Concurrent writers never take the same slot
+    std::vector<std::thread> writers;
+    std::atomic<int>         failures{0};
+    for (int t = 1; t <= 2; t++) {
+        writers.emplace_back([t, &failures] {
+            for (int i = 0; i < 2; i++) {
+                if (fty::shm::write_metric("shared", "metric", std::to_string(t * 100 + i), "W", 10) != 0)
+                    failures++;
+            }
+        });
+    }
+    for (auto& writer : writers)
+        writer.join();
+    CHECK(failures == 0);
+    REQUIRE(fty::shm::read_metric_history("shared", "metric", 0, samples) == 0);
+    CHECK(samples.size() == 4);
+
+    // A write reads the header of the history only
+    fty::shm::ProcessStats before, after;
+    fty::shm::get_stats(before);
+    REQUIRE(fty::shm::write_metric("shared", "metric", "42", "W", 10) == 0);
+    fty::shm::get_stats(after);
+    REQUIRE(fty::shm::read_metric_history("shared", "metric", 0, samples) == 0);
+    CHECK(samples.size() == 5);
+    CHECK(samples[4].value == 42);
+    CHECK(stat_value(after, "bytes_read") == stat_value(before, "bytes_read") + 32);
+
+    // The other families have no history
+    fty::shm::FamilyPolicy policy;
+    REQUIRE(fty::shm::set_family_policy("other", policy) == 0);
+    REQUIRE(fty::shm::Family("other").write_metric("asset", "metric", "1", "W", 10) == 0);
+    CHECK(access(SELFTEST_RW "/other/.history", F_OK) < 0);
+
+    fty_shm_delete_test_dir();
+    unsetenv("FTY_SHM_HISTORY");
+}
+
+TEST_CASE("shm aggregate")
+{
+    std::vector<fty::shm::Aggregate> result;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    for (int i = 1; i <= 10; i++) {
+        std::string asset = "ups-" + std::to_string(i);
+        REQUIRE(fty::shm::write_metric(asset, "realpower.output", std::to_string(i * 100), "W", 0) == 0);
+        REQUIRE(fty::shm::write_metric(asset, "load", std::to_string(i) + ".5", "%", 0) == 0);
+    }
+    REQUIRE(fty::shm::write_metric("ups-11", "realpower.output", "n/a", "W", 0) == 0);
+    REQUIRE(fty::shm::write_metric("epdu-1", "realpower.output", "12345", "W", 0) == 0);
+
+    REQUIRE(fty::shm::aggregate_metrics("ups-.*", "realpower.output", fty::shm::AGG_ALL, result) == 0);
+    REQUIRE(result.size() == 1);
+    CHECK(result[0].metric.empty());
+    CHECK(result[0].count == 10);
+    CHECK(result[0].skipped == 1);
+    CHECK(result[0].sum == 5500);
+    CHECK(result[0].min == 100);
+    CHECK(result[0].max == 1000);
+    CHECK(result[0].mean == 550);
+
+    REQUIRE(fty::shm::aggregate_metrics("ups-.*", ".*", fty::shm::AGG_SUM | fty::shm::AGG_MAX, result, true) == 0);
+    REQUIRE(result.size() == 2);
+    CHECK(result[0].metric == "load");
+    CHECK(result[0].count == 10);
+    CHECK(result[0].sum == 60);
+    CHECK(result[0].max == 10.5);
+    CHECK(std::isnan(result[0].min));
+    CHECK(std::isnan(result[0].mean));
+    CHECK(result[1].metric == "realpower.output");
+    CHECK(result[1].sum == 5500);
+
+    REQUIRE(fty::shm::aggregate_metrics("nothing", ".*", fty::shm::AGG_ALL, result) == 0);
+    REQUIRE(result.size() == 1);
+    CHECK(result[0].count == 0);
+    CHECK(std::isnan(result[0].sum));
+    CHECK(fty::shm::aggregate_metrics("(", ".*", fty::shm::AGG_ALL, result) < 0);
+
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm filters")
+{
+    using fty::shm::Filter;
+
+    // Literals, prefixes, patterns and alternatives, as regex would match them
+    std::vector<std::string> names = {"", "ups-4", "ups-42", "ups-4x2", "realpower.output.L1", "realpower_output_L1",
+        "voltage.input", "ups-1", "ups-2", "ups-12", "a|b", "a.b"};
+    std::vector<std::string> patterns = {".*", "ups-42", "ups-4.*", "ups-4.", ".*put.*", ".*L1", "realpower.output.L1",
+        "realpower\\.output\\.L1", "ups-1|ups-2", "(ups-1|ups-2)", "(?:ups-12|voltage\\.input)", "a\\|b", "a.*b.*L.",
+        "", "ups-[0-9]+", "(^asset|other)((?!2).)*", "ups-4x?2", ".*.*", "ups-4.*2.*"};
+    for (auto& pattern : patterns) {
+        std::regex regex(pattern);
+        Filter     filter(pattern);
+        REQUIRE(filter.valid());
+        CHECK(filter.pattern() == pattern);
+        for (auto& name : names) {
+            INFO(pattern << " " << name);
+            CHECK(filter.match(name) == std::regex_match(name, regex));
+        }
+    }
+    CHECK(!Filter("(").valid());
+    CHECK(!Filter("(").match("("));
+    CHECK(Filter().match("anything"));
+
+    CHECK(Filter::glob("ups-*").match("ups-42"));
+    CHECK(!Filter::glob("ups-*").match("epdu-1"));
+    CHECK(Filter::glob("*.L?").match("realpower.output.L1"));
+    CHECK(!Filter::glob("*.L?").match("realpower.output.L12"));
+    CHECK(Filter::glob("ups-[13]").match("ups-3"));
+    CHECK(!Filter::glob("ups-[13]").match("ups-2"));
+    CHECK(Filter::glob("a\\*").match("a*"));
+    CHECK(!Filter::glob("a\\*").match("ab"));
+
+    Filter set = Filter::names({"ups-1", "ups-2"});
+    CHECK(set.match("ups-1"));
+    CHECK(!set.match("ups-12"));
+    CHECK(!set.match("ups-"));
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    REQUIRE(fty::shm::write_metric("ups-1", "load", "1", "%", 0) == 0);
+    REQUIRE(fty::shm::write_metric("ups-2", "load", "2", "%", 0) == 0);
+    REQUIRE(fty::shm::write_metric("ups-3", "load", "3", "%", 0) == 0);
+    REQUIRE(fty::shm::write_metric("ups-3", "realpower", "3", "W", 0) == 0);
+    {
+        fty::shm::shmMetrics result;
+        REQUIRE(fty::shm::read_metrics(Filter::names({"ups-1", "ups-3"}), Filter::glob("l*"), result) == 0);
+        CHECK(result.size() == 2);
+    }
+    {
+        int count = 0;
+        REQUIRE(fty::shm::read_metrics(Filter::glob("ups-?"), Filter(), [&count](fty_proto_t*) {
+            count++;
+            return true;
+        }) == 0);
+        CHECK(count == 4);
+    }
+    fty_shm_delete_test_dir();
+}
+
+static int count_views(const fty_shm_metric_view_t* metric, void* arg)
+{
+    int* count = static_cast<int*>(arg);
+    CHECK(strcmp(metric->unit, "%") == 0);
+    (*count)++;
+    return *count == 2;
+}
+
+TEST_CASE("shm for each metric")
+{
+    std::map<std::string, std::string> seen;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    REQUIRE(fty::shm::write_metric("ups-1", "load", "10", "%", 60) == 0);
+    REQUIRE(fty::shm::write_metric("ups-2", "load", "20", "%", 0) == 0);
+    REQUIRE(fty::shm::write_metric("ups-2", "realpower", "30", "W", 0) == 0);
+    fty_proto_t* bundled = fty_proto_new(FTY_PROTO_METRIC);
+    fty_proto_set_name(bundled, "%s", "ups-3");
+    fty_proto_set_type(bundled, "%s", "load");
+    fty_proto_set_value(bundled, "%s", "40");
+    fty_proto_set_unit(bundled, "%s", "%");
+    fty_proto_set_ttl(bundled, 0);
+    REQUIRE(fty::shm::write_metrics({bundled}, true) == 0);
+    fty_proto_destroy(&bundled);
+
+    REQUIRE(fty::shm::for_each_metric("ups-.*", "load", [&seen](const fty::shm::MetricView& metric) {
+        seen[metric.asset] = metric.value;
+        CHECK(strcmp(metric.metric, "load") == 0);
+        CHECK(metric.time != 0);
+        if (strcmp(metric.asset, "ups-1") == 0)
+            CHECK(metric.ttl == 60);
+        return true;
+    }) == 0);
+    CHECK(seen == std::map<std::string, std::string>{{"ups-1", "10"}, {"ups-2", "20"}, {"ups-3", "40"}});
+
+    // The C callback stops the scan by returning non-zero
+    int count = 0;
+    REQUIRE(fty_shm_for_each_metric(".*", "load", count_views, &count) == 0);
+    CHECK(count == 2);
+    CHECK(fty_shm_for_each_metric("(", ".*", count_views, &count) < 0);
+
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm skip unchanged writes")
+{
+    std::string            value;
+    struct stat            first, second;
+    fty::shm::ProcessStats before, after;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    std::string filename = std::string(SELFTEST_RW) + "/" FTY_SHM_METRIC_TYPE "/load@ups";
+
+    REQUIRE(fty::shm::write_metric("ups", "load", "42", "%", 60) == 0);
+    REQUIRE(stat(filename.c_str(), &first) == 0);
+
+    // The same record again only moves the mtime forward, still notified
+    fty::shm::Watcher watcher;
+    REQUIRE(watcher.open() == 0);
+    fty::shm::get_stats(before);
+    REQUIRE(fty::shm::write_metric("ups", "load", "42", "%", 60) == 0);
+    fty::shm::get_stats(after);
+    int notified = 0;
+    watcher.dispatch([&](const std::string& asset, const std::string& metric, bool removed) {
+        if (asset == "ups" && metric == "load" && !removed)
+            notified++;
+    });
+    CHECK(notified == 1);
+    REQUIRE(stat(filename.c_str(), &second) == 0);
+    CHECK(stat_value(after, "write_unchanged") == stat_value(before, "write_unchanged") + 1);
+    CHECK(stat_value(after, "write") == stat_value(before, "write"));
+    CHECK(second.st_ino == first.st_ino);
+    CHECK((second.st_mtim.tv_sec > first.st_mtim.tv_sec ||
+           (second.st_mtim.tv_sec == first.st_mtim.tv_sec && second.st_mtim.tv_nsec > first.st_mtim.tv_nsec)));
+    REQUIRE(fty::shm::read_metric_value("ups", "load", value) == 0);
+    CHECK(value == "42");
+
+    // A change of value, unit or ttl is written
+    REQUIRE(fty::shm::write_metric("ups", "load", "42", "%", 30) == 0);
+    REQUIRE(fty::shm::write_metric("ups", "load", "43", "%", 30) == 0);
+    REQUIRE(fty::shm::read_metric_value("ups", "load", value) == 0);
+    CHECK(value == "43");
+
+    // So is a file written by someone else since
+    FILE* file = fopen(filename.c_str(), "w");
+    REQUIRE(file);
+    fputs("0000000030\n%\n44", file);
+    fclose(file);
+    fty::shm::get_stats(before);
+    REQUIRE(fty::shm::write_metric("ups", "load", "43", "%", 30) == 0);
+    fty::shm::get_stats(after);
+    CHECK(stat_value(after, "write") == stat_value(before, "write") + 1);
+    REQUIRE(fty::shm::read_metric_value("ups", "load", value) == 0);
+    CHECK(value == "43");
+
+    // The temporary files of the longest names fit in NAME_MAX too
+    std::string long_metric(NAME_MAX - strlen("@ups"), 'm');
+    REQUIRE(fty::shm::write_metric("ups", long_metric, "1", "%", 60) == 0);
+    REQUIRE(fty::shm::write_metric("ups", long_metric, "2", "%", 60) == 0);
+    REQUIRE(fty::shm::read_metric_value("ups", long_metric, value) == 0);
+    CHECK(value == "2");
+
+    // Without the cache, every write is done
+    fty_shm_delete_test_dir();
+    setenv("FTY_SHM_SKIP_UNCHANGED", "OFF", 1);
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    REQUIRE(fty::shm::write_metric("ups", "load", "42", "%", 60) == 0);
+    fty::shm::get_stats(before);
+    REQUIRE(fty::shm::write_metric("ups", "load", "42", "%", 60) == 0);
+    fty::shm::get_stats(after);
+    CHECK(stat_value(after, "write") == stat_value(before, "write") + 1);
+
+    fty_shm_delete_test_dir();
+    unsetenv("FTY_SHM_SKIP_UNCHANGED");
+}
+
+TEST_CASE("shm families")
+{
+    std::string              value;
+    std::vector<std::string> families;
+    fty::shm::FamilyPolicy   policy;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+
+    fty::shm::Family inventory("inventory");
+    policy.max_ttl = 3600;
+    policy.publish = false;
+    policy.cleanup = false;
+    REQUIRE(fty::shm::set_family_policy("inventory", policy) == 0);
+    REQUIRE(fty::shm::get_family_policy("inventory", policy) == 0);
+    CHECK(policy.max_ttl == 3600);
+    CHECK(!policy.publish);
+    CHECK(!policy.cleanup);
+    REQUIRE(fty::shm::get_family_policy(FTY_SHM_METRIC_TYPE, policy) == 0);
+    CHECK(policy.max_ttl == 0);
+    CHECK(policy.publish);
+
+    // The families are kept apart
+    REQUIRE(inventory.write_metric("ups", "serial", "ABC123", "", 0) == 0);
+    REQUIRE(fty::shm::write_metric("ups", "load", "42", "%", 0) == 0);
+    REQUIRE(inventory.read_metric_value("ups", "serial", value) == 0);
+    CHECK(value == "ABC123");
+    CHECK(fty::shm::read_metric_value("ups", "serial", value) < 0);
+    CHECK(inventory.read_metric_value("ups", "load", value) < 0);
+    {
+        fty::shm::shmMetrics result;
+        REQUIRE(inventory.read_metrics(fty::shm::Filter(), fty::shm::Filter(), result) == 0);
+        REQUIRE(result.size() == 1);
+        // The infinite ttl is cut to the retention of the family
+        CHECK(fty_proto_ttl(result.get(0)) == 3600);
+    }
+    {
+        fty::shm::shmMetrics result;
+        REQUIRE(fty::shm::Family("*").read_metrics(fty::shm::Filter(), fty::shm::Filter(), result) == 0);
+        CHECK(result.size() == 2);
+    }
+    int count = 0;
+    REQUIRE(fty::shm::Family("*").for_each_metric(fty::shm::Filter(), fty::shm::Filter(),
+                [&count](const fty::shm::MetricView&) {
+                    count++;
+                    return true;
+                }) == 0);
+    CHECK(count == 2);
+
+    REQUIRE(fty::shm::list_families(families) == 0);
+    CHECK(std::find(families.begin(), families.end(), "inventory") != families.end());
+    CHECK(std::find(families.begin(), families.end(), FTY_SHM_METRIC_TYPE) != families.end());
+
+    CHECK(fty::shm::Family("*").write_metric("ups", "load", "1", "%", 0) < 0);
+    CHECK(!fty::shm::Family(".hidden").valid());
+    CHECK(fty::shm::set_family_policy("a/b", policy) < 0);
+
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm families update log")
+{
+    fty::shm::UpdateLogReader reader;
+    fty::shm::MetricUpdate    update;
+    fty::shm::FamilyPolicy    policy;
+    const int                 rounds = 500;
+
+    setenv("FTY_SHM_UPDATE_LOG", "ON", 1);
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    REQUIRE(fty::shm::set_family_policy("alpha", policy) == 0);
+    REQUIRE(fty::shm::set_family_policy("beta", policy) == 0);
+    REQUIRE(reader.open() == 0);
+
+    // Writes to several families at once, only the default one is logged
+    std::vector<std::thread> threads;
+    for (const char* family : {"alpha", "beta", FTY_SHM_METRIC_TYPE}) {
+        threads.emplace_back([family]() {
+            fty::shm::Family writer(family);
+            for (int i = 0; i < rounds; i++)
+                writer.write_metric("ups", "load", std::to_string(i), "%", 60);
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    int count = 0;
+    while (reader.next(update) == 1)
+        count++;
+    CHECK(count + int(reader.lost()) == rounds);
+    CHECK(update.value == std::to_string(rounds - 1));
+    CHECK(access(SELFTEST_RW "/alpha/.updates", F_OK) < 0);
+    CHECK(access(SELFTEST_RW "/beta/.updates", F_OK) < 0);
+
+    fty_shm_delete_test_dir();
+    unsetenv("FTY_SHM_UPDATE_LOG");
+}
+
+TEST_CASE("shm conditional write")
+{
+    uint64_t    version;
+    std::string value;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+    fty_proto_set_name(metric, "ups");
+    fty_proto_set_type(metric, "load");
+    fty_proto_set_unit(metric, "%s", "%");
+    fty_proto_set_ttl(metric, 60);
+    fty_proto_aux_insert(metric, "source", "%s", "collector-1");
+
+    // Newer versions only
+    fty_proto_set_value(metric, "10");
+    REQUIRE(fty::shm::write_metric_if_newer(metric, 100) == 0);
+    fty_proto_set_value(metric, "9");
+    CHECK(fty::shm::write_metric_if_newer(metric, 99) < 0);
+    CHECK(errno == ECANCELED);
+    CHECK(fty::shm::write_metric_if_newer(metric, 100) < 0);
+    // The swap of the files is notified as an update
+    fty::shm::Watcher watcher;
+    REQUIRE(watcher.open() == 0);
+    fty_proto_set_value(metric, "11");
+    REQUIRE(fty::shm::write_metric_if_newer(metric, 101) == 0);
+    REQUIRE(fty::shm::read_metric_version("ups", "load", version) == 0);
+    CHECK(version == 101);
+    int updated = 0, removed = 0;
+    watcher.dispatch([&](const std::string& asset, const std::string& name, bool gone) {
+        if (asset == "ups" && name == "load")
+            (gone ? removed : updated)++;
+    });
+    CHECK(updated > 0);
+    CHECK(removed == 0);
+
+    // The version is stored as the first aux pair, for the older readers, but
+    // it is not part of the metric
+    FILE* file = fopen(SELFTEST_RW "/" FTY_SHM_METRIC_TYPE "/load@ups", "r");
+    REQUIRE(file);
+    char text[256] = "";
+    CHECK(fread(text, 1, sizeof(text) - 1, file) > 0);
+    fclose(file);
+    CHECK(strstr(text, "\n11\n__fty_shm_version\n+00000000000000000101\nsource\ncollector-1") != nullptr);
+    fty_proto_t* read = nullptr;
+    REQUIRE(fty::shm::read_metric("ups", "load", &read) == 0);
+    CHECK(std::string(fty_proto_value(read)) == "11");
+    CHECK(std::string(fty_proto_aux_string(read, "source", "")) == "collector-1");
+    CHECK(zhash_size(fty_proto_aux(read)) == 1);
+    fty_proto_destroy(&read);
+
+    // Compare and swap on the version
+    CHECK(fty::shm::compare_and_write_metric(metric, 100) < 0);
+    CHECK(errno == ECANCELED);
+    REQUIRE(fty::shm::compare_and_write_metric(metric, 101) == 0);
+    REQUIRE(fty::shm::read_metric_version("ups", "load", version) == 0);
+    CHECK(version == 102);
+
+    // The claim left by a killed writer is taken over once outdated
+    struct stat st;
+    std::string family_dir(SELFTEST_RW "/" FTY_SHM_METRIC_TYPE);
+    REQUIRE(stat((family_dir + "/load@ups").c_str(), &st) == 0);
+    std::string claim = family_dir + "/.load@ups.claim." + std::to_string(st.st_ino) + ".102";
+    file = fopen(claim.c_str(), "w");
+    REQUIRE(file);
+    fclose(file);
+    CHECK(fty::shm::compare_and_write_metric(metric, 102) < 0);
+    CHECK(errno == ECANCELED);
+    struct timespec outdated[2] = {{time(nullptr) - 60, 0}, {time(nullptr) - 60, 0}};
+    REQUIRE(utimensat(AT_FDCWD, claim.c_str(), outdated, 0) == 0);
+    REQUIRE(fty::shm::compare_and_write_metric(metric, 102) == 0);
+    CHECK(access(claim.c_str(), F_OK) < 0);
+    REQUIRE(fty::shm::read_metric_version("ups", "load", version) == 0);
+    CHECK(version == 103);
+
+    // An unconditional write has no version
+    REQUIRE(fty::shm::write_metric("ups", "load", "12", "%", 60) == 0);
+    REQUIRE(fty::shm::read_metric_version("ups", "load", version) == 0);
+    CHECK(version == 0);
+    REQUIRE(fty::shm::compare_and_write_metric(metric, 0) == 0);
+    CHECK(fty::shm::read_metric_version("ups", "nothing", version) < 0);
+    fty_proto_destroy(&metric);
+
+    // Concurrent increments: every successful compare and swap counts once
+    const int                writers = 4, rounds = 200;
+    std::atomic<int>         successes{0}, errors{0};
+    std::vector<std::thread> threads;
+    for (int w = 0; w < writers; w++) {
+        threads.emplace_back([&successes, &errors]() {
+            fty_proto_t* counter = fty_proto_new(FTY_PROTO_METRIC);
+            fty_proto_set_name(counter, "ups");
+            fty_proto_set_type(counter, "counter");
+            fty_proto_set_unit(counter, "");
+            for (int i = 0; i < rounds; i++) {
+                uint64_t current = 0;
+                fty::shm::read_metric_version("ups", "counter", current);
+                fty_proto_set_value(counter, "%" PRIu64, current + 1);
+                if (fty::shm::compare_and_write_metric(counter, current) == 0)
+                    successes++;
+                else if (errno != ECANCELED)
+                    errors++;
+            }
+            fty_proto_destroy(&counter);
+        });
+    }
+    // Concurrent timestamps: the most recent one stays
+    for (int w = 0; w < writers; w++) {
+        threads.emplace_back([w]() {
+            fty_proto_t* sample = fty_proto_new(FTY_PROTO_METRIC);
+            fty_proto_set_name(sample, "ups");
+            fty_proto_set_type(sample, "sample");
+            fty_proto_set_unit(sample, "");
+            for (int i = 1; i <= rounds; i++) {
+                uint64_t stamp = uint64_t(i * writers + w);
+                fty_proto_set_value(sample, "%" PRIu64, stamp);
+                fty::shm::write_metric_if_newer(sample, stamp);
+            }
+            fty_proto_destroy(&sample);
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    CHECK(errors == 0);
+    REQUIRE(fty::shm::read_metric_version("ups", "counter", version) == 0);
+    CHECK(version == uint64_t(successes.load()));
+    REQUIRE(fty::shm::read_metric_value("ups", "counter", value) == 0);
+    CHECK(value == std::to_string(version));
+    REQUIRE(fty::shm::read_metric_version("ups", "sample", version) == 0);
+    CHECK(version == uint64_t(rounds * writers + writers - 1));
+    REQUIRE(fty::shm::read_metric_value("ups", "sample", value) == 0);
+    CHECK(value == std::to_string(version));
+
+    // Both kinds on one metric: a compare and swap never puts back an older
+    // version than a successful write_metric_if_newer()
+    std::atomic<uint64_t> newest{0};
+    threads.clear();
+    for (int w = 0; w < writers; w++) {
+        threads.emplace_back([w, &newest]() {
+            fty_proto_t* mixed = fty_proto_new(FTY_PROTO_METRIC);
+            fty_proto_set_name(mixed, "ups");
+            fty_proto_set_type(mixed, "mixed");
+            fty_proto_set_unit(mixed, "");
+            for (int i = 1; i <= rounds; i++) {
+                uint64_t next = 0;
+                if (w % 2) {
+                    next = uint64_t(i * writers + w) * 2;
+                    fty_proto_set_value(mixed, "%" PRIu64, next);
+                    if (fty::shm::write_metric_if_newer(mixed, next) < 0)
+                        continue;
+                    for (uint64_t seen = newest; seen < next && !newest.compare_exchange_weak(seen, next);)
+                        ;
+                } else {
+                    fty::shm::read_metric_version("ups", "mixed", next);
+                    fty_proto_set_value(mixed, "%" PRIu64, next + 1);
+                    fty::shm::compare_and_write_metric(mixed, next);
+                }
+            }
+            fty_proto_destroy(&mixed);
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    REQUIRE(fty::shm::read_metric_version("ups", "mixed", version) == 0);
+    CHECK(version >= newest);
+    REQUIRE(fty::shm::read_metric_value("ups", "mixed", value) == 0);
+    CHECK(value == std::to_string(version));
+
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm batched publish")
+{
+    fty::shm::ProcessStats before, after;
+    auto                   bus = std::make_shared<fty::shm::MockPublishBus>(false);
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    fty::shm::set_publish_bus(bus);
+    std::vector<fty_proto_t*> metrics;
+    for (int i = 0; i < 5; i++) {
+        fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+        fty_proto_set_name(metric, i < 3 ? "ups-1" : "ups-2");
+        fty_proto_set_type(metric, "metric-%d", i);
+        fty_proto_set_value(metric, "%d", i);
+        fty_proto_set_unit(metric, "V");
+        fty_proto_set_ttl(metric, 60);
+        metrics.push_back(metric);
+    }
+
+    // One message per metric by default
+    REQUIRE(fty::shm::flush(1000) == 0);
+    fty::shm::get_stats(before);
+    REQUIRE(fty::shm::write_metrics(metrics) == 0);
+    REQUIRE(fty::shm::flush(1000) == 0);
+    fty::shm::get_stats(after);
+    CHECK(stat_value(after, "publish") == stat_value(before, "publish") + 5);
+    CHECK(stat_value(after, "publish_batched") == stat_value(before, "publish_batched"));
+
+    // One message per asset of a batch write
+    fty::shm::set_publish_mode(fty::shm::PUBLISH_ASSET, 0);
+    for (bool bundle : {false, true}) {
+        fty::shm::get_stats(before);
+        REQUIRE(fty::shm::write_metrics(metrics, bundle) == 0);
+        REQUIRE(fty::shm::flush(1000) == 0);
+        fty::shm::get_stats(after);
+        CHECK(stat_value(after, "publish") == stat_value(before, "publish") + 2);
+        CHECK(stat_value(after, "publish_batched") == stat_value(before, "publish_batched") + 5);
+    }
+
+    // Single writes within the window, the last write of a metric wins
+    fty::shm::set_publish_mode(fty::shm::PUBLISH_ASSET, 100);
+    fty::shm::get_stats(before);
+    REQUIRE(fty::shm::write_metric("ups-3", "load", "1", "%", 60) == 0);
+    REQUIRE(fty::shm::write_metric("ups-3", "load", "2", "%", 60) == 0);
+    REQUIRE(fty::shm::write_metric("ups-3", "realpower", "100", "W", 60) == 0);
+    fty::shm::get_stats(after);
+    zclock_sleep(20);
+    fty::shm::get_stats(after);
+    CHECK(stat_value(after, "publish") == stat_value(before, "publish"));
+    zclock_sleep(500);
+    REQUIRE(fty::shm::flush(1000) == 0);
+    fty::shm::get_stats(after);
+    CHECK(stat_value(after, "publish") == stat_value(before, "publish") + 1);
+    CHECK(stat_value(after, "publish_batched") == stat_value(before, "publish_batched") + 2);
+
+    // Both for the subscribers of either
+    fty::shm::set_publish_mode(fty::shm::PUBLISH_BOTH, 0);
+    fty::shm::get_stats(before);
+    REQUIRE(fty::shm::write_metric("ups-3", "load", "3", "%", 60) == 0);
+    REQUIRE(fty::shm::flush(1000) == 0);
+    fty::shm::get_stats(after);
+    CHECK(stat_value(after, "publish") == stat_value(before, "publish") + 2);
+    CHECK(bus->count() == 5 + 2 + 2 + 1 + 2);
+
+    for (auto metric : metrics)
+        fty_proto_destroy(&metric);
+    fty::shm::set_publish_bus(nullptr);
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm publisher lifecycle")
+{
+    fty::shm::ProcessStats before, after;
+    auto accounted = [](const fty::shm::ProcessStats& stats) {
+        return stat_value(stats, "publish") + stat_value(stats, "publish_send_error") +
+               stat_value(stats, "publish_dropped");
+    };
+
+    auto bus = std::make_shared<fty::shm::MockPublishBus>(false);
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    fty::shm::set_publish_bus(bus);
+    REQUIRE(fty_shm_init() == 0);
+    REQUIRE(fty_shm_flush(0) == 0);
+
+    // The writes only queue their messages
+    fty::shm::get_stats(before);
+    int64_t start = zclock_mono();
+    for (int i = 0; i < 10; i++)
+        REQUIRE(fty_shm_write_metric("ups-1", "load", std::to_string(i).c_str(), "%", 60) == 0);
+    CHECK(zclock_mono() - start < 1000);
+
+    // Each one is sent by the shutdown, within its timeout
+    start = zclock_mono();
+    CHECK(fty::shm::shutdown(200) == 0);
+    CHECK(zclock_mono() - start < 2000);
+    fty::shm::get_stats(after);
+    CHECK(accounted(after) == accounted(before) + 10);
+    CHECK(stat_value(after, "publish_dropped") == stat_value(before, "publish_dropped"));
+    CHECK(bus->count() == 10);
+
+    // Started again by the next write
+    fty::shm::get_stats(before);
+    REQUIRE(fty_shm_write_metric("ups-1", "load", "10", "%", 60) == 0);
+    CHECK(fty_shm_shutdown() == 0);
+    fty::shm::get_stats(after);
+    CHECK(accounted(after) == accounted(before) + 1);
+    CHECK(bus->count() == 11);
+
+    // A thread blocked on the bus doesn't hold the shutdown past its timeout
+    struct BlockingBus : fty::shm::PublishBus
+    {
+        std::atomic<bool> entered{false}, released{false};
+        int               connect(std::string&) override
+        {
+            return 0;
+        }
+        int send(const std::string&, const std::string&, std::string&) override
+        {
+            entered = true;
+            while (!released)
+                zclock_sleep(10);
+            return 0;
+        }
+    };
+    auto blocking = std::make_shared<BlockingBus>();
+    fty::shm::set_publish_bus(blocking);
+    REQUIRE(fty_shm_write_metric("ups-1", "load", "11", "%", 60) == 0);
+    while (!blocking->entered)
+        zclock_sleep(10);
+    start = zclock_mono();
+    CHECK(fty::shm::shutdown(100) < 0);
+    CHECK(errno == ETIMEDOUT);
+    CHECK(zclock_mono() - start < 1000);
+    blocking->released = true;
+    fty::shm::set_publish_bus(nullptr);
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm publish bus")
+{
+    auto bus = std::make_shared<fty::shm::MockPublishBus>();
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    fty::shm::set_publish_bus(bus);
+    REQUIRE(fty::shm::write_metric("ups-1", "load", "42", "%", 60) == 0);
+    REQUIRE(fty::shm::flush(1000) == 0);
+    auto messages = bus->messages();
+    REQUIRE(messages.size() == 1);
+    CHECK(messages[0].topic == "/etn/metrics/ups-1/load");
+    CHECK(messages[0].payload.find("\"42\"") != std::string::npos);
+
+    bus->clear();
+    fty::shm::set_publish_mode(fty::shm::PUBLISH_ASSET, 0);
+    REQUIRE(fty::shm::write_metric("ups-1", "load", "43", "%", 60) == 0);
+    REQUIRE(fty::shm::flush(1000) == 0);
+    messages = bus->messages();
+    REQUIRE(messages.size() == 1);
+    CHECK(messages[0].topic == "/etn/metrics/ups-1");
+
+    // Only counted
+    auto counter = std::make_shared<fty::shm::MockPublishBus>(false);
+    fty::shm::set_publish_bus(counter);
+    REQUIRE(fty::shm::write_metric("ups-1", "load", "44", "%", 60) == 0);
+    REQUIRE(fty::shm::flush(1000) == 0);
+    CHECK(counter->count() == 1);
+    CHECK(counter->messages().empty());
+    CHECK(bus->count() == 1);
+
+    fty::shm::set_publish_bus(nullptr);
+    fty_shm_delete_test_dir();
+}
+
+TEST_CASE("shm local transport")
+{
+    fty::shm::MetricUpdate update;
+    fty::shm::LocalSubscriber all, loads;
+
+    REQUIRE(fty_shm_set_test_dir(SELFTEST_RW) == 0);
+    fty::shm::set_publish_transport(fty::shm::TRANSPORT_LOCAL);
+    REQUIRE(all.open() == 0);
+    REQUIRE(loads.open("ups-.*", "load") == 0);
+    CHECK(all.next(update) == 0);
+    CHECK(all.wait(0) == 0);
+
+    REQUIRE(fty::shm::write_metric("ups-1", "load", "42", "%", 60) == 0);
+    REQUIRE(fty::shm::write_metric("ups-1", "realpower", "100", "W", 0) == 0);
+    REQUIRE(fty::shm::write_metric("epdu-1", "load", "7", "%", 60) == 0);
+
+    REQUIRE(all.wait(1000) == 1);
+    REQUIRE(all.next(update) == 1);
+    CHECK(update.asset == "ups-1");
+    CHECK(update.metric == "load");
+    CHECK(update.value == "42");
+    CHECK(update.unit == "%");
+    CHECK(update.ttl == 60);
+    CHECK(update.time != 0);
+    CHECK(!update.truncated);
+    REQUIRE(all.next(update) == 1);
+    CHECK(update.metric == "realpower");
+    REQUIRE(all.next(update) == 1);
+    CHECK(update.asset == "epdu-1");
+    CHECK(all.next(update) == 0);
+
+    // Only what matches the filters
+    REQUIRE(loads.next(update) == 1);
+    CHECK(update.asset == "ups-1");
+    CHECK(update.value == "42");
+    CHECK(loads.next(update) == 0);
+
+    // A closed subscriber gets nothing more, the others go on
+    loads.close();
+    CHECK(loads.next(update) < 0);
+    REQUIRE(fty::shm::write_metric("ups-2", "load", "1", "%", 60) == 0);
+    REQUIRE(all.next(update) == 1);
+    CHECK(update.asset == "ups-2");
+
+    // A subscriber gone without closing is dropped by the writers
+    fty::shm::ProcessStats before, after;
+    std::string            orphan = std::string(SELFTEST_RW) + "/.subscribers/orphan";
+    {
+        int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        REQUIRE(fd >= 0);
+        struct sockaddr_un addr = {};
+        addr.sun_family         = AF_UNIX;
+        strcpy(addr.sun_path, orphan.c_str());
+        REQUIRE(bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) == 0);
+        close(fd);
+        FILE* filter = fopen((orphan + ".filter").c_str(), "w");
+        REQUIRE(filter);
+        fputs(".*\n.*\n", filter);
+        fclose(filter);
+    }
+    fty::shm::get_stats(before);
+    REQUIRE(fty::shm::write_metric("ups-2", "load", "2", "%", 60) == 0);
+    fty::shm::get_stats(after);
+    CHECK(stat_value(after, "publish_local") == stat_value(before, "publish_local") + 1);
+    CHECK(access(orphan.c_str(), F_OK) < 0);
+    REQUIRE(all.next(update) == 1);
+    CHECK(update.value == "2");
+
+    CHECK(loads.open("(", ".*") < 0);
+    all.close();
+    fty_shm_delete_test_dir();
+}
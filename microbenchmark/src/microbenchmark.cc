@@ -0,0 +1,508 @@
+/*  =========================================================================
+    microbenchmark - fty-shm internals microbenchmark
+
+    Copyright (C) 2018 - 2020 Eaton
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program; if not, write to the Free Software Foundation, Inc.,
+    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+    =========================================================================
+*/
+
+/*
+@header
+    microbenchmark - fty-shm internals microbenchmark
+@discuss
+    Measure the building blocks of the library one by one, against a
+    storage directory which should live on a tmpfs (default /dev/shm).
+@end
+*/
+
+#include "fty_shm.h"
+#include "fty_shm_internal.h"
+#include "publisher.h"
+#include <chrono>
+#include <getopt.h>
+#include <iomanip>
+#include <iostream>
+#include <limits.h>
+#include <map>
+#include <regex>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#define DEFAULT_BENCH_DIR "/dev/shm/fty-shm-microbench"
+
+static const char help_text[] =
+    "microbenchmark [options] ...\n"
+    "  -d, --directory=DIR   set the storage directory (default " DEFAULT_BENCH_DIR ")\n"
+    "  -c, --clean           clean and delete the storage directory at the end\n"
+    "  -n, --iterations=N    number of iterations of each benchmark (default 100000)\n"
+    "  -b, --benchmark=NAME  select benchmark to run (use -b help for a list, default all)\n"
+    "  -h, --help            display this help text and exit\n";
+
+#define NUM_NAMES 10000
+
+#define BENCH_ASSET  "ups-42"
+#define BENCH_METRIC "realpower.output.L1"
+
+// Keep the compiler from optimizing the measured calls away
+static volatile size_t sink;
+
+class MicroBenchmark
+{
+public:
+    MicroBenchmark()
+        : iterations(100000)
+    {
+    }
+    typedef void (MicroBenchmark::*benchmark_fn)();
+    void prepare_filename_bench();
+    void parse_ttl_bench();
+    void read_data_metric_bench();
+    void write_metric_file_bench();
+    void metric2json_bench();
+    void regex_match_bench();
+    void bundle_bench();
+    void async_read_bench();
+    void read_cache_bench();
+    void aggregate_bench();
+    void local_publish_bench();
+    int  iterations;
+
+private:
+    typedef std::chrono::steady_clock clock;
+    void                              report(const std::string& name, const clock::time_point& start, long count);
+    fty_proto_t*                      fixture_metric();
+};
+
+void MicroBenchmark::report(const std::string& name, const clock::time_point& start, long count)
+{
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
+    std::cout << std::setfill(' ') << std::left << std::setw(20) << name << std::right << std::setw(10) << count
+              << " ops " << std::setw(12) << std::fixed << std::setprecision(1) << double(elapsed) / double(count)
+              << " ns/op" << std::endl;
+}
+
+// A metric as written by the nut drivers: a few aux entries
+fty_proto_t* MicroBenchmark::fixture_metric()
+{
+    fty_proto_t* metric = fty_proto_new(FTY_PROTO_METRIC);
+    fty_proto_set_name(metric, "%s", BENCH_ASSET);
+    fty_proto_set_type(metric, "%s", BENCH_METRIC);
+    fty_proto_set_value(metric, "%s", "1234.56");
+    fty_proto_set_unit(metric, "%s", "W");
+    fty_proto_set_ttl(metric, 300);
+    fty_proto_aux_insert(metric, "port", "%s", "0");
+    fty_proto_aux_insert(metric, "sname", "%s", "ups-42");
+    fty_proto_aux_insert(metric, "x-cm-count", "%s", "1");
+    return metric;
+}
+
+void MicroBenchmark::prepare_filename_bench()
+{
+    char   filename[PATH_MAX];
+    size_t a_len = strlen(BENCH_ASSET);
+    size_t m_len = strlen(BENCH_METRIC);
+
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        prepare_filename(filename, BENCH_ASSET, a_len, BENCH_METRIC, m_len, FTY_SHM_METRIC_TYPE);
+        sink = sink + size_t(filename[0]);
+    }
+    report("prepare_filename", start, iterations);
+}
+
+void MicroBenchmark::parse_ttl_bench()
+{
+    char   buf[16];
+    time_t ttl = 0;
+
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        // parse_ttl() modifies its input
+        memcpy(buf, "0000000300\n", sizeof("0000000300\n"));
+        parse_ttl(buf, ttl);
+        sink = sink + size_t(ttl);
+    }
+    report("parse_ttl", start, iterations);
+}
+
+void MicroBenchmark::read_data_metric_bench()
+{
+    char         filename[PATH_MAX];
+    fty_proto_t* metric = fixture_metric();
+
+    prepare_filename(
+        filename, BENCH_ASSET, strlen(BENCH_ASSET), BENCH_METRIC, strlen(BENCH_METRIC), FTY_SHM_METRIC_TYPE);
+    if (write_metric_file(filename, metric) < 0) {
+        std::cerr << "Unable to write " << filename << ": " << strerror(errno) << std::endl;
+        fty_proto_destroy(&metric);
+        return;
+    }
+
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        fty_proto_t* proto_metric = fty_proto_new(FTY_PROTO_METRIC);
+        read_data_metric(filename, proto_metric);
+        fty_proto_destroy(&proto_metric);
+    }
+    report("read_data_metric", start, iterations);
+    fty_proto_destroy(&metric);
+}
+
+void MicroBenchmark::read_cache_bench()
+{
+    char         filename[PATH_MAX];
+    fty_proto_t* metric = fixture_metric();
+
+    prepare_filename(
+        filename, BENCH_ASSET, strlen(BENCH_ASSET), BENCH_METRIC, strlen(BENCH_METRIC), FTY_SHM_METRIC_TYPE);
+    if (write_metric_file(filename, metric) < 0) {
+        std::cerr << "Unable to write " << filename << ": " << strerror(errno) << std::endl;
+        fty_proto_destroy(&metric);
+        return;
+    }
+    fty_proto_destroy(&metric);
+    // Past the clock tick of the write, for the file to be cached
+    usleep(50000);
+
+    for (int mode = 0; mode < 3; mode++) {
+        fty::shm::set_read_cache(mode ? 1 << 20 : 0, mode == 2);
+        const char* name = mode == 0 ? "read uncached" : (mode == 1 ? "read cache stat" : "read cache notify");
+
+        auto start = clock::now();
+        for (int i = 0; i < iterations; i++) {
+            fty_proto_t* proto_metric = fty_proto_new(FTY_PROTO_METRIC);
+            read_data_metric(filename, proto_metric);
+            fty_proto_destroy(&proto_metric);
+        }
+        report(name, start, iterations);
+    }
+    fty::shm::set_read_cache(0);
+}
+
+void MicroBenchmark::aggregate_bench()
+{
+    fty_proto_t* metric = fixture_metric();
+    for (int i = 0; i < 1000; i++) {
+        fty_proto_set_name(metric, "ups-%d", i);
+        fty_proto_set_value(metric, "%d.5", i);
+        fty::shm::write_metric(metric);
+    }
+    fty_proto_destroy(&metric);
+
+    // What the dashboards do
+    long count = 0;
+    auto start = clock::now();
+    while (count < iterations) {
+        fty::shm::shmMetrics result;
+        fty::shm::read_metrics("ups-.*", BENCH_METRIC, result);
+        double sum = 0;
+        for (auto element : result)
+            sum += strtod(fty_proto_value(element), nullptr);
+        sink  = sink + size_t(sum);
+        count = count + long(result.size());
+    }
+    report("read_metrics + sum", start, count);
+
+    count = 0;
+    start = clock::now();
+    while (count < iterations) {
+        std::vector<fty::shm::Aggregate> result;
+        fty::shm::aggregate_metrics("ups-.*", BENCH_METRIC, fty::shm::AGG_ALL, result);
+        sink  = sink + size_t(result[0].sum);
+        count = count + long(result[0].count);
+    }
+    report("aggregate_metrics", start, count);
+
+    // The reduction alone
+    std::vector<double> values(4096);
+    for (size_t i = 0; i < values.size(); i++)
+        values[i] = double(i) * 1.5;
+    fty::shm::Aggregate aggregate;
+    start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        aggregate_column(values.data(), values.size(), fty::shm::AGG_ALL, aggregate);
+        sink = sink + size_t(aggregate.sum);
+    }
+    report("aggregate_column", start, long(iterations) * long(values.size()));
+}
+
+void MicroBenchmark::write_metric_file_bench()
+{
+    char         filename[PATH_MAX];
+    fty_proto_t* metric = fixture_metric();
+
+    prepare_filename(
+        filename, BENCH_ASSET, strlen(BENCH_ASSET), BENCH_METRIC, strlen(BENCH_METRIC), FTY_SHM_METRIC_TYPE);
+
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        write_metric_file(filename, metric);
+    }
+    report("write_metric_file", start, iterations);
+
+    // A steady metric only has its mtime refreshed
+    start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        fty::shm::write_metric(BENCH_ASSET, BENCH_METRIC, "230", "V", 60);
+    }
+    report("write unchanged", start, iterations);
+    start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        fty::shm::write_metric(BENCH_ASSET, BENCH_METRIC, std::to_string(i), "V", 60);
+    }
+    report("write changed", start, iterations);
+    fty_proto_destroy(&metric);
+}
+
+void MicroBenchmark::metric2json_bench()
+{
+    std::string  json;
+    fty_proto_t* metric = fixture_metric();
+
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        metric2JSON(metric, json);
+        sink = sink + json.size();
+    }
+    report("metric2JSON", start, iterations);
+    fty_proto_destroy(&metric);
+}
+
+// Directory entry names as seen by the scans, matched with std::regex as
+// before Filter, then with Filter
+void MicroBenchmark::regex_match_bench()
+{
+    std::vector<std::string> names;
+    names.reserve(NUM_NAMES);
+    for (int i = 0; i < NUM_NAMES; i++) {
+        names.push_back("realpower.output.L" + std::to_string(i % 100) + "@ups-" + std::to_string(i / 100));
+    }
+
+    static const std::map<std::string, std::pair<const char*, const char*>> patterns = {
+        {"regex_match .*", {".*", ".*"}}, {"regex_match literal", {"ups-42", "realpower.output.L1"}},
+        {"regex_match prefix", {"ups-4.*", "realpower.*"}},
+        {"regex_match set", {"ups-1|ups-42", "realpower.output.L1|realpower.output.L2"}}};
+
+    for (auto& pattern : patterns) {
+        std::regex regAsset(pattern.second.first);
+        std::regex regType(pattern.second.second);
+        long       count = 0;
+
+        auto start = clock::now();
+        while (count < iterations) {
+            for (auto& name : names) {
+                const char* delim = strchr(name.c_str(), '@');
+                sink              = sink + (std::regex_match(std::string(delim + 1), regAsset) &&
+                                        std::regex_match(std::string(name.c_str(), delim), regType));
+            }
+            count += NUM_NAMES;
+        }
+        report(pattern.first, start, count);
+
+        fty::shm::Filter assetFilter(pattern.second.first);
+        fty::shm::Filter typeFilter(pattern.second.second);
+        count = 0;
+        start = clock::now();
+        while (count < iterations) {
+            for (auto& name : names) {
+                const char* delim = strchr(name.c_str(), '@');
+                sink              = sink + match_metric_filename(name.c_str(), delim, assetFilter, typeFilter);
+            }
+            count += NUM_NAMES;
+        }
+        report("filter" + pattern.first.substr(strlen("regex_match")), start, count);
+    }
+}
+
+// All the metrics of a device read back, one file per metric vs one bundle
+void MicroBenchmark::bundle_bench()
+{
+    std::vector<fty_proto_t*> batch;
+    for (int i = 0; i < 100; i++) {
+        fty_proto_t* metric = fixture_metric();
+        fty_proto_set_type(metric, "realpower.output.L%d", i);
+        batch.push_back(metric);
+    }
+    for (auto metric : batch)
+        fty_proto_set_name(metric, "%s", "ups-files");
+    fty::shm::write_metrics(batch);
+    for (auto metric : batch)
+        fty_proto_set_name(metric, "%s", "ups-bundle");
+    fty::shm::write_metrics(batch, true);
+
+    for (const char* asset : {"ups-files", "ups-bundle"}) {
+        long count = 0;
+        auto start = clock::now();
+        while (count < iterations) {
+            fty::shm::read_metrics(asset, ".*", [&count](fty_proto_t*) {
+                count++;
+                return true;
+            });
+        }
+        report(std::string("read_metrics ") + asset, start, count);
+    }
+    for (auto& metric : batch)
+        fty_proto_destroy(&metric);
+}
+
+// A whole store read back synchronously, then through an AsyncReader
+void MicroBenchmark::async_read_bench()
+{
+    fty_proto_t* metric = fixture_metric();
+    for (int i = 0; i < NUM_NAMES / 10; i++) {
+        fty_proto_set_type(metric, "realpower.output.L%d", i);
+        fty::shm::write_metric(metric);
+    }
+    fty_proto_destroy(&metric);
+
+    long count = 0;
+    auto start = clock::now();
+    while (count < iterations) {
+        fty::shm::shmMetrics result;
+        fty::shm::read_metrics(".*", ".*", result);
+        count += long(result.size());
+    }
+    report("read_metrics", start, count);
+
+    fty::shm::AsyncReader reader;
+    if (reader.open() < 0) {
+        std::cerr << "Unable to set up the async reader: " << strerror(errno) << std::endl;
+        return;
+    }
+    count = 0;
+    start = clock::now();
+    while (count < iterations) {
+        reader.read_metrics(".*", ".*", [&count](fty::shm::shmMetrics& result) {
+            count += long(result.size());
+        });
+        reader.wait();
+    }
+    report(reader.async() ? "async io_uring" : "async fallback", start, count);
+}
+
+// Updates sent to a local subscriber and received, to compare with the
+// metric2JSON of each message to the broker
+void MicroBenchmark::local_publish_bench()
+{
+    fty::shm::LocalSubscriber subscriber;
+    fty::shm::MetricUpdate    update;
+    if (subscriber.open() < 0) {
+        std::cerr << "Unable to subscribe: " << strerror(errno) << std::endl;
+        return;
+    }
+
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+        publish_local("ups-1", "realpower.output.L1", "1234.5", "W", 60);
+        while (subscriber.next(update) == 1)
+            sink = sink + update.value.size();
+    }
+    report("publish_local + receive", start, iterations);
+}
+
+struct BenchmarkDesc
+{
+    MicroBenchmark::benchmark_fn func;
+    const char*                  desc;
+};
+
+std::map<std::string, BenchmarkDesc> benchmarks = {
+    {"filename", {&MicroBenchmark::prepare_filename_bench, "Benchmark prepare_filename"}},
+    {"ttl", {&MicroBenchmark::parse_ttl_bench, "Benchmark parse_ttl"}},
+    {"read", {&MicroBenchmark::read_data_metric_bench, "Benchmark read_data_metric parsing"}},
+    {"write", {&MicroBenchmark::write_metric_file_bench, "Benchmark write_metric_file, and write_metric of steady and changing values"}},
+    {"json", {&MicroBenchmark::metric2json_bench, "Benchmark metric2JSON"}},
+    {"regex", {&MicroBenchmark::regex_match_bench, "Benchmark the regex and Filter matching of the scans"}},
+    {"bundle", {&MicroBenchmark::bundle_bench, "Benchmark reading a device from metric files and from a bundle"}},
+    {"async", {&MicroBenchmark::async_read_bench, "Benchmark read_metrics against AsyncReader"}},
+    {"cache", {&MicroBenchmark::read_cache_bench, "Benchmark read_data_metric with the read cache"}},
+    {"aggregate", {&MicroBenchmark::aggregate_bench, "Benchmark summing metrics in the caller and in the library"}},
+    {"local", {&MicroBenchmark::local_publish_bench, "Benchmark the local transport of the publications"}}};
+
+int main(int argc, char** argv)
+{
+    MicroBenchmark               benchmark;
+    MicroBenchmark::benchmark_fn func   = nullptr;
+    const char*                  dir    = DEFAULT_BENCH_DIR;
+    bool                         bclean = false;
+
+    static struct option long_opts[] = {{"help", no_argument, 0, 'h'}, {"directory", required_argument, 0, 'd'},
+        {"clean", no_argument, 0, 'c'}, {"iterations", required_argument, 0, 'n'},
+        {"benchmark", required_argument, 0, 'b'}, {0, 0, 0, 0}};
+
+    int c = 0;
+    while (c >= 0) {
+        c = getopt_long(argc, argv, "hd:cn:b:", long_opts, 0);
+
+        switch (c) {
+            case 'h':
+                std::cout << help_text;
+                return 0;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'c':
+                bclean = true;
+                break;
+            case 'n':
+                benchmark.iterations = atoi(optarg);
+                if (benchmark.iterations <= 0) {
+                    std::cerr << "Invalid number of iterations: " << optarg << std::endl;
+                    return 1;
+                }
+                break;
+            case 'b': {
+                if (strcmp(optarg, "help") == 0) {
+                    std::cout << "Valid options are: " << std::endl;
+                    for (auto b : benchmarks)
+                        std::cout << b.first << " - " << b.second.desc << std::endl;
+                    return 0;
+                }
+                auto it = benchmarks.find(optarg);
+                if (it == benchmarks.end()) {
+                    std::cerr << "Unknown benchmark: " << optarg << std::endl;
+                    std::cerr << "Use -b help for a list of possible benchmark names" << std::endl;
+                    return 1;
+                }
+                func = it->second.func;
+                break;
+            }
+            case '?':
+                std::cerr << help_text;
+                return 1;
+            default:
+                // Should not happen
+                c = -1;
+        }
+    }
+
+    if (fty_shm_set_test_dir(dir) < 0) {
+        std::cerr << "Unable to use storage directory " << dir << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    if (func) {
+        (benchmark.*func)();
+    } else {
+        for (auto& b : benchmarks)
+            (benchmark.*(b.second.func))();
+    }
+    if (bclean)
+        fty_shm_delete_test_dir();
+
+    return 0;
+}